@@ -0,0 +1,114 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : bus_latency.c
+//  Description    : Times a block transfer through the bus client on its
+//                   own, without the filesystem or the cache: serial writes,
+//                   serial reads and pipelined reads (posted a window at a
+//                   time). Run it once per transport, with LC_BUS_SERVER
+//                   set to the server's TCP, unix: or shm: address, and
+//                   compare. It writes blocks 0 and 1 of sector 0 of the
+//                   first device.
+//
+//  Usage          : bus_latency [blocks per pass]
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <lcloud_controller.h>
+#include <lcloud_filesys.h>
+#include <lcloud_network.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define BENCH_PASSES 3                //Best of this many passes is printed
+#define BENCH_WINDOW 64               //Reads posted before waiting
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchNow
+// Description  : Monotonic time in seconds
+//
+// Inputs       : none
+// Outputs      : the time
+static double benchNow( void ) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : busOp
+// Description  : Sends one request and waits for its answer
+//
+// Inputs       : c0 - the opcode, c1 - the device, c2 - read or write,
+//                d0 - the sector, d1 - the block, buf - the block data
+// Outputs      : the answer registers
+static LCloudRegisterFrame busOp( uint8_t c0, uint8_t c1, uint8_t c2, uint16_t d0, uint16_t d1, void *buf ) {
+    return client_lcloud_bus_request(create_lcloud_registers(0, 0, c0, c1, c2, d0, d1), buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Powers on, times the three kinds of transfer and powers off
+//
+// Inputs       : argc - the number of arguments, argv - the arguments
+// Outputs      : 0 if successful, -1 if failure
+int main( int argc, char *argv[] ) {
+    static char blk[LC_DEVICE_BLOCK_SIZE], rd[BENCH_WINDOW][LC_DEVICE_BLOCK_SIZE];
+    int n = (argc > 1) ? atoi(argv[1]) : 20000;
+    double best[3] = { 1e9, 1e9, 1e9 }, t;
+    uint8_t b0, b1, c0, c1, c2;
+    uint16_t d0, d1;
+    int dev;
+
+    memset(blk, 'q', sizeof(blk));
+    busOp(LC_POWER_ON, 0, 0, 0, 0, NULL);
+    extract_lcloud_registers(busOp(LC_DEVPROBE, 0, 0, 0, 0, NULL), &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    if(b1 != 1 || d0 == 0) {
+        fprintf(stderr, "No devices answered the probe\n");
+        return -1;
+    }
+    dev = __builtin_ctz(d0);
+    busOp(LC_DEVINIT, dev, 0, 0, 0, NULL);
+
+    for(int p=0;p<BENCH_PASSES;p++) {
+        t = benchNow();
+        for(int k=0;k<n;k++) {
+            busOp(LC_BLOCK_XFER, dev, LC_XFER_WRITE, 0, k % 2, blk);
+        }
+        best[0] = CMPSC311_MINVAL(best[0], (benchNow() - t) / n);
+
+        t = benchNow();
+        for(int k=0;k<n;k++) {
+            busOp(LC_BLOCK_XFER, dev, LC_XFER_READ, 0, k % 2, rd[0]);
+        }
+        best[1] = CMPSC311_MINVAL(best[1], (benchNow() - t) / n);
+
+        t = benchNow();
+        for(int k=0;k<n;k++) {
+            client_lcloud_bus_post(create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev, LC_XFER_READ, 0, k % 2), rd[k % BENCH_WINDOW]);
+            if(k % BENCH_WINDOW == BENCH_WINDOW - 1) {
+                client_lcloud_bus_wait(dev);
+            }
+        }
+        client_lcloud_bus_wait(dev);
+        best[2] = CMPSC311_MINVAL(best[2], (benchNow() - t) / n);
+    }
+    busOp(LC_POWER_OFF, 0, 0, 0, 0, NULL);
+
+    if(memcmp(rd[0], blk, LC_DEVICE_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Blocks read back wrong\n");
+        return -1;
+    }
+    printf("%-24s %14s %14s %14s\n", "server", "write us/blk", "read us/blk", "piped us/blk");
+    printf("%-24s %14.2f %14.2f %14.2f\n", (getenv("LC_BUS_SERVER") != NULL) ? getenv("LC_BUS_SERVER") : "default",
+           best[0] * 1e6, best[1] * 1e6, best[2] * 1e6);
+    return( 0 );
+}
@@ -0,0 +1,298 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : bus_server.c
+//  Description    : A stand in for lcloud_server, with the in-memory devices
+//                   of membus.c behind it, so bus_latency can compare the
+//                   transports on one server: TCP, Unix domain sockets and
+//                   shared memory, which lcloud_server does not speak. It
+//                   takes where to listen in the form LC_BUS_SERVER takes
+//                   (just :<port> for TCP, on the loopback address), serves
+//                   each connection from its own thread and runs until it
+//                   is killed. LC_MEMBUS_DELAY=<us> adds a device latency.
+//
+//  Usage          : bus_server [:<port> | unix:<path> | shm:<name>]
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <lcloud_controller.h>
+#include <lcloud_filesys.h>
+#include <lcloud_network.h>
+#include <lcloud_shm.h>
+#include <cmpsc311_util.h>
+
+// Type definitions
+typedef struct SERVER_CONN {            //A client being served
+    int socket;                         //-1 for a shared memory connection
+    LcShmConn *shm;
+} SERVER_CONN;
+
+// Global data
+char *shmName = NULL;                   //The shared memory object, removed on the way out
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFull
+// Description  : Reads exactly the bytes asked for from a client
+//
+// Inputs       : c - the client, buf - where they go, len - how many
+// Outputs      : 0 if successful, -1 if the client went away
+static int readFull( SERVER_CONN *c, void *buf, size_t len ) {
+    struct iovec iov = { buf, len };
+    ssize_t n;
+
+    if(c->shm != NULL) {
+        lcloud_shm_read(&c->shm->requests, &iov, 1);
+        return( 0 );
+    }
+    while(len > 0) {
+        n = read(c->socket, buf, len);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFull
+// Description  : Sends an answer to a client, carrying on after short writes
+//
+// Inputs       : c - the client, iov - the pieces of the answer (moved
+//                along as they are sent), cnt - how many
+// Outputs      : 0 if successful, -1 if the client went away
+static int writeFull( SERVER_CONN *c, struct iovec *iov, int cnt ) {
+    ssize_t n;
+
+    if(c->shm != NULL) {
+        lcloud_shm_write(&c->shm->answers, iov, cnt);
+        return( 0 );
+    }
+    while(cnt > 0) {
+        n = writev(c->socket, iov, cnt);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        while(cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveConn
+// Description  : Answers a client's requests in order until it goes away. A
+//                block read is always followed by a block, zeros if the
+//                read failed, since the client reads one either way.
+//
+// Inputs       : arg - the client
+// Outputs      : NULL
+static void *serveConn( void *arg ) {
+    SERVER_CONN *c = (SERVER_CONN *)arg;
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    LCloudRegisterFrame wire, reg, answer;
+    struct iovec iov[2];
+    uint8_t b0, b1, c0, c1, c2;
+    uint16_t d0, d1;
+
+    while(readFull(c, &wire, LCLOUD_NET_HEADER_SIZE) == 0) {
+        reg = ntohll64(wire);
+        extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_WRITE) {
+            if(readFull(c, blk, LC_DEVICE_BLOCK_SIZE) == -1) {
+                break;
+            }
+        } else {
+            memset(blk, 0, sizeof(blk));
+        }
+
+        answer = htonll64(client_lcloud_bus_request(reg, blk));
+        iov[0].iov_base = &answer;
+        iov[0].iov_len = LCLOUD_NET_HEADER_SIZE;
+        iov[1].iov_base = blk;
+        iov[1].iov_len = LC_DEVICE_BLOCK_SIZE;
+        if(writeFull(c, iov, (c0 == LC_BLOCK_XFER && c2 == LC_XFER_READ) ? 2 : 1) == -1) {
+            break;
+        }
+    }
+    if(c->socket != -1) {
+        close(c->socket);
+    }
+    free(c);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startConn
+// Description  : Starts a thread serving a client
+//
+// Inputs       : socket - the client's socket, -1 for shared memory, shm -
+//                its shared memory connection
+// Outputs      : 0 if successful, -1 if failure
+static int startConn( int socket, LcShmConn *shm ) {
+    SERVER_CONN *c = (SERVER_CONN *)malloc(sizeof(SERVER_CONN));
+    pthread_t t;
+
+    if(c == NULL) {
+        return -1;
+    }
+    c->socket = socket;
+    c->shm = shm;
+    if(pthread_create(&t, NULL, serveConn, c) != 0) {
+        free(c);
+        return -1;
+    }
+    pthread_detach(t);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopServer
+// Description  : Removes the shared memory object when the server is killed
+//
+// Inputs       : sig - the signal
+// Outputs      : none
+static void stopServer( int sig ) {
+    if(shmName != NULL) {
+        lcloud_shm_remove(shmName);
+    }
+    _exit(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveShm
+// Description  : Makes the shared memory object and serves every connection
+//                in it, each from its own thread whether a client has
+//                claimed it or not
+//
+// Inputs       : name - the object's name
+// Outputs      : -1 if failure, otherwise it does not return
+static int serveShm( char *name ) {
+    LcShmConn *conns = lcloud_shm_map(name, 1);
+
+    if(conns == NULL) {
+        return -1;
+    }
+    shmName = name;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    for(int k=0;k<LC_SHM_CONNECTIONS;k++) {
+        if(startConn(-1, &conns[k]) == -1) {
+            stopServer(0);
+        }
+    }
+    while(1) {
+        pause();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveSockets
+// Description  : Listens on a TCP port of the loopback address or a Unix
+//                domain socket, and serves each client that connects
+//
+// Inputs       : where - :<port> (the colon can be left out), or
+//                unix:<path>
+// Outputs      : -1 if failure, otherwise it does not return
+static int serveSockets( char *where ) {
+    struct sockaddr_storage addr;
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+    struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+    socklen_t len;
+    int one = 1;
+    int s, c;
+
+    memset(&addr, 0, sizeof(addr));
+    if(strncmp(where, "unix:", 5) == 0) {
+        if(strlen(where + 5) == 0 || strlen(where + 5) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Bad socket path [%s]\n", where + 5);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, where + 5);
+        unlink(un->sun_path);
+        len = sizeof(*un);
+    } else {
+        in->sin_family = AF_INET;
+        if(*where == ':') {
+            where++;
+        }
+        in->sin_port = htons((*where != '\0') ? atoi(where) : LCLOUD_DEFAULT_PORT);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        len = sizeof(*in);
+    }
+
+    s = socket(addr.ss_family, SOCK_STREAM, 0);
+    if(s == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(s, (struct sockaddr *)&addr, len) == -1 || listen(s, LC_BUS_MAX_CONNECTIONS) == -1) {
+        perror("bind");
+        close(s);
+        return -1;
+    }
+    while(1) {
+        c = accept(s, NULL, NULL);
+        if(c == -1) {
+            continue;
+        }
+        if(addr.ss_family != AF_UNIX) {
+            setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if(startConn(c, NULL) == -1) {
+            close(c);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Serves clients where the argument says
+//
+// Inputs       : argc - the number of arguments, argv - the arguments
+// Outputs      : -1 if failure, otherwise it does not return
+int main( int argc, char *argv[] ) {
+    char *where = (argc > 1) ? argv[1] : "";
+
+    if(strncmp(where, "shm:", 4) == 0 && where[4] != '\0') {
+        return serveShm(where + 4);
+    }
+    return serveSockets(where);
+}
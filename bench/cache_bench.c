@@ -0,0 +1,109 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cache_bench.c
+//  Description    : Measures the sharded block cache with several threads
+//                   doing random lookups and inserts at once.
+//
+//  Usage          : cache_bench [cache blocks] [blocks touched] [shards]
+//                               [threads ...]
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+#include <lcloud_cache.h>
+
+// Defines
+#define BENCH_OPS 2000000             //Lookups (and inserts on a miss) per thread
+#define BENCH_MAX_THREADS 64
+
+//
+// Global Data
+static int touched;                   //Distinct blocks the threads pick from
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchWorker
+// Description  : Looks up random blocks, puts the ones that missed. Every
+//                block is filled with its own number so a hit on the wrong
+//                line shows up.
+//
+// Inputs       : arg - the thread's random seed
+// Outputs      : the number of hits
+static void *benchWorker( void *arg ) {
+    unsigned int seed = (unsigned int)(intptr_t)arg;
+    char buf[LC_DEVICE_BLOCK_SIZE];
+    intptr_t hits = 0;
+    int b;
+
+    for(int k=0;k<BENCH_OPS;k++) {
+        b = rand_r(&seed) % touched;
+        if(lcloud_readcache(b % 8, b / 256, b % 256, buf) == 0) {
+            if(buf[0] != (char)b) {
+                fprintf(stderr, "cache_bench: block %d has the wrong data\n", b);
+                exit(1);
+            }
+            hits++;
+        } else {
+            memset(buf, (char)b, LC_DEVICE_BLOCK_SIZE);
+            lcloud_putcache(b % 8, b / 256, b % 256, buf);
+        }
+    }
+    return (void *)hits;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Runs the benchmark once per thread count on a fresh cache
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, 1 if failure
+int main( int argc, char *argv[] ) {
+    int blocks = argc > 1 ? atoi(argv[1]) : 100000;
+    int nshards = argc > 3 ? atoi(argv[3]) : 64;
+    int counts[] = {1, 4, 8};
+    pthread_t tids[BENCH_MAX_THREADS];
+    struct timespec start, end;
+    int threads;
+    intptr_t hits;
+    void *ret;
+    double secs;
+
+    touched = argc > 2 ? atoi(argv[2]) : 2 * blocks;
+    if(blocks <= 0 || touched <= 0 || nshards <= 0) {
+        fprintf(stderr, "USAGE: cache_bench [cache blocks] [blocks touched] [shards] [threads ...]\n");
+        return 1;
+    }
+    for(int t=0;t<(argc > 4 ? argc - 4 : 3);t++) {
+        threads = argc > 4 ? atoi(argv[4 + t]) : counts[t];
+        threads = threads < 1 ? 1 : (threads > BENCH_MAX_THREADS ? BENCH_MAX_THREADS : threads);
+        if(lcloud_initcache_sharded(blocks, nshards) == -1) {
+            fprintf(stderr, "cache_bench: could not make a %d block cache\n", blocks);
+            return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int k=0;k<threads;k++) {
+            pthread_create(&tids[k], NULL, benchWorker, (void *)(intptr_t)(k + 1));
+        }
+        hits = 0;
+        for(int k=0;k<threads;k++) {
+            pthread_join(tids[k], &ret);
+            hits += (intptr_t)ret;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("threads %2d  %d blocks in %d shards  hit ratio %.3f  %.2f Mops/s\n", threads,
+               blocks, nshards, (double)hits / ((double)threads * BENCH_OPS),
+               (double)threads * BENCH_OPS / secs / 1e6);
+        lcloud_closecache();
+    }
+    return 0;
+}
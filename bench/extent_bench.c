@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : extent_bench.c
+//  Description    : Times small reads and overwrites at random offsets of
+//                   files with more and more extents, to show the offset
+//                   lookup stays flat. A file gets its extents by writing
+//                   every other block, so no two of them can merge. Runs on
+//                   the in-memory bus (membus.c).
+//
+//  Usage          : extent_bench [ops per size]
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <lcloud_controller.h>
+#include <lcloud_filesys.h>
+
+// Defines
+#define BENCH_IO 64                   //Bytes read or written per op
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchNow
+// Description  : Monotonic time in seconds
+//
+// Inputs       : none
+// Outputs      : the time
+static double benchNow( void ) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Builds a file per size, then times the ops on it
+//
+// Inputs       : argc - the number of arguments, argv - the arguments
+// Outputs      : 0 if successful, -1 if failure
+int main( int argc, char *argv[] ) {
+    static const int sizes[] = { 100, 1000, 10000, 100000 };
+    char blk[LC_DEVICE_BLOCK_SIZE], buf[BENCH_IO], name[32];
+    int ops = (argc > 1) ? atoi(argv[1]) : 200000;
+    double setup, rd, wr, t;
+    LcFHandle fh;
+    size_t off;
+
+    memset(blk, 'x', sizeof(blk));
+    memset(buf, 'y', sizeof(buf));
+    printf("%8s %10s %12s %12s\n", "extents", "setup s", "read ns/op", "write ns/op");
+    for(int z=0;z<(int)(sizeof(sizes) / sizeof(sizes[0]));z++) {
+        int n = sizes[z];
+
+        snprintf(name, sizeof(name), "extents-%d", n);
+        t = benchNow();
+        fh = lcopen(name);
+        if(fh == -1) {
+            fprintf(stderr, "Could not open %s\n", name);
+            return -1;
+        }
+        for(int e=0;e<n;e++) {
+            if(lcseek(fh, (size_t)e * 2 * LC_DEVICE_BLOCK_SIZE) == -1 || lcwrite(fh, blk, LC_DEVICE_BLOCK_SIZE) == -1) {
+                fprintf(stderr, "Could not write extent %d of %s\n", e, name);
+                return -1;
+            }
+        }
+        setup = benchNow() - t;
+
+        //Random offsets within the written blocks, the holes read as zeros
+        //and would time another path
+        srand(1);
+        t = benchNow();
+        for(int k=0;k<ops;k++) {
+            off = (size_t)(rand() % n) * 2 * LC_DEVICE_BLOCK_SIZE + rand() % (LC_DEVICE_BLOCK_SIZE - BENCH_IO);
+            lcseek(fh, off);
+            lcread(fh, buf, BENCH_IO);
+        }
+        rd = benchNow() - t;
+        t = benchNow();
+        for(int k=0;k<ops;k++) {
+            off = (size_t)(rand() % n) * 2 * LC_DEVICE_BLOCK_SIZE + rand() % (LC_DEVICE_BLOCK_SIZE - BENCH_IO);
+            lcseek(fh, off);
+            lcwrite(fh, buf, BENCH_IO);
+        }
+        wr = benchNow() - t;
+        lcclose(fh);
+        printf("%8d %10.2f %12.0f %12.0f\n", n, setup, rd / ops * 1e9, wr / ops * 1e9);
+    }
+    lcshutdown();
+    return( 0 );
+}
@@ -0,0 +1,154 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs_stress.c
+//  Description    : Runs N threads on disjoint files at once, each writing,
+//                   reading back and checking its files and reopening them
+//                   now and then, and prints the throughput for each N and
+//                   its speedup over one thread. Runs on the in-memory bus
+//                   (membus.c), LC_MEMBUS_DELAY=<us> gives it a device
+//                   latency for the threads to overlap.
+//
+//  Usage          : fs_stress [rounds] [threads ...]
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <lcloud_controller.h>
+#include <lcloud_filesys.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define STRESS_FILES 4                //Files per thread
+#define STRESS_SIZE 4096              //Bytes per file
+#define STRESS_WRITE 300              //Bytes per write, not block aligned on purpose
+#define STRESS_READ 200               //Bytes per read
+#define STRESS_MAXTHREADS 64
+
+// Type definitions
+typedef struct STRESS_ARG {           //What a thread is given and hands back
+    int thread;
+    int run;                          //Keeps each run's files apart
+    int rounds;
+    long ops;                         //Reads and writes done
+    long bad;                         //Files that read back wrong, or failed calls
+} STRESS_ARG;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchNow
+// Description  : Monotonic time in seconds
+//
+// Inputs       : none
+// Outputs      : the time
+static double benchNow( void ) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stressWorker
+// Description  : One thread's work, on files no other thread opens
+//
+// Inputs       : arg - the thread's STRESS_ARG
+// Outputs      : NULL
+static void *stressWorker( void *arg ) {
+    STRESS_ARG *a = (STRESS_ARG *)arg;
+    char buf[STRESS_SIZE], got[STRESS_SIZE], path[64];
+    LcFHandle fh[STRESS_FILES];
+    int n;
+
+    for(int f=0;f<STRESS_FILES;f++) {
+        snprintf(path, sizeof(path), "stress-%d-%d-%d", a->run, a->thread, f);
+        fh[f] = lcopen(path);
+    }
+    for(int r=0;r<a->rounds;r++) {
+        for(int f=0;f<STRESS_FILES;f++) {
+            for(int k=0;k<STRESS_SIZE;k++) {
+                buf[k] = (char)(a->thread * 31 + f * 7 + r + k);
+            }
+            lcseek(fh[f], 0);
+            for(int off=0;off<STRESS_SIZE;off+=STRESS_WRITE) {
+                n = CMPSC311_MINVAL(STRESS_WRITE, STRESS_SIZE - off);
+                a->bad += (lcwrite(fh[f], &buf[off], n) != n);
+                a->ops++;
+            }
+            lcseek(fh[f], 0);
+            for(int off=0;off<STRESS_SIZE;off+=STRESS_READ) {
+                n = CMPSC311_MINVAL(STRESS_READ, STRESS_SIZE - off);
+                a->bad += (lcread(fh[f], &got[off], n) != n);
+                a->ops++;
+            }
+            a->bad += (memcmp(buf, got, STRESS_SIZE) != 0);
+
+            //Reopening takes the table and path index locks too
+            if(r % 5 == 4) {
+                lcclose(fh[f]);
+                snprintf(path, sizeof(path), "stress-%d-%d-%d", a->run, a->thread, f);
+                fh[f] = lcopen(path);
+            }
+        }
+    }
+    for(int f=0;f<STRESS_FILES;f++) {
+        lcclose(fh[f]);
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Runs the stress for each thread count
+//
+// Inputs       : argc - the number of arguments, argv - the arguments
+// Outputs      : 0 if every file read back right, -1 otherwise
+int main( int argc, char *argv[] ) {
+    static int defaults[] = { 1, 2, 4, 8 };
+    static STRESS_ARG args[STRESS_MAXTHREADS];
+    pthread_t threads[STRESS_MAXTHREADS];
+    int rounds = (argc > 1) ? atoi(argv[1]) : 20;
+    int runs = (argc > 2) ? argc - 2 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+    double t, rate, base = 0;
+    long ops, bad = 0;
+    LcFHandle fh;
+
+    //Power on before the clock starts
+    fh = lcopen("stress-warm");
+    lcclose(fh);
+
+    printf("%8s %12s %8s\n", "threads", "ops/s", "speedup");
+    for(int run=0;run<runs;run++) {
+        int count = (argc > 2) ? atoi(argv[run + 2]) : defaults[run];
+
+        count = CMPSC311_MINVAL(CMPSC311_MAXVAL(count, 1), STRESS_MAXTHREADS);
+        t = benchNow();
+        for(int k=0;k<count;k++) {
+            args[k] = (STRESS_ARG){ k, run, rounds, 0, 0 };
+            pthread_create(&threads[k], NULL, stressWorker, &args[k]);
+        }
+        ops = 0;
+        for(int k=0;k<count;k++) {
+            pthread_join(threads[k], NULL);
+            ops += args[k].ops;
+            bad += args[k].bad;
+        }
+        rate = ops / (benchNow() - t);
+        if(run == 0) {
+            base = rate;
+        }
+        printf("%8d %12.0f %8.2f\n", count, rate, rate / base);
+    }
+    lcshutdown();
+    if(bad) {
+        printf("%ld files or calls went wrong\n", bad);
+        return -1;
+    }
+    return( 0 );
+}
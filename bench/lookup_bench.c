@@ -0,0 +1,140 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lookup_bench.c
+//  Description    : Measures single threaded cache lookups on a full cache,
+//                   the dirty block scan of a flush and a resize. Meant to
+//                   be run under perf stat -e LLC-load-misses as well, the
+//                   lookups are what the cache line layout is for.
+//
+//  Usage          : lookup_bench [cache blocks]
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+#include <lcloud_cache.h>
+
+// Defines
+#define BENCH_OPS 4000000             //Lookups timed per pass
+#define BENCH_FLUSHES 20              //Flushes timed, each with one dirty block
+
+// Block i of the benchmark, spread over 8 devices
+#define BENCH_DEV(i) ((i) & 7)
+#define BENCH_SEC(i) (((i) >> 3) & 0xFFFF)
+#define BENCH_BLK(i) ((i) >> 19)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchNow
+// Description  : Monotonic time in seconds
+//
+// Inputs       : none
+// Outputs      : the time
+static double benchNow( void ) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchRss
+// Description  : Reads a line of /proc/self/status, in kB
+//
+// Inputs       : field - the field name with its colon
+// Outputs      : the value, 0 if not found
+static long benchRss( const char *field ) {
+    FILE *fh = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = 0;
+
+    while(fh != NULL && fgets(line, sizeof(line), fh) != NULL) {
+        if(strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(&line[strlen(field)]);
+        }
+    }
+    if(fh != NULL) {
+        fclose(fh);
+    }
+    return kb;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchWriteback
+// Description  : Write back that drops the block, only the scan is timed
+//
+// Inputs       : did, sec, blk, block - the block
+// Outputs      : 0
+static int benchWriteback( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Fills an LRU cache, then times pinned random hits, random
+//                misses, flushes of a single dirty block and a resize to
+//                half the size
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, 1 if failure
+int main( int argc, char *argv[] ) {
+    int blocks = argc > 1 ? atoi(argv[1]) : 1000000;
+    char buf[LC_DEVICE_BLOCK_SIZE];
+    unsigned int seed = 1;
+    LcCacheRef ref;
+    long sum = 0;
+    double t;
+    int k;
+
+    if(blocks <= 1 || lcloud_initcache_policy(blocks, 0, LC_CACHE_LRU) == -1) {
+        fprintf(stderr, "USAGE: lookup_bench [cache blocks]\n");
+        return 1;
+    }
+    lcloud_setwriteback(benchWriteback);
+    memset(buf, 1, sizeof(buf));
+    for(int i=0;i<blocks;i++) {
+        lcloud_putcache(BENCH_DEV(i), BENCH_SEC(i), BENCH_BLK(i), buf);
+    }
+    printf("%d blocks, VmRSS %ld kB (%.1f bytes a block)\n", blocks, benchRss("VmRSS:"),
+           benchRss("VmRSS:") * 1024.0 / blocks);
+
+    t = benchNow();
+    for(int i=0;i<BENCH_OPS;i++) {
+        k = rand_r(&seed) % blocks;
+        if(lcloud_pincache(BENCH_DEV(k), BENCH_SEC(k), BENCH_BLK(k), &ref) == 0) {
+            sum += ref.data[0];
+            lcloud_unpincache(&ref);
+        }
+    }
+    printf("pinned random hits  %.1f Mops/s\n", BENCH_OPS / (benchNow() - t) / 1e6);
+
+    //Device 9 is never cached, every lookup walks a chain and misses
+    t = benchNow();
+    for(int i=0;i<BENCH_OPS;i++) {
+        k = rand_r(&seed) % blocks;
+        sum += (lcloud_getcache(9, BENCH_SEC(k), BENCH_BLK(k)) != NULL);
+    }
+    printf("random misses       %.1f Mops/s\n", BENCH_OPS / (benchNow() - t) / 1e6);
+
+    k = blocks - 1;
+    t = benchNow();
+    for(int i=0;i<BENCH_FLUSHES;i++) {
+        lcloud_dirtycache(BENCH_DEV(k), BENCH_SEC(k), BENCH_BLK(k), buf);
+        lcloud_flushcache();
+    }
+    printf("flush, 1 dirty      %.2f ms\n", (benchNow() - t) / BENCH_FLUSHES * 1e3);
+
+    t = benchNow();
+    lcloud_resizecache(blocks / 2);
+    printf("resize to half      %.1f ms\n", (benchNow() - t) * 1e3);
+
+    lcloud_closecache();
+    return (sum < 0);
+}
@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : membus.c
+//  Description    : An in-memory stand in for the bus client, so the
+//                   filesystem benchmarks time the driver and not the
+//                   network or the server. Blocks live in memory for the
+//                   life of the process, each device behind its own lock,
+//                   and a posted request is done by the time post returns.
+//                   LC_MEMBUS_DELAY=<us> adds a device latency to every
+//                   block transfer, slept outside the locks.
+//
+
+// Includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <lcloud_controller.h>
+#include <lcloud_filesys.h>
+#include <lcloud_network.h>
+
+// Defines
+#define MEMBUS_DEVICES 4                //Devices 0 to 3 answer the probe
+#define MEMBUS_SECTORS 256
+#define MEMBUS_BLOCKS 256               //Blocks per sector, 16MB per device
+
+// Global data
+char *memStore[MEMBUS_DEVICES];         //Blocks of each device, sector major, allocated at init
+pthread_mutex_t memLock[MEMBUS_DEVICES] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                                            PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+long memDelay = 0;                      //Microseconds per block transfer
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_request
+// Description  : Does a bus operation on the in-memory devices
+//
+// Inputs       : reg - the request registers, buf - the block for a transfer
+// Outputs      : the response registers
+
+LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void *buf) {
+    uint8_t b0, b1, c0, c1, c2;
+    uint16_t d0, d1;
+    char *blk;
+
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    switch(c0) {
+    case LC_DEVPROBE:
+        return create_lcloud_registers(1, 1, c0, 0, 0, (1 << MEMBUS_DEVICES) - 1, 0);
+
+    case LC_DEVINIT:
+        if(c1 >= MEMBUS_DEVICES) {
+            return create_lcloud_registers(1, 0, c0, c1, 0, 0, 0);
+        }
+        if(getenv("LC_MEMBUS_DELAY") != NULL) {
+            memDelay = atol(getenv("LC_MEMBUS_DELAY"));
+        }
+        pthread_mutex_lock(&memLock[c1]);
+        if(memStore[c1] == NULL) {
+            memStore[c1] = (char *)calloc((size_t)MEMBUS_SECTORS * MEMBUS_BLOCKS, LC_DEVICE_BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&memLock[c1]);
+        return create_lcloud_registers(1, memStore[c1] != NULL, c0, c1, 0, MEMBUS_SECTORS, MEMBUS_BLOCKS);
+
+    case LC_BLOCK_XFER:
+        if(c1 >= MEMBUS_DEVICES || memStore[c1] == NULL || d0 >= MEMBUS_SECTORS || d1 >= MEMBUS_BLOCKS) {
+            return create_lcloud_registers(1, 0, c0, c1, c2, d0, d1);
+        }
+        blk = &memStore[c1][((size_t)d0 * MEMBUS_BLOCKS + d1) * LC_DEVICE_BLOCK_SIZE];
+        if(memDelay > 0) {
+            struct timespec d = { memDelay / 1000000, (memDelay % 1000000) * 1000 };
+            nanosleep(&d, NULL);
+        }
+        pthread_mutex_lock(&memLock[c1]);
+        if(c2 == LC_XFER_READ) {
+            memcpy(buf, blk, LC_DEVICE_BLOCK_SIZE);
+        } else {
+            memcpy(blk, buf, LC_DEVICE_BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&memLock[c1]);
+        return create_lcloud_registers(1, 1, c0, c1, c2, d0, d1);
+
+    default:
+        return create_lcloud_registers(1, 1, c0, c1, c2, d0, d1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_post
+// Description  : Does the request at once, there is nothing to overlap
+//
+// Inputs       : reg - the request registers, buf - the block for a transfer
+// Outputs      : none
+
+void client_lcloud_bus_post(LCloudRegisterFrame reg, void *buf) {
+    client_lcloud_bus_request(reg, buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_wait
+// Description  : Nothing is ever outstanding
+//
+// Inputs       : did - the device
+// Outputs      : none
+
+void client_lcloud_bus_wait(LcDeviceId did) {
+    (void)did;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_channel
+// Description  : Each device is its own channel
+//
+// Inputs       : did - the device
+// Outputs      : the channel
+
+int client_lcloud_bus_channel(LcDeviceId did) {
+    return did;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_shared
+// Description  : Every request is done under its device's lock, so any
+//                number of threads can use a device at once
+//
+// Inputs       : none
+// Outputs      : 1
+int client_lcloud_bus_shared(void) {
+    return 1;
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# CMPSC311 - LionCloud Device - Assignment #4
+# policy_compare.sh - hit ratio of every cache replacement policy on every
+#                     workload that has a manifest
+#
+# Usage: bench/policy_compare.sh [policy ...]   (run from the top directory
+#        after make; build with -DLC_CACHE_MAXBLOCKS=<blocks> for other sizes)
+#
+
+CLIENT=${CLIENT:-./lcloud_client}
+SERVER=${SERVER:-./lcloud_server}
+POLICIES=${@:-lru clock 2q arc}
+
+printf "%-10s" "workload"
+for p in $POLICIES; do printf "%8s" "$p"; done
+echo
+
+for wl in workload/cmpsc311-assign*-workload.txt; do
+    man=${wl%-workload.txt}-manifest.txt
+    [ -f "$man" ] || continue
+    name=${wl#workload/cmpsc311-assign}
+    printf "%-10s" "${name%-workload.txt}"
+    for p in $POLICIES; do
+        # The server serves one run at a time, start a fresh one for each
+        $SERVER "$man" >/dev/null 2>&1 &
+        srv=$!
+        sleep 0.5
+        ratio=$(LC_CACHE_POLICY=$p $CLIENT -v "$wl" 2>&1 | sed -n 's/.*HIT RATIO: *//p' | tail -1)
+        kill $srv 2>/dev/null
+        wait $srv 2>/dev/null
+        printf "%8s" "${ratio:--}"
+    done
+    echo
+done
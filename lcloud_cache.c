@@ -8,40 +8,202 @@
 //   Last Modified : 4/19/20
 //
 
-// Includes 
+// Includes
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 #include <lcloud_cache.h>
 #include "lcloud_support.h"
 
-// Functions
-int getLine(LcDeviceId did, uint16_t sec, uint16_t blk);
+// Defines
+#define LC_CACHE_NIL -1                 //End of a hash chain or recency list
+#define LC_CACHE_NOKEY UINT64_MAX       //Key of a line holding nothing
+#define LC_CACHE_TOUCH_SLOTS 64         //Hits buffered per shard before promotion
+#define LC_CACHE_CURVE_SAMPLES 8192     //Most keys the curve simulations hold, all sizes together
+#define LC_CACHE_TUNE_SLACK 0.01        //Hit ratio tuning gives up for a smaller cache
+#define LC_CACHE_ALIGN 64               //Block arenas start on a CPU cache line
+#define LC_CACHE_HUGEPAGE (2 * 1024 * 1024) //Arenas this big are mapped for huge pages
+#define LINE_DATA(s, line) (&(s)->data[(size_t)(line) * LC_DEVICE_BLOCK_SIZE])
+#define LC_SNAP_MAGIC "LCCACHE"            //First 8 bytes of a snapshot file (with the NUL)
+#define LC_SNAP_VERSION 2                  //1 had no tag, it is not loaded
+#define LC_PUT_CLEAN 0                  //putLine: the device has this data
+#define LC_PUT_DIRTY 1                  //putLine: the device does not have it yet
+#define LC_PUT_PREFETCH 2               //putLine: read ahead, only if not cached already
+#define LC_CACHE_KEY(did, sec, blk) (((uint64_t)(did) << 32) | ((uint64_t)(sec) << 16) | (uint64_t)(blk))
 
 //Structs
-typedef struct CACHE_LINE {
-    char data[256];
-    uint64_t lastUsed;
-    LcDeviceId device;
-    uint16_t sec;
-    uint16_t block;
+typedef struct CACHE_INDEX {            //What a lookup touches, four lines per CPU cache line
+    uint64_t key;                       //Packed (device, sector, block)
+    int32_t hashNext;                   //Next line in the same hash bucket
+    uint32_t pins;                      //Readers holding the line, never evicted while non zero (atomic)
+} CACHE_INDEX;
+
+typedef struct CACHE_LINE {             //What the policy touches, the block itself is in the arena
+    int32_t prev;                       //More recently used neighbour
+    int32_t next;                       //Less recently used neighbour
+    uint8_t list;                       //Which resident list the line is on
+    uint8_t ref;                        //Reference bit (CLOCK, atomic)
+    uint8_t dirty;                      //Newer than the copy on the device (write back)
+    uint8_t prefetched;                 //Brought in by read ahead and not looked up since (atomic)
 } CACHE_LINE;
 
+typedef struct GHOST {                  //Key of a recently evicted block (2Q, ARC)
+    uint64_t key;
+    int32_t hashNext;
+    int32_t prev;
+    int32_t next;
+    uint8_t list;
+} GHOST;
+
+typedef struct CACHE_LIST {             //Recency ordered list of lines or ghosts
+    int32_t mru;                        //Most recently used (head)
+    int32_t lru;                        //Least recently used (tail)
+    int size;
+} CACHE_LIST;
+
+typedef struct CACHE_SHARD {            //Independent slice of the cache
+    pthread_rwlock_t lock;              //Shared for hits, exclusive for anything that relinks
+    CACHE_INDEX *index;                 //Keys and hash chains of the lines, parallel to lines
+    CACHE_LINE *lines;                  //Recency and flags of the lines
+    char *data;                         //The blocks, line n at n * LC_DEVICE_BLOCK_SIZE
+    int32_t *buckets;                   //Hash index, each bucket is the head of a chain of lines
+    uint32_t bucketMask;                //Number of buckets - 1 (always a power of two)
+    int numLines;                       //Number of blocks stored in shard
+    int topLine;                        //Lines 0 to topLine - 1 have been used
+    int32_t freeLine;                   //Dropped lines below topLine, linked through hashNext
+    int maxLines;                       //Capacity of the shard
+    int numDirty;                       //Lines waiting to be written back
+    CACHE_LIST lists[2];                //Resident lists, meaning depends on the policy
+    GHOST *ghosts;                      //Ghost entries, only for policies that use them
+    int32_t *ghostBuckets;              //Hash index of the ghosts
+    uint32_t ghostMask;
+    int32_t ghostFree;                  //Free ghost entries, linked through next
+    CACHE_LIST ghostLists[2];           //Ghost lists, meaning depends on the policy
+    int target;                         //ARC target size of T1
+    int pending;                        //List chosen by the last miss for the next insert
+    uint32_t numTouched;                //Hits recorded under the shared lock (atomic)
+    int32_t touched[LC_CACHE_TOUCH_SLOTS]; //Lines hit since the last promotion pass
+    LcCacheStats stats[LC_CACHE_MAXDEVICES+1]; //Per device counters, the last slot for larger IDs
+} CACHE_SHARD;
+
+typedef struct CACHE_SNAPSHOT {         //Header of a snapshot file, then the keys, then the blocks
+    char magic[8];                      //LC_SNAP_MAGIC
+    uint32_t version;                   //LC_SNAP_VERSION
+    uint32_t blockSize;                 //LC_DEVICE_BLOCK_SIZE when written
+    uint64_t count;                     //Number of blocks
+    uint64_t checksum;                  //Of the keys and blocks
+    uint64_t tag;                       //What the devices held when written (lcloud_snapshottag)
+    char pad[24];                       //Keeps the header a CPU cache line long
+} CACHE_SNAPSHOT;
+
+typedef struct CACHE_POLICY {           //Replacement policy, run with the shard exclusively locked
+    const char *name;
+    int ghosts;                         //Does the policy remember evicted keys
+    int concurrentHit;                  //Is hit() safe under the shared lock
+    void (*hit)(CACHE_SHARD *s, int line);        //A resident line was referenced
+    int (*miss)(CACHE_SHARD *s, uint64_t key);    //Make room for key, returns the evicted line or LC_CACHE_NIL
+    void (*insert)(CACHE_SHARD *s, int line);     //A line was filled after a miss
+} CACHE_POLICY;
+
+// Functions
+CACHE_SHARD *getShard(uint64_t key, uint64_t *hash); //Shard of a block
+int getLine(CACHE_SHARD *s, uint64_t hash, uint64_t key); //Hash lookup of a block
+int putLine(LcDeviceId did, uint16_t sec, uint16_t blk, char *block, int how); //Insert or refresh a block
+void notePrefetch(CACHE_SHARD *s, int line, uint64_t key); //Count the first use of a prefetched line
+int cleanLine(CACHE_SHARD *s, int line);      //Write a dirty line back
+LcCacheStats *devStats(CACHE_SHARD *s, uint64_t key); //Counters of the block's device
+void addStats(LcCacheStats *sum, const LcCacheStats *st); //Accumulate counters
+int dumpStats(const char *fname);       //Write the per device counters to a file
+int initShard(CACHE_SHARD *s, int maxlines);  //Allocate a shard
+uint32_t numBuckets(int n);             //Hash index size for n entries
+int allocLines(CACHE_SHARD *s, int maxlines); //Allocate empty lines
+void freeLines(CACHE_SHARD *s, int maxlines); //Free the lines of a shard
+char *allocArena(size_t bytes);         //Allocate aligned memory for blocks
+void freeArena(char *p, size_t bytes);  //Free memory from allocArena
+int allocGhosts(CACHE_SHARD *s, int n); //Allocate a pool of ghosts
+int resizeShard(CACHE_SHARD *s, int maxlines); //Change the capacity of a shard
+size_t lineBytes(void);                 //Memory used per block of capacity
+size_t budgetFromEnv(void);             //Memory budget given by LC_CACHE_BUDGET
+int initCurve(void);                    //Start the hit ratio curve for the current size
+void freeCurve(void);                   //Stop the hit ratio curve
+void curvePoints(LcCacheCurvePoint *pts, int n); //Read the curve, holding curveLock
+void noteAccess(uint64_t hash, uint64_t key); //Feed a lookup to the curve
+size_t snapshotData(uint64_t count);    //Offset of the blocks in a snapshot
+uint64_t snapshotSum(const char *p, size_t len); //Checksum of a snapshot's contents
+int saveSnapshot(const char *fname);    //Write the clean lines to a snapshot
+int loadSnapshot(const char *fname, uint64_t tag); //Fill the cache from a snapshot
+LcCachePolicy policyFromEnv(void);      //Policy named by LC_CACHE_POLICY
+void noteHit(CACHE_SHARD *s, int line); //Record a hit, promoting now or later
+void applyTouches(CACHE_SHARD *s);      //Promote hits recorded under the shared lock
+void unlinkLine(CACHE_SHARD *s, int line);    //Remove line from its resident list
+void pushFront(CACHE_SHARD *s, int list, int line); //Make line the most recent on a list
+void unhashLine(CACHE_SHARD *s, int line);    //Remove line from its hash chain
+int findGhost(CACHE_SHARD *s, uint64_t key);  //Hash lookup of a ghost
+void addGhost(CACHE_SHARD *s, int list, uint64_t key); //Remember an evicted key
+void dropGhost(CACHE_SHARD *s, int ghost);    //Forget a ghost
+int isPinned(CACHE_SHARD *s, int line);       //Is the line pinned by a reader
+int takeVictim(CACHE_SHARD *s, int list);     //Unlink the oldest unpinned line of a list
+void keepVictim(CACHE_SHARD *s, int line);    //Put back a victim that could not be written back
+void dropLine(CACHE_SHARD *s, int line);      //Forget a line, dirty or not
+
+void lruHit(CACHE_SHARD *s, int line);
+int lruMiss(CACHE_SHARD *s, uint64_t key);
+void lruInsert(CACHE_SHARD *s, int line);
+void clockHit(CACHE_SHARD *s, int line);
+int clockMiss(CACHE_SHARD *s, uint64_t key);
+void clockInsert(CACHE_SHARD *s, int line);
+void twoQHit(CACHE_SHARD *s, int line);
+int twoQMiss(CACHE_SHARD *s, uint64_t key);
+void arcHit(CACHE_SHARD *s, int line);
+int arcMiss(CACHE_SHARD *s, uint64_t key);
+int arcReplace(CACHE_SHARD *s, int inB2);
+void pendingInsert(CACHE_SHARD *s, int line);
+
 //Global variables
-int i;                          //Used for loops, declared now for convienience
-CACHE_LINE *cache;              //The cache
-uint64_t hits = 0;              //Number of cache hits
-uint64_t misses = 0;            //Number of cache misses
-int numLines = 0;               //Number of blocks stored in cache
-int maxBlocks;
-CACHE_LINE *cache;
+CACHE_SHARD *shards = NULL;     //The cache, split into shards
+int numShards = 0;              //Number of shards (always a power of two)
+int shardBits = 0;              //log2 of numShards
+int locking = 0;                //Are the shards shared between threads
+const CACHE_POLICY *policy;     //Replacement policy of every shard
+LcCacheWriteback writeback = NULL; //Writes dirty blocks to the device
+int totalBlocks = 0;            //Capacity of all the shards together
+int blockCap = 0;               //Largest size tuning may grow to (the budget)
+int tracking = 0;               //Is the hit ratio curve kept
+uint64_t snapTag = 0;           //Written in the snapshot header at close, 0 to not save one
+
+//Hit ratio curve. Each size is simulated as a key only LRU (a list of ghosts)
+//fed a spatial sample of the lookups, 1 in 2^curveBits keys by hash.
+const int curveEighths[LC_CACHE_CURVE_POINTS] = { 2, 4, 6, 8, 10, 12, 16, 32 }; //Sizes, in eighths of the cache
+CACHE_SHARD *curve = NULL;      //The simulations, maxLines is the sampled size
+int curveBase = 0;              //Cache size the simulations were sized for
+int curveBits = 0;              //log2 of the sampling rate
+uint64_t curveLookups = 0;      //Sampled lookups
+uint64_t curveHits[LC_CACHE_CURVE_POINTS]; //Sampled lookups each size would have hit
+pthread_mutex_t curveLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Policies, indexed by LcCachePolicy
+const CACHE_POLICY policies[LC_CACHE_MAX_POLICY] = {
+    { NULL,    0, 0, NULL,     NULL,      NULL },
+    { "LRU",   0, 0, lruHit,   lruMiss,   lruInsert },
+    { "CLOCK", 0, 1, clockHit, clockMiss, clockInsert },
+    { "2Q",    1, 0, twoQHit,  twoQMiss,  pendingInsert },
+    { "ARC",   1, 0, arcHit,   arcMiss,   pendingInsert },
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_getcache
-// Description  : Search the cache for a block 
+// Description  : Search the cache for a block
 //
 // Inputs       : did - device number of block to find
 //                sec - sector number of block to find
@@ -49,29 +211,133 @@ CACHE_LINE *cache;
 // Outputs      : cache block if found (pointer), NULL if not or failure
 
 char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+    char *data = NULL;
 
-    int num = getLine(did, sec, blk);           //Which line in cache, if any
+    noteAccess(hash, key);
+    if(locking) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+
+    int num = getLine(s, hash, key);            //Which line in cache, if any
     if (num == -1) {                            //If block is not in cache, return NULL, increment misses
-        misses++;
-        return (NULL);
+        __atomic_fetch_add(&devStats(s, key)->misses, 1, __ATOMIC_RELAXED);
+    }
+    else {                                      //Block in cache, update hits and recency
+        __atomic_fetch_add(&devStats(s, key)->hits, 1, __ATOMIC_RELAXED);
+        noteHit(s, num);
+        notePrefetch(s, num, key);
+        data = LINE_DATA(s, num);
     }
 
-    else {                                      //Block in cache, update hits and last used
-        cache[num].lastUsed = -1;
-        hits++;
-        for(int j=0;j<numLines;j++) {
-            cache[j].lastUsed++;
-        }
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return data;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_readcache
+// Description  : Copy a block out of the cache, safe against concurrent callers
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+//                buf - where to copy the block to
+// Outputs      : 0 if found, -1 if not in cache
+
+int lcloud_readcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+    int num;
+
+    noteAccess(hash, key);
+    if(locking) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+
+    num = getLine(s, hash, key);
+    if (num == -1) {
+        __atomic_fetch_add(&devStats(s, key)->misses, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_add(&devStats(s, key)->hits, 1, __ATOMIC_RELAXED);
+        memcpy(buf, LINE_DATA(s, num), LC_DEVICE_BLOCK_SIZE);
+        noteHit(s, num);
+        notePrefetch(s, num, key);
+    }
+
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return (num == -1) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_pincache
+// Description  : Look up a block and pin it, so the caller can copy straight
+//                out of the cache. A pinned block is never evicted, the caller
+//                must give it back with lcloud_unpincache.
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+//                ref - filled in with the pinned block if found
+// Outputs      : 0 if found, -1 if not in cache
+
+int lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk, LcCacheRef *ref ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+    int num;
+
+    noteAccess(hash, key);
+    if(locking) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+
+    num = getLine(s, hash, key);
+    if (num == -1) {
+        __atomic_fetch_add(&devStats(s, key)->misses, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_add(&devStats(s, key)->hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->index[num].pins, 1, __ATOMIC_ACQUIRE);
+        noteHit(s, num);
+        notePrefetch(s, num, key);
+        ref->data = LINE_DATA(s, num);
+        ref->shard = s - shards;
+        ref->line = num;
     }
 
-    return cache[num].data;
- 
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return (num == -1) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_unpincache
+// Description  : Release a block pinned by lcloud_pincache
+//
+// Inputs       : ref - the pinned block
+// Outputs      : none
+
+void lcloud_unpincache( LcCacheRef *ref ) {
+    __atomic_fetch_sub(&shards[ref->shard].index[ref->line].pins, 1, __ATOMIC_RELEASE);
+    ref->data = NULL;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_putcache
-// Description  : Put a value in the cache 
+// Description  : Put a value in the cache
 //
 // Inputs       : did - device number of block to insert
 //                sec - sector number of block to insert
@@ -79,96 +345,2139 @@ char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
 // Outputs      : 0 if succesfully inserted, -1 if failure
 
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
-    int large = 0;                              //Stores the least recently used vlaue to compare against
-    int line = 0;                               //Which line in cache to put the block
-
-    int num = getLine(did, sec, blk);
-    //Block is not in cache and cache is not full
-    if (num == -1 && numLines < maxBlocks) {
-        line = numLines;
-        numLines++;
-    }
-    //Block is not in cache but cache is full, evict least recent block
-    else if(num == -1) {
-        for(i=0;i<maxBlocks;i++) {
-            if(cache[i].lastUsed > large) {
-                large = cache[i].lastUsed;
-                line = i;
-            }
-        }
+    return putLine(did, sec, blk, block, LC_PUT_CLEAN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_dirtycache
+// Description  : Put a value in the cache that has not been written to the
+//                device yet. It is written back when evicted or flushed.
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+// Outputs      : 0 if succesfully inserted, -1 if failure (caller must
+//                write the block through)
+
+int lcloud_dirtycache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    if(writeback == NULL) {
+        return -1;
     }
-    //Cache in block
-    else {
-        line = num;
+    return putLine(did, sec, blk, block, LC_PUT_DIRTY);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_fillcache
+// Description  : Put a block read ahead of the reader in the cache. Nothing
+//                is changed if the block is cached already, since the cached
+//                copy may be newer than what was read from the device.
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+//                block - the block read from the device
+// Outputs      : 0 if inserted, 1 if already cached, -1 if failure
+
+int lcloud_fillcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    return putLine(did, sec, blk, block, LC_PUT_PREFETCH);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_peekcache
+// Description  : Check for a block without counting a hit or miss or
+//                touching its recency. Copying out a prefetched block does
+//                count it as used (a prefetch hit).
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+//                buf - where to copy the block to, NULL to only check
+// Outputs      : 0 if found, -1 if not in cache
+
+int lcloud_peekcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+    int num;
+
+    if(locking) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+
+    num = getLine(s, hash, key);
+    if(num != -1 && buf != NULL) {
+        memcpy(buf, LINE_DATA(s, num), LC_DEVICE_BLOCK_SIZE);
+        notePrefetch(s, num, key);
+    }
+
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return (num == -1) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_skipread
+// Description  : Count a write that did not need the block's old contents,
+//                so neither looked it up nor read it from the device
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_skipread( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+
+    if(shards == NULL) {
+        return -1;
     }
+    __atomic_fetch_add(&devStats(getShard(key, &hash), key)->rmwSkips, 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    //Set cache line
-    cache[line].device = did;
-    cache[line].sec = sec;
-    cache[line].block = blk;
-    cache[line].lastUsed = 0;
-    memcpy(cache[line].data,block,256); 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setwriteback
+// Description  : Set the function used to write dirty blocks to the device
+//
+// Inputs       : fn - the write back function
+// Outputs      : 0 if successful, -1 if failure
 
+int lcloud_setwriteback( LcCacheWriteback fn ) {
+    writeback = fn;
     return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushblock
+// Description  : Write a block back to the device if it is dirty
+//
+// Inputs       : did - device number of block to flush
+//                sec - sector number of block to flush
+//                blk - block number of block to flush
+// Outputs      : 0 if successful (or nothing to do), -1 if failure
+
+int lcloud_flushblock( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+    int line;
+    int ret = 0;
+
+    if(locking) {
+        pthread_rwlock_wrlock(&s->lock);
+    }
+    line = s->numDirty > 0 ? getLine(s, hash, key) : -1;
+    if(line != -1 && s->lines[line].dirty) {
+        ret = cleanLine(s, line);
+    }
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_dropcache
+// Description  : Forget a block, without writing it back even if dirty. For
+//                blocks that were freed, whose data nobody wants any more.
+//
+// Inputs       : did - device number of block to drop
+//                sec - sector number of block to drop
+//                blk - block number of block to drop
+// Outputs      : 0 if successful (or not cached), -1 if a reader has it
+//                pinned
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+    int line;
+    int ret = 0;
+
+    if(locking) {
+        pthread_rwlock_wrlock(&s->lock);
+        applyTouches(s);
+    }
+    line = getLine(s, hash, key);
+    if(line != -1) {
+        if(isPinned(s, line)) {
+            ret = -1;
+        }
+        else {
+            dropLine(s, line);
+        }
+    }
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushcache
+// Description  : Write every dirty block back to the device
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if any block failed
+
+int lcloud_flushcache( void ) {
+    int ret = 0;
+
+    for(int j=0;j<numShards;j++) {
+        CACHE_SHARD *s = &shards[j];
+        if(locking) {
+            pthread_rwlock_wrlock(&s->lock);
+        }
+        for(int k=0;k<s->topLine && s->numDirty > 0;k++) {
+            if(s->lines[k].dirty && cleanLine(s, k) == -1) {
+                ret = -1;
+            }
+        }
+        if(locking) {
+            pthread_rwlock_unlock(&s->lock);
+        }
+    }
+    return( ret );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_initcache
 // Description  : Initialze the cache by setting up metadata a cache elements.
+//                LC_CACHE_BUDGET (bytes, K/M/G suffix allowed) overrides the
+//                size with a memory budget.
 //
-// Inputs       : maxblocks - the max number number of blocks 
+// Inputs       : maxblocks - the max number number of blocks
 // Outputs      : 0 if successful, -1 if failure
 
 int lcloud_initcache( int maxblocks ) {
-    cache = (CACHE_LINE *)malloc(sizeof(CACHE_LINE) * maxblocks);
-    if(cache == NULL) {
+    size_t budget = budgetFromEnv();
+
+    if(budget > 0) {
+        return lcloud_initcache_budget(budget, 0, LC_CACHE_POLICY_DEFAULT);
+    }
+    return lcloud_initcache_policy(maxblocks, 0, LC_CACHE_POLICY_DEFAULT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache_sharded
+// Description  : Initialize a cache that may be used by several threads at
+//                once. Blocks hash to independent shards, each with its own
+//                lock and recency list. LC_CACHE_BUDGET overrides the size
+//                as for lcloud_initcache.
+//
+// Inputs       : maxblocks - the max number number of blocks
+//                nshards - number of shards, rounded up to a power of two
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache_sharded( int maxblocks, int nshards ) {
+    size_t budget = budgetFromEnv();
+
+    if(nshards <= 0) {
         return -1;
     }
-    maxBlocks = maxblocks;
+    if(budget > 0) {
+        return lcloud_initcache_budget(budget, nshards, LC_CACHE_POLICY_DEFAULT);
+    }
+    return lcloud_initcache_policy(maxblocks, nshards, LC_CACHE_POLICY_DEFAULT);
+}
 
-    //Initialize each values to nonsense
-    for(i=0;i<maxBlocks;i++) {
-        cache[i].lastUsed = -1;
-        cache[i].device = -1;
-        cache[i].sec = -1;
-        cache[i].block = -1;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache_policy
+// Description  : Initialize the cache with a given replacement policy. The
+//                hit ratio curve is kept if LC_CACHE_CURVE is non zero.
+//
+// Inputs       : maxblocks - the max number number of blocks
+//                nshards - number of locked shards, 0 for a single unlocked
+//                          shard (single threaded callers)
+//                pol - the replacement policy, LC_CACHE_POLICY_DEFAULT to
+//                      take it from the LC_CACHE_POLICY environment variable
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache_policy( int maxblocks, int nshards, LcCachePolicy pol ) {
+    int per;                                    //Lines per shard
+
+    if(maxblocks <= 0 || nshards < 0 || pol < 0 || pol >= LC_CACHE_MAX_POLICY) {
+        return -1;
+    }
+    if(pol == LC_CACHE_POLICY_DEFAULT) {
+        pol = policyFromEnv();
+    }
+    policy = &policies[pol];
+
+    //Never make a shard smaller than LC_CACHE_SHARDLINES, a small cache
+    //split many ways evicts blocks its other shards have room for
+    numShards = 1;
+    shardBits = 0;
+    while(numShards < nshards && numShards * 2 * LC_CACHE_SHARDLINES <= maxblocks && numShards < LC_CACHE_MAXSHARDS) {
+        numShards <<= 1;
+        shardBits++;
+    }
+
+    shards = (CACHE_SHARD *)calloc(numShards, sizeof(CACHE_SHARD));
+    if(shards == NULL) {
+        return -1;
+    }
+    locking = (nshards > 0);
+
+    //Spread the remainder so the shards add up to maxblocks
+    for(int j=0;j<numShards;j++) {
+        per = maxblocks / numShards + (j < maxblocks % numShards);
+        if(initShard(&shards[j], per) == -1) {
+            lcloud_closecache();
+            return -1;
+        }
+    }
+    totalBlocks = maxblocks;
+    blockCap = maxblocks;
+
+    if(getenv("LC_CACHE_CURVE") != NULL && atoi(getenv("LC_CACHE_CURVE")) != 0) {
+        tracking = 1;
+    }
+    if(tracking && initCurve() == -1) {
+        lcloud_closecache();
+        return -1;
     }
     return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_closecache
-// Description  : Clean up the cache when program is closing
+// Function     : lcloud_initcache_budget
+// Description  : Initialize the cache with as many blocks as fit in a memory
+//                budget, counting the lines, hash indexes and ghosts. The hit
+//                ratio curve is kept (in a small fixed amount of memory on top)
+//                so lcloud_tunecache can size the cache within the budget.
 //
-// Inputs       : none
+// Inputs       : bytes - the memory budget, raised to one block per shard
+//                        if it is smaller
+//                nshards - as for lcloud_initcache_policy
+//                pol - as for lcloud_initcache_policy
 // Outputs      : 0 if successful, -1 if failure
+int lcloud_initcache_budget( size_t bytes, int nshards, LcCachePolicy pol ) {
+    //Each shard costs its struct and up to a page of arena rounding
+    size_t fixed = (sizeof(CACHE_SHARD) + 4096) * CMPSC311_MINVAL(CMPSC311_MAXVAL(nshards, 1), LC_CACHE_MAXSHARDS);
+    size_t blocks;
 
-int lcloud_closecache( void ) {
-    free(cache);
-
-    logMessage(LcDriverLLevel,"NUMBER OF HITS: %"PRIu64,hits/2);            //Divide hits by 2 because getcache is called twice per
-    logMessage(LcDriverLLevel,"NUMBER OF MISSES: %"PRIu64,misses);             
-    float ratio = (float)(hits/2) / (float)((hits/2)+misses);
-    logMessage(LcDriverLLevel,"HIT RATIO: %.2f",ratio);                     //Divide hits by 2 because getcache is called twice per
+    if(nshards < 0 || pol < 0 || pol >= LC_CACHE_MAX_POLICY) {
+        return -1;
+    }
+    if(pol == LC_CACHE_POLICY_DEFAULT) {
+        pol = policyFromEnv();
+    }
+    policy = &policies[pol];
 
+    //A budget too small for a block per shard still gets a working cache
+    blocks = (bytes > fixed) ? CMPSC311_MINVAL((bytes - fixed) / lineBytes(), (size_t)INT32_MAX / 4) : 0;
+    if(blocks < (size_t)CMPSC311_MAXVAL(nshards, 1)) {
+        blocks = CMPSC311_MAXVAL(nshards, 1);
+        logMessage(LOG_WARNING_LEVEL,"Cache budget %zu bytes is too small, using %zu blocks",bytes,blocks);
+    }
+    tracking = 1;
+    if(lcloud_initcache_policy((int)blocks, nshards, pol) == -1) {
+        tracking = 0;
+        return -1;
+    }
+    logMessage(LcDriverLLevel,"Cache budget %zu bytes, %zu blocks",bytes,blocks);
     return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : getLine
-// Description  : Finds which line, if any the block is stored
+// Function     : lcloud_resizecache
+// Description  : Grows or shrinks the cache while it is in use. Shrinking
+//                evicts (and writes back) what the policy would evict next.
+//                Every shard is locked for the duration, and the resize is
+//                refused while a block is pinned, since pins point into the
+//                lines being reallocated. Restarts the hit ratio curve.
 //
-// Inputs       : did - The device ID the sector is in, sec - The sector the block is stored in, block - the block the data is tored in
+// Inputs       : maxblocks - the new size, at least one block per shard
 // Outputs      : 0 if successful, -1 if failure
-int getLine(LcDeviceId did, uint16_t sec, uint16_t blk) {
-    for(i=0;i<numLines;i++) {
-        if (cache[i].device == did && cache[i].sec == sec && cache[i].block == blk) {
-            return i;
+int lcloud_resizecache( int maxblocks ) {
+    int ret = 0;
+    int per;
+
+    if(shards == NULL || maxblocks < numShards) {
+        return -1;
+    }
+
+    for(int j=0;j<numShards;j++) {
+        if(locking) {
+            pthread_rwlock_wrlock(&shards[j].lock);
+            applyTouches(&shards[j]);
+        }
+        for(int k=0;k<shards[j].topLine;k++) {
+            if(isPinned(&shards[j], k)) {
+                ret = -1;
+            }
         }
     }
 
-    return -1;
-}
\ No newline at end of file
+    totalBlocks = 0;
+    for(int j=0;j<numShards;j++) {
+        per = maxblocks / numShards + (j < maxblocks % numShards);
+        if(ret == 0 && per != shards[j].maxLines && resizeShard(&shards[j], per) == -1) {
+            logMessage(LOG_ERROR_LEVEL,"Could not resize cache shard %d to %d blocks",j,per);
+            ret = -1;
+        }
+        totalBlocks += shards[j].maxLines;
+    }
+
+    for(int j=0;j<numShards && locking;j++) {
+        pthread_rwlock_unlock(&shards[j].lock);
+    }
+
+    if(tracking) {
+        pthread_mutex_lock(&curveLock);
+        freeCurve();
+        if(initCurve() == -1) {
+            logMessage(LOG_WARNING_LEVEL,"Could not restart the cache hit ratio curve");
+            tracking = 0;
+        }
+        pthread_mutex_unlock(&curveLock);
+    }
+    if(ret == 0) {
+        logMessage(LcDriverLLevel,"Cache resized to %d blocks",totalBlocks);
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachecurve
+// Description  : Gets the estimated hit ratio of an LRU cache at sizes from
+//                a quarter to four times the current one, from the lookups
+//                seen since the cache was last sized
+//
+// Inputs       : pts - where to put the points, smallest size first
+//                max - room in pts (LC_CACHE_CURVE_POINTS for all)
+// Outputs      : number of points, -1 if the curve is not kept
+int lcloud_cachecurve( LcCacheCurvePoint *pts, int max ) {
+    int n = CMPSC311_MINVAL(max, LC_CACHE_CURVE_POINTS);
+
+    if(pts == NULL) {
+        return -1;
+    }
+
+    //A resize frees and rebuilds the curve under the lock
+    pthread_mutex_lock(&curveLock);
+    if(curve == NULL) {
+        pthread_mutex_unlock(&curveLock);
+        return -1;
+    }
+    curvePoints(pts, n);
+    pthread_mutex_unlock(&curveLock);
+    return( n );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_tunecache
+// Description  : Resizes the cache to the smallest size on the curve whose
+//                hit ratio is within LC_CACHE_TUNE_SLACK of the best size that
+//                fits the budget. Does nothing until the largest simulation
+//                has seen enough lookups to fill it twice over.
+//
+// Inputs       : none
+// Outputs      : the cache size afterwards, -1 if failure
+int lcloud_tunecache( void ) {
+    LcCacheCurvePoint pts[LC_CACHE_CURVE_POINTS];
+    double best = 0;
+    int blocks = totalBlocks;
+    int ready;
+
+    pthread_mutex_lock(&curveLock);
+    if(curve == NULL) {
+        pthread_mutex_unlock(&curveLock);
+        return -1;
+    }
+    ready = (curveLookups >= 2 * (uint64_t)curve[LC_CACHE_CURVE_POINTS-1].maxLines);
+    curvePoints(pts, LC_CACHE_CURVE_POINTS);
+    pthread_mutex_unlock(&curveLock);
+    if(!ready) {
+        return totalBlocks;
+    }
+
+    for(int j=0;j<LC_CACHE_CURVE_POINTS;j++) {
+        if(pts[j].blocks >= numShards && pts[j].blocks <= blockCap) {
+            best = CMPSC311_MAXVAL(best, pts[j].hitRatio);
+        }
+    }
+    for(int j=0;j<LC_CACHE_CURVE_POINTS;j++) {
+        if(pts[j].blocks >= numShards && pts[j].blocks <= blockCap && pts[j].hitRatio >= best - LC_CACHE_TUNE_SLACK) {
+            blocks = pts[j].blocks;
+            break;
+        }
+    }
+
+    if(blocks != totalBlocks && lcloud_resizecache(blocks) == -1) {
+        return -1;
+    }
+    return totalBlocks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachestats
+// Description  : Get the cache counters of one device, can be called while
+//                the cache is in use (counters are read without locking)
+//
+// Inputs       : did - the device, IDs at or above LC_CACHE_MAXDEVICES
+//                      share the last slot
+//                stats - where to put the counters
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_cachestats( int did, LcCacheStats *stats ) {
+    int d = CMPSC311_MINVAL(did, LC_CACHE_MAXDEVICES);
+
+    if(shards == NULL || stats == NULL || did < 0) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(LcCacheStats));
+    for(int j=0;j<numShards;j++) {
+        addStats(stats, &shards[j].stats[d]);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachehistogram
+// Description  : Counts the blocks of one device resident in the cache, per
+//                sector, so the hot parts of a device show. Walks every
+//                line under the shard's shared lock, so it is meant for the
+//                occasional query rather than every operation.
+//
+// Inputs       : did - the device (all of it, not just its stats slot)
+//                counts - where to put the counts, sectors at or above
+//                         max - 1 are counted in the last one
+//                max - room in counts
+// Outputs      : number of counts up to the last non zero one, -1 if failure
+
+int lcloud_cachehistogram( int did, uint64_t *counts, int max ) {
+    uint64_t key;
+    int used = 0;
+    int sec;
+
+    if(shards == NULL || counts == NULL || max <= 0 || did < 0 || did > UINT8_MAX) {
+        return -1;
+    }
+
+    memset(counts, 0, sizeof(uint64_t) * max);
+    for(int j=0;j<numShards;j++) {
+        if(locking) {
+            pthread_rwlock_rdlock(&shards[j].lock);
+        }
+        for(int k=0;k<shards[j].topLine;k++) {
+            key = shards[j].index[k].key;
+            if(key != LC_CACHE_NOKEY && (int)(key >> 32) == did) {
+                sec = CMPSC311_MINVAL((int)(uint16_t)(key >> 16), max - 1);
+                counts[sec]++;
+                used = CMPSC311_MAXVAL(used, sec + 1);
+            }
+        }
+        if(locking) {
+            pthread_rwlock_unlock(&shards[j].lock);
+        }
+    }
+    return( used );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_loadsnapshot
+// Description  : Warm start, fills the cache from the LC_CACHE_SNAPSHOT file
+//                if it is valid and was saved with the given tag. A bad,
+//                stale or missing snapshot just means a cold start.
+//
+// Inputs       : tag - what the devices hold now, as given to
+//                      lcloud_snapshottag by the run that saved it
+// Outputs      : number of blocks loaded, -1 if none were
+
+int lcloud_loadsnapshot( uint64_t tag ) {
+    if(shards == NULL || getenv("LC_CACHE_SNAPSHOT") == NULL) {
+        return -1;
+    }
+    return loadSnapshot(getenv("LC_CACHE_SNAPSHOT"), tag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_snapshottag
+// Description  : Sets the tag saved with the snapshot at close. It names
+//                the devices' contents the clean blocks match, so a later
+//                run can tell whether they changed in between.
+//
+// Inputs       : tag - the tag, 0 to save no snapshot
+// Outputs      : none
+
+void lcloud_snapshottag( uint64_t tag ) {
+    snapTag = tag;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_closecache
+// Description  : Clean up the cache when program is closing, saving the
+//                clean blocks to the LC_CACHE_SNAPSHOT file if set
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_closecache( void ) {
+    LcCacheStats total;             //Counters over every device
+    LcCacheStats st;
+    const char *fname = getenv("LC_CACHE_STATS");
+
+    if(shards == NULL) {
+        return -1;
+    }
+
+    //Report while the counters are still there
+    memset(&total, 0, sizeof(total));
+    for(int d=0;d<=LC_CACHE_MAXDEVICES;d++) {
+        lcloud_cachestats(d, &st);
+        addStats(&total, &st);
+        if(st.hits + st.misses + st.inserts > 0) {
+            logMessage(LcDriverLLevel,"DEVICE %d: hits %"PRIu64", misses %"PRIu64", inserts %"PRIu64", evictions %"PRIu64
+                ", flushes %"PRIu64", resident %"PRIu64", prefetches %"PRIu64", prefetch hits %"PRIu64", rmw skips %"PRIu64,
+                d, st.hits, st.misses, st.inserts, st.evictions, st.flushes, st.resident, st.prefetches, st.prefetchHits,
+                st.rmwSkips);
+        }
+    }
+    if(curve != NULL) {
+        LcCacheCurvePoint pts[LC_CACHE_CURVE_POINTS];
+        int n = lcloud_cachecurve(pts, LC_CACHE_CURVE_POINTS);
+        for(int j=0;j<n;j++) {
+            logMessage(LcDriverLLevel,"CACHE CURVE: %d blocks, estimated hit ratio %.2f",pts[j].blocks,pts[j].hitRatio);
+        }
+    }
+    if(fname != NULL && dumpStats(fname) == -1) {
+        logMessage(LOG_WARNING_LEVEL,"Could not write cache statistics to [%s]",fname);
+    }
+    if(getenv("LC_CACHE_SNAPSHOT") != NULL && snapTag != 0 && saveSnapshot(getenv("LC_CACHE_SNAPSHOT")) == -1) {
+        logMessage(LOG_WARNING_LEVEL,"Could not write cache snapshot to [%s]",getenv("LC_CACHE_SNAPSHOT"));
+    }
+
+    for(int j=0;j<numShards;j++) {
+        if(shards[j].numDirty > 0) {
+            logMessage(LOG_WARNING_LEVEL,"Closing cache with %d unflushed blocks",shards[j].numDirty);
+        }
+        freeLines(&shards[j], shards[j].maxLines);
+        free(shards[j].ghosts);
+        free(shards[j].ghostBuckets);
+        if(locking) {
+            pthread_rwlock_destroy(&shards[j].lock);
+        }
+    }
+    free(shards);
+    shards = NULL;
+    numShards = 0;
+    freeCurve();
+    tracking = 0;
+    snapTag = 0;
+
+    logMessage(LcDriverLLevel,"CACHE POLICY: %s",policy->name);
+    logMessage(LcDriverLLevel,"NUMBER OF HITS: %"PRIu64,total.hits);
+    logMessage(LcDriverLLevel,"NUMBER OF MISSES: %"PRIu64,total.misses);
+    float ratio = (total.hits+total.misses) ? (float)total.hits / (float)(total.hits+total.misses) : 0;
+    logMessage(LcDriverLLevel,"HIT RATIO: %.2f",ratio);
+    if(total.prefetches > 0) {
+        logMessage(LcDriverLLevel,"PREFETCHES: %"PRIu64", PREFETCH HITS: %"PRIu64,total.prefetches,total.prefetchHits);
+    }
+    if(total.rmwSkips > 0) {
+        logMessage(LcDriverLLevel,"WRITES WITHOUT READ: %"PRIu64,total.rmwSkips);
+    }
+
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getShard
+// Description  : Hashes a block key and picks its shard
+//
+// Inputs       : key - the packed (device, sector, block) key
+//                hash - where to store the hash for the bucket lookup
+// Outputs      : the shard the block belongs in
+CACHE_SHARD *getShard(uint64_t key, uint64_t *hash) {
+
+    //Fibonacci hashing, the high bits of the product are well mixed. The
+    //bucket uses bits 32 and up, the shard the very top bits.
+    key *= 0x9E3779B97F4A7C15ULL;
+    *hash = key;
+    if(shardBits == 0) {
+        return &shards[0];
+    }
+    return &shards[key >> (64 - shardBits)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getLine
+// Description  : Finds which line, if any the block is stored
+//
+// Inputs       : s - the shard, hash - the hash of the block, key - the block key
+// Outputs      : the line number if found, -1 if not in cache
+int getLine(CACHE_SHARD *s, uint64_t hash, uint64_t key) {
+    int32_t line = s->buckets[(uint32_t)(hash >> 32) & s->bucketMask];
+
+    while(line != LC_CACHE_NIL) {
+        if (s->index[line].key == key) {
+            return line;
+        }
+        line = s->index[line].hashNext;
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : putLine
+// Description  : Puts a block in the cache, writing back the dirty block it
+//                displaces if there is one
+//
+// Inputs       : did - device number, sec - sector number, blk - block number,
+//                block - the data, how - LC_PUT_CLEAN, LC_PUT_DIRTY or
+//                LC_PUT_PREFETCH
+// Outputs      : 0 if succesfully inserted, 1 if a prefetch found the block
+//                cached already, -1 if failure
+int putLine(LcDeviceId did, uint16_t sec, uint16_t blk, char *block, int how) {
+    int line;                                   //Which line in cache to put the block
+    int dirty = (how == LC_PUT_DIRTY);
+    uint32_t bucket;
+    uint64_t hash;
+    uint64_t key = LC_CACHE_KEY(did, sec, blk);
+    CACHE_SHARD *s = getShard(key, &hash);
+
+    if(locking) {
+        pthread_rwlock_wrlock(&s->lock);
+        applyTouches(s);
+    }
+
+    line = getLine(s, hash, key);
+    //Block in cache, just refresh it (read ahead leaves it alone)
+    if (line != -1 && how == LC_PUT_PREFETCH) {
+        if(locking) {
+            pthread_rwlock_unlock(&s->lock);
+        }
+        return( 1 );
+    }
+    if (line != -1) {
+        policy->hit(s, line);
+    }
+    else {
+        //Let the policy make room, then take the evicted line or a free one
+        line = policy->miss(s, key);
+        if (line != LC_CACHE_NIL) {
+            //A dirty block that cannot be written back stays, the put fails
+            if(s->lines[line].dirty && cleanLine(s, line) == -1) {
+                keepVictim(s, line);
+                if(locking) {
+                    pthread_rwlock_unlock(&s->lock);
+                }
+                return( -1 );
+            }
+            devStats(s, s->index[line].key)->evictions++;
+            devStats(s, s->index[line].key)->resident--;
+            unhashLine(s, line);
+        }
+        else if (s->freeLine != LC_CACHE_NIL) {
+            line = s->freeLine;
+            s->freeLine = s->index[line].hashNext;
+            s->numLines++;
+        }
+        else if (s->numLines < s->maxLines) {
+            line = s->topLine;
+            s->topLine++;
+            s->numLines++;
+        }
+        else {
+            if(locking) {
+                pthread_rwlock_unlock(&s->lock);
+            }
+            return( -1 );
+        }
+
+        //Set cache line and index it
+        s->index[line].key = key;
+        s->lines[line].dirty = 0;
+        __atomic_store_n(&s->lines[line].prefetched, (how == LC_PUT_PREFETCH), __ATOMIC_RELAXED);
+        bucket = (uint32_t)(hash >> 32) & s->bucketMask;
+        s->index[line].hashNext = s->buckets[bucket];
+        s->buckets[bucket] = line;
+        policy->insert(s, line);
+        devStats(s, key)->inserts++;
+        devStats(s, key)->resident++;
+        if(how == LC_PUT_PREFETCH) {
+            devStats(s, key)->prefetches++;
+        }
+    }
+    memcpy(LINE_DATA(s, line),block,LC_DEVICE_BLOCK_SIZE);
+
+    //A clean put means the device has this data, so an older dirty copy is moot
+    if(dirty != s->lines[line].dirty) {
+        s->numDirty += dirty ? 1 : -1;
+        s->lines[line].dirty = dirty;
+    }
+
+    if(locking) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : notePrefetch
+// Description  : Counts a prefetch hit the first time a line brought in by
+//                read ahead is used. Safe under the shared lock.
+//
+// Inputs       : s - the shard, line - the line that was hit, key - its key
+// Outputs      : none
+void notePrefetch(CACHE_SHARD *s, int line, uint64_t key) {
+    if(__atomic_load_n(&s->lines[line].prefetched, __ATOMIC_RELAXED) && __atomic_exchange_n(&s->lines[line].prefetched, 0, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&devStats(s, key)->prefetchHits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cleanLine
+// Description  : Writes a dirty line back to the device and marks it clean.
+//                Caller must hold the exclusive lock.
+//
+// Inputs       : s - the shard, line - the dirty line
+// Outputs      : 0 if successful, -1 if the write back failed
+int cleanLine(CACHE_SHARD *s, int line) {
+    uint64_t key = s->index[line].key;
+
+    if(writeback((LcDeviceId)(key >> 32), (uint16_t)(key >> 16), (uint16_t)key, LINE_DATA(s, line)) == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Cache write back failed for block %"PRIu64,key);
+        return( -1 );
+    }
+    s->lines[line].dirty = 0;
+    s->numDirty--;
+    devStats(s, key)->flushes++;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : devStats
+// Description  : Finds the counters a block is accounted to
+//
+// Inputs       : s - the shard, key - the block key
+// Outputs      : the counters of the block's device in this shard
+LcCacheStats *devStats(CACHE_SHARD *s, uint64_t key) {
+    uint64_t did = key >> 32;
+
+    return &s->stats[CMPSC311_MINVAL(did, LC_CACHE_MAXDEVICES)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addStats
+// Description  : Adds one set of counters into another
+//
+// Inputs       : sum - the running total, st - the counters to add
+// Outputs      : none
+void addStats(LcCacheStats *sum, const LcCacheStats *st) {
+    sum->hits += __atomic_load_n(&st->hits, __ATOMIC_RELAXED);
+    sum->misses += __atomic_load_n(&st->misses, __ATOMIC_RELAXED);
+    sum->inserts += st->inserts;
+    sum->evictions += st->evictions;
+    sum->flushes += st->flushes;
+    sum->resident += st->resident;
+    sum->prefetches += st->prefetches;
+    sum->prefetchHits += __atomic_load_n(&st->prefetchHits, __ATOMIC_RELAXED);
+    sum->rmwSkips += __atomic_load_n(&st->rmwSkips, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dumpStats
+// Description  : Writes the per device counters to a file, as CSV if the
+//                name ends in .csv and as JSON otherwise
+//
+// Inputs       : fname - the file to write
+// Outputs      : 0 if successful, -1 if failure
+int dumpStats(const char *fname) {
+    size_t len = strlen(fname);
+    int csv = (len >= 4 && strcasecmp(&fname[len-4], ".csv") == 0);
+    int first = 1;
+    int n;
+    LcCacheStats st;
+    uint64_t hist[LC_CACHE_HIST_SECTORS];          //Resident blocks per sector of a device
+    FILE *fh = fopen(fname, "w");
+
+    if(fh == NULL) {
+        return -1;
+    }
+
+    if(csv) {
+        fprintf(fh, "device,hits,misses,inserts,evictions,flushes,resident,prefetches,prefetchHits,rmwSkips\n");
+    }
+    else {
+        fprintf(fh, "{\n  \"policy\": \"%s\",\n  \"blocks\": %d,\n  \"devices\": [", policy->name, totalBlocks);
+    }
+    for(int d=0;d<=LC_CACHE_MAXDEVICES;d++) {
+        lcloud_cachestats(d, &st);
+        if(st.hits + st.misses + st.inserts == 0) {
+            continue;
+        }
+        if(csv) {
+            fprintf(fh, "%d,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+                d, st.hits, st.misses, st.inserts, st.evictions, st.flushes, st.resident, st.prefetches, st.prefetchHits,
+                st.rmwSkips);
+        }
+        else {
+            fprintf(fh, "%s\n    { \"device\": %d, \"hits\": %"PRIu64", \"misses\": %"PRIu64", \"inserts\": %"PRIu64
+                ", \"evictions\": %"PRIu64", \"flushes\": %"PRIu64", \"resident\": %"PRIu64
+                ", \"prefetches\": %"PRIu64", \"prefetchHits\": %"PRIu64", \"rmwSkips\": %"PRIu64,
+                first ? "" : ",", d, st.hits, st.misses, st.inserts, st.evictions, st.flushes, st.resident,
+                st.prefetches, st.prefetchHits, st.rmwSkips);
+            first = 0;
+
+            //Where the device's resident blocks are, the shared slot has no single device
+            n = (d < LC_CACHE_MAXDEVICES) ? lcloud_cachehistogram(d, hist, LC_CACHE_HIST_SECTORS) : 0;
+            if(n > 0) {
+                fprintf(fh, ", \"sectors\": [");
+                for(int j=0;j<n;j++) {
+                    fprintf(fh, "%s%"PRIu64, j ? ", " : "", hist[j]);
+                }
+                fprintf(fh, "]");
+            }
+            fprintf(fh, " }");
+        }
+    }
+    if(!csv) {
+        fprintf(fh, "\n  ]");
+        if(curve != NULL) {
+            LcCacheCurvePoint pts[LC_CACHE_CURVE_POINTS];
+            int n = lcloud_cachecurve(pts, LC_CACHE_CURVE_POINTS);
+            fprintf(fh, ",\n  \"curve\": [");
+            for(int j=0;j<n;j++) {
+                fprintf(fh, "%s\n    { \"blocks\": %d, \"hitRatio\": %.4f }", j ? "," : "", pts[j].blocks, pts[j].hitRatio);
+            }
+            fprintf(fh, "\n  ]");
+        }
+        fprintf(fh, "\n}\n");
+    }
+
+    return (fclose(fh) == 0) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initShard
+// Description  : Allocates the lines, hash index and ghosts of one shard
+//
+// Inputs       : s - the (zeroed) shard, maxlines - its capacity
+// Outputs      : 0 if successful, -1 if failure
+int initShard(CACHE_SHARD *s, int maxlines) {
+    if(allocLines(s, maxlines) == -1) {
+        return -1;
+    }
+    //Ghosts never outnumber the lines
+    if(policy->ghosts && allocGhosts(s, maxlines) == -1) {
+        return -1;
+    }
+    if(locking && pthread_rwlock_init(&s->lock, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : numBuckets
+// Description  : Size of a hash index, keeping the load factor at or below
+//                1/2 so chains stay short
+//
+// Inputs       : n - the most entries the index will hold
+// Outputs      : the number of buckets (a power of two)
+uint32_t numBuckets(int n) {
+    uint32_t b = 1;
+
+    while(b < (uint32_t)n * 2) {
+        b <<= 1;
+    }
+    return b;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocLines
+// Description  : Allocates empty lines, their hash index and the arena
+//                holding their blocks
+//
+// Inputs       : s - the shard, maxlines - its capacity
+// Outputs      : 0 if successful, -1 if failure
+int allocLines(CACHE_SHARD *s, int maxlines) {
+    uint32_t nb = numBuckets(maxlines);
+
+    s->index = (CACHE_INDEX *)malloc(sizeof(CACHE_INDEX) * maxlines);
+    s->lines = (CACHE_LINE *)malloc(sizeof(CACHE_LINE) * maxlines);
+    s->data = allocArena((size_t)maxlines * LC_DEVICE_BLOCK_SIZE);
+    s->buckets = (int32_t *)malloc(sizeof(int32_t) * nb);
+    if(s->index == NULL || s->lines == NULL || s->data == NULL || s->buckets == NULL) {
+        freeLines(s, maxlines);
+        return -1;
+    }
+    s->maxLines = maxlines;
+    s->bucketMask = nb - 1;
+    s->numLines = 0;
+    s->topLine = 0;
+    s->freeLine = LC_CACHE_NIL;
+    for(int j=0;j<2;j++) {
+        s->lists[j].mru = s->lists[j].lru = LC_CACHE_NIL;
+        s->lists[j].size = 0;
+    }
+
+    //Initialize each values to nonsense
+    for(int j=0;j<maxlines;j++) {
+        s->index[j].key = LC_CACHE_NOKEY;
+        s->index[j].hashNext = LC_CACHE_NIL;
+        s->index[j].pins = 0;
+        s->lines[j].prev = LC_CACHE_NIL;
+        s->lines[j].next = LC_CACHE_NIL;
+        s->lines[j].dirty = 0;
+        __atomic_store_n(&s->lines[j].prefetched, 0, __ATOMIC_RELAXED);
+    }
+    for(uint32_t j=0;j<nb;j++) {
+        s->buckets[j] = LC_CACHE_NIL;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeLines
+// Description  : Frees what allocLines allocated
+//
+// Inputs       : s - the shard, maxlines - the capacity it was allocated with
+// Outputs      : none
+void freeLines(CACHE_SHARD *s, int maxlines) {
+    free(s->index);
+    free(s->lines);
+    freeArena(s->data, (size_t)maxlines * LC_DEVICE_BLOCK_SIZE);
+    free(s->buckets);
+    s->index = NULL;
+    s->lines = NULL;
+    s->data = NULL;
+    s->buckets = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocArena
+// Description  : Allocates memory for blocks, aligned to a CPU cache line.
+//                Big arenas are mapped straight from the kernel on a huge
+//                page boundary and advised to use huge pages, so a big cache
+//                costs a few TLB entries and goes back to the system in full
+//                when freed.
+//
+// Inputs       : bytes - the size of the arena
+// Outputs      : the arena, NULL if failure
+char *allocArena(size_t bytes) {
+    size_t len = (bytes + 4095) & ~(size_t)4095;
+    uintptr_t start;
+    char *p;
+    void *q;
+
+    if(bytes < LC_CACHE_HUGEPAGE) {
+        return (posix_memalign(&q, LC_CACHE_ALIGN, CMPSC311_MAXVAL(bytes, 1)) == 0) ? (char *)q : NULL;
+    }
+
+    //Map a huge page extra, then trim both ends so the arena starts on one
+    p = (char *)mmap(NULL, len + LC_CACHE_HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+    start = ((uintptr_t)p + LC_CACHE_HUGEPAGE - 1) & ~(uintptr_t)(LC_CACHE_HUGEPAGE - 1);
+    if(start > (uintptr_t)p) {
+        munmap(p, start - (uintptr_t)p);
+    }
+    munmap((char *)start + len, (uintptr_t)p + LC_CACHE_HUGEPAGE - start);
+#ifdef MADV_HUGEPAGE
+    madvise((char *)start, len, MADV_HUGEPAGE);
+#endif
+    return (char *)start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeArena
+// Description  : Frees an arena from allocArena
+//
+// Inputs       : p - the arena (may be NULL), bytes - the size it was allocated with
+// Outputs      : none
+void freeArena(char *p, size_t bytes) {
+    if(p == NULL) {
+        return;
+    }
+    if(bytes < LC_CACHE_HUGEPAGE) {
+        free(p);
+    }
+    else {
+        munmap(p, (bytes + 4095) & ~(size_t)4095);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocGhosts
+// Description  : Allocates a free pool of ghosts and their hash index
+//
+// Inputs       : s - the shard, n - the most ghosts kept (one spare is
+//                added for the policy to juggle)
+// Outputs      : 0 if successful, -1 if failure
+int allocGhosts(CACHE_SHARD *s, int n) {
+    uint32_t nb = numBuckets(n);
+
+    s->ghosts = (GHOST *)malloc(sizeof(GHOST) * (n + 1));
+    s->ghostBuckets = (int32_t *)malloc(sizeof(int32_t) * nb);
+    if(s->ghosts == NULL || s->ghostBuckets == NULL) {
+        free(s->ghosts);
+        free(s->ghostBuckets);
+        s->ghosts = NULL;
+        s->ghostBuckets = NULL;
+        return -1;
+    }
+    s->ghostMask = nb - 1;
+    for(int j=0;j<=n;j++) {
+        s->ghosts[j].next = (j < n) ? j+1 : LC_CACHE_NIL;
+    }
+    s->ghostFree = 0;
+    for(int j=0;j<2;j++) {
+        s->ghostLists[j].mru = s->ghostLists[j].lru = LC_CACHE_NIL;
+        s->ghostLists[j].size = 0;
+    }
+    for(uint32_t j=0;j<nb;j++) {
+        s->ghostBuckets[j] = LC_CACHE_NIL;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resizeShard
+// Description  : Changes the capacity of a shard. When shrinking the policy
+//                picks the lines to evict, as if for that many misses. The
+//                survivors and ghosts are then copied into arrays of the new
+//                size in list order, so the policy state carries over. Caller
+//                must hold the exclusive lock and have checked for pins.
+//
+// Inputs       : s - the shard, maxlines - the new capacity
+// Outputs      : 0 if successful, -1 if failure (shard unchanged)
+int resizeShard(CACHE_SHARD *s, int maxlines) {
+    CACHE_SHARD ns;                             //The new arrays, built beside the old ones
+    uint64_t hash;
+    uint32_t bucket;
+    int oldMax = s->maxLines;
+    int line;
+    int n = 0;
+
+    memset(&ns, 0, sizeof(ns));
+    if(allocLines(&ns, maxlines) == -1 || (policy->ghosts && allocGhosts(&ns, maxlines) == -1)) {
+        freeLines(&ns, maxlines);
+        return -1;
+    }
+
+    //Evicted lines leave holes the copy below fills, so nothing can be
+    //put back once eviction starts. Write back first, a dirty block that
+    //cannot be written back stops the resize instead.
+    for(line=0;line<s->topLine && s->numLines > maxlines && s->numDirty > 0;line++) {
+        if(s->lines[line].dirty && cleanLine(s, line) == -1) {
+            freeLines(&ns, maxlines);
+            free(ns.ghosts);
+            free(ns.ghostBuckets);
+            return -1;
+        }
+    }
+
+    //Evict down to the new size
+    s->maxLines = maxlines;
+    s->target = CMPSC311_MINVAL(s->target, maxlines);
+    while(s->numLines > maxlines) {
+        line = policy->miss(s, LC_CACHE_NOKEY);
+        devStats(s, s->index[line].key)->evictions++;
+        devStats(s, s->index[line].key)->resident--;
+        unhashLine(s, line);
+        s->numLines--;
+    }
+
+    //Copy the survivors, least recent first so pushFront keeps the order
+    for(int l=0;l<2;l++) {
+        for(line=s->lists[l].lru;line!=LC_CACHE_NIL;line=s->lines[line].prev) {
+            ns.lines[n] = s->lines[line];
+            ns.index[n] = s->index[line];
+            memcpy(LINE_DATA(&ns, n), LINE_DATA(s, line), LC_DEVICE_BLOCK_SIZE);
+            getShard(ns.index[n].key, &hash);
+            bucket = (uint32_t)(hash >> 32) & ns.bucketMask;
+            ns.index[n].hashNext = ns.buckets[bucket];
+            ns.buckets[bucket] = n;
+            pushFront(&ns, l, n);
+            n++;
+        }
+    }
+
+    //Same for the ghosts, forgetting the oldest if there are too many
+    if(policy->ghosts) {
+        while(s->ghostLists[0].size + s->ghostLists[1].size > maxlines) {
+            dropGhost(s, s->ghostLists[s->ghostLists[1].size > s->ghostLists[0].size].lru);
+        }
+        for(int l=0;l<2;l++) {
+            for(int g=s->ghostLists[l].lru;g!=LC_CACHE_NIL;g=s->ghosts[g].prev) {
+                addGhost(&ns, l, s->ghosts[g].key);
+            }
+        }
+    }
+
+    freeLines(s, oldMax);
+    free(s->ghosts);
+    free(s->ghostBuckets);
+    s->index = ns.index;
+    s->lines = ns.lines;
+    s->data = ns.data;
+    s->buckets = ns.buckets;
+    s->bucketMask = ns.bucketMask;
+    s->numLines = n;
+    s->topLine = n;
+    s->freeLine = LC_CACHE_NIL;
+    memcpy(s->lists, ns.lists, sizeof(s->lists));
+    s->ghosts = ns.ghosts;
+    s->ghostBuckets = ns.ghostBuckets;
+    s->ghostMask = ns.ghostMask;
+    s->ghostFree = ns.ghostFree;
+    memcpy(s->ghostLists, ns.ghostLists, sizeof(s->ghostLists));
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lineBytes
+// Description  : Memory one block of capacity costs, assuming the hash
+//                indexes are rounded up as far as they can be
+//
+// Inputs       : none
+// Outputs      : bytes per block
+size_t lineBytes(void) {
+    size_t n = LC_DEVICE_BLOCK_SIZE + sizeof(CACHE_INDEX) + sizeof(CACHE_LINE) + 4 * sizeof(int32_t);
+
+    if(policy->ghosts) {
+        n += sizeof(GHOST) + 4 * sizeof(int32_t);
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : budgetFromEnv
+// Description  : Reads a memory budget from the LC_CACHE_BUDGET environment
+//                variable, a number of bytes with an optional K, M or G
+//
+// Inputs       : none
+// Outputs      : the budget in bytes, 0 if unset
+size_t budgetFromEnv(void) {
+    const char *str = getenv("LC_CACHE_BUDGET");
+    char *end;
+    size_t n;
+
+    if(str == NULL) {
+        return 0;
+    }
+    n = strtoull(str, &end, 10);
+    switch(*end) {
+        case 'g': case 'G':
+            n <<= 10;
+            /* fall through */
+        case 'm': case 'M':
+            n <<= 10;
+            /* fall through */
+        case 'k': case 'K':
+            n <<= 10;
+            break;
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initCurve
+// Description  : Sets up the simulations of the hit ratio curve for the
+//                current cache size. The sampling rate is picked so that all
+//                of them together hold at most LC_CACHE_CURVE_SAMPLES keys.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int initCurve(void) {
+    CACHE_SHARD *c;
+    int64_t total = 0;
+    int bits = 0;
+    int size;
+
+    for(int j=0;j<LC_CACHE_CURVE_POINTS;j++) {
+        total += (int64_t)totalBlocks * curveEighths[j] / 8;
+    }
+    while((total >> bits) > LC_CACHE_CURVE_SAMPLES) {
+        bits++;
+    }
+
+    c = (CACHE_SHARD *)calloc(LC_CACHE_CURVE_POINTS, sizeof(CACHE_SHARD));
+    if(c == NULL) {
+        return -1;
+    }
+    for(int j=0;j<LC_CACHE_CURVE_POINTS;j++) {
+        size = CMPSC311_MAXVAL((int)(((int64_t)totalBlocks * curveEighths[j] / 8) >> bits), 1);
+        c[j].maxLines = size;
+        if(allocGhosts(&c[j], size) == -1) {
+            for(int k=0;k<=j;k++) {
+                free(c[k].ghosts);
+                free(c[k].ghostBuckets);
+            }
+            free(c);
+            return -1;
+        }
+        curveHits[j] = 0;
+    }
+    curveBase = totalBlocks;
+    curveLookups = 0;
+
+    //Lookups check the curve and sampling rate before taking curveLock
+    __atomic_store_n(&curveBits, bits, __ATOMIC_RELAXED);
+    __atomic_store_n(&curve, c, __ATOMIC_RELEASE);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeCurve
+// Description  : Frees the simulations of the hit ratio curve
+//
+// Inputs       : none
+// Outputs      : none
+void freeCurve(void) {
+    if(curve == NULL) {
+        return;
+    }
+    for(int j=0;j<LC_CACHE_CURVE_POINTS;j++) {
+        free(curve[j].ghosts);
+        free(curve[j].ghostBuckets);
+    }
+    free(curve);
+    __atomic_store_n(&curve, NULL, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : curvePoints
+// Description  : Reads the curve's points, curveLock held and the curve
+//                kept
+//
+// Inputs       : pts - where to put the points, n - how many
+// Outputs      : none
+void curvePoints(LcCacheCurvePoint *pts, int n) {
+    for(int j=0;j<n;j++) {
+        pts[j].blocks = (int)((int64_t)curveBase * curveEighths[j] / 8);
+        pts[j].hitRatio = curveLookups ? (double)curveHits[j] / (double)curveLookups : 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : noteAccess
+// Description  : Feeds a lookup to the hit ratio curve if its key is in the
+//                sample. Each simulated size moves the key to the head of its
+//                list, counting a hit if it was there. Lookups that find the
+//                curve busy are skipped rather than waited on.
+//
+// Inputs       : hash - the hash of the block, key - the block key
+// Outputs      : none
+void noteAccess(uint64_t hash, uint64_t key) {
+    CACHE_SHARD *c;
+    int bits = __atomic_load_n(&curveBits, __ATOMIC_RELAXED);
+    int g;
+
+    //Most lookups are not sampled and never touch the lock
+    if(__atomic_load_n(&curve, __ATOMIC_ACQUIRE) == NULL || (bits > 0 && (hash >> (64 - bits)) != 0)) {
+        return;
+    }
+    if(locking && pthread_mutex_trylock(&curveLock) != 0) {
+        return;
+    }
+
+    //A resize may have dropped or rebuilt the curve meanwhile
+    if(curve == NULL || (curveBits > 0 && (hash >> (64 - curveBits)) != 0)) {
+        if(locking) {
+            pthread_mutex_unlock(&curveLock);
+        }
+        return;
+    }
+
+    curveLookups++;
+    for(int j=0;j<LC_CACHE_CURVE_POINTS;j++) {
+        c = &curve[j];
+        g = findGhost(c, key);
+        if(g != LC_CACHE_NIL) {
+            curveHits[j]++;
+            dropGhost(c, g);
+        }
+        else if(c->ghostLists[0].size >= c->maxLines) {
+            dropGhost(c, c->ghostLists[0].lru);
+        }
+        addGhost(c, 0, key);
+    }
+
+    if(locking) {
+        pthread_mutex_unlock(&curveLock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshotData
+// Description  : Where the blocks start in a snapshot, after the header and
+//                keys, rounded up so they are aligned like the arena
+//
+// Inputs       : count - number of blocks in the snapshot
+// Outputs      : offset of the first block
+size_t snapshotData(uint64_t count) {
+    size_t off = sizeof(CACHE_SNAPSHOT) + count * sizeof(uint64_t);
+
+    return (off + LC_CACHE_ALIGN - 1) & ~(size_t)(LC_CACHE_ALIGN - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshotSum
+// Description  : Checksum of a snapshot's keys and blocks, FNV-1a over
+//                64 bit words
+//
+// Inputs       : p - the contents (8 byte aligned), len - their length (a
+//                multiple of 8)
+// Outputs      : the checksum
+uint64_t snapshotSum(const char *p, size_t len) {
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for(size_t j=0;j<len/sizeof(uint64_t);j++) {
+        h = (h ^ w[j]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : saveSnapshot
+// Description  : Writes the clean lines to a snapshot file, least recent
+//                first within each shard so reloading keeps their order.
+//                Dirty lines are left out, the device does not have them so
+//                they can not come back as clean. The file is written under
+//                a temporary name and renamed over the old one, so a crash
+//                leaves the old snapshot or the new one, never half of each.
+//
+// Inputs       : fname - the snapshot file
+// Outputs      : 0 if successful, -1 if failure
+int saveSnapshot(const char *fname) {
+    CACHE_SNAPSHOT *hdr;
+    char tmp[4096];
+    uint64_t count = 0;
+    uint64_t *keys;
+    size_t len;
+    char *p;
+    int fd;
+    int n = 0;
+
+    for(int j=0;j<numShards;j++) {
+        count += shards[j].numLines - shards[j].numDirty;
+    }
+    len = snapshotData(count) + count * LC_DEVICE_BLOCK_SIZE;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", fname) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+    if(ftruncate(fd, len) == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        unlink(tmp);
+        return -1;
+    }
+
+    //Keys and blocks, in the same order
+    keys = (uint64_t *)(p + sizeof(CACHE_SNAPSHOT));
+    for(int j=0;j<numShards;j++) {
+        CACHE_SHARD *s = &shards[j];
+        for(int l=0;l<2;l++) {
+            for(int line=s->lists[l].lru;line!=LC_CACHE_NIL;line=s->lines[line].prev) {
+                if(s->lines[line].dirty) {
+                    continue;
+                }
+                keys[n] = s->index[line].key;
+                memcpy(p + snapshotData(count) + (size_t)n * LC_DEVICE_BLOCK_SIZE, LINE_DATA(s, line), LC_DEVICE_BLOCK_SIZE);
+                n++;
+            }
+        }
+    }
+
+    hdr = (CACHE_SNAPSHOT *)p;
+    memcpy(hdr->magic, LC_SNAP_MAGIC, sizeof(hdr->magic));
+    hdr->version = LC_SNAP_VERSION;
+    hdr->blockSize = LC_DEVICE_BLOCK_SIZE;
+    hdr->count = count;
+    hdr->tag = snapTag;
+    hdr->checksum = snapshotSum(p + sizeof(CACHE_SNAPSHOT), len - sizeof(CACHE_SNAPSHOT));
+
+    if(msync(p, len, MS_SYNC) == -1 || munmap(p, len) == -1 || rename(tmp, fname) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    logMessage(LcDriverLLevel,"Cache snapshot of %"PRIu64" blocks written to [%s]",count,fname);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadSnapshot
+// Description  : Maps a snapshot file and puts its blocks in the cache. The
+//                file is checked (magic, version, block size, length, tag
+//                and checksum) before anything is used. If it holds more
+//                blocks than fit, the policy evicts as it would for any
+//                insert.
+//
+// Inputs       : fname - the snapshot file, tag - the tag it must have
+// Outputs      : number of blocks loaded, -1 if missing or invalid
+int loadSnapshot(const char *fname, uint64_t tag) {
+    const CACHE_SNAPSHOT *hdr;
+    const uint64_t *keys;
+    struct timespec start, end;
+    struct stat st;
+    const char *p;
+    uint64_t key;
+    int count;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = open(fname, O_RDONLY);
+    if(fd == -1) {
+        return -1;
+    }
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CACHE_SNAPSHOT)) {
+        close(fd);
+        logMessage(LOG_WARNING_LEVEL,"Cache snapshot [%s] is too short, starting cold",fname);
+        return -1;
+    }
+    p = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        return -1;
+    }
+    madvise((void *)p, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = (const CACHE_SNAPSHOT *)p;
+    if(memcmp(hdr->magic, LC_SNAP_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != LC_SNAP_VERSION ||
+        hdr->blockSize != LC_DEVICE_BLOCK_SIZE || hdr->count > (uint64_t)st.st_size / LC_DEVICE_BLOCK_SIZE ||
+        (size_t)st.st_size != snapshotData(hdr->count) + hdr->count * LC_DEVICE_BLOCK_SIZE ||
+        hdr->checksum != snapshotSum(p + sizeof(CACHE_SNAPSHOT), st.st_size - sizeof(CACHE_SNAPSHOT))) {
+        logMessage(LOG_WARNING_LEVEL,"Cache snapshot [%s] is not valid, starting cold",fname);
+        munmap((void *)p, st.st_size);
+        return -1;
+    }
+    if(hdr->tag != tag) {
+        logMessage(LOG_WARNING_LEVEL,"Cache snapshot [%s] is of older device contents, starting cold",fname);
+        munmap((void *)p, st.st_size);
+        return -1;
+    }
+
+    count = (int)hdr->count;
+    keys = (const uint64_t *)(p + sizeof(CACHE_SNAPSHOT));
+    for(uint64_t j=0;j<hdr->count;j++) {
+        key = keys[j];
+        putLine((LcDeviceId)(key >> 32), (uint16_t)(key >> 16), (uint16_t)key,
+            (char *)p + snapshotData(hdr->count) + j * LC_DEVICE_BLOCK_SIZE, LC_PUT_CLEAN);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    munmap((void *)p, st.st_size);
+    logMessage(LcDriverLLevel,"Cache warmed with %d blocks from [%s] in %.2f ms",count,fname,
+        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : policyFromEnv
+// Description  : Reads the replacement policy from the LC_CACHE_POLICY
+//                environment variable (lru, clock, 2q or arc)
+//
+// Inputs       : none
+// Outputs      : the policy, LC_CACHE_LRU if unset or unknown
+LcCachePolicy policyFromEnv(void) {
+    const char *name = getenv("LC_CACHE_POLICY");
+
+    if(name == NULL) {
+        return LC_CACHE_LRU;
+    }
+    for(int j=LC_CACHE_LRU;j<LC_CACHE_MAX_POLICY;j++) {
+        if(strcasecmp(name, policies[j].name) == 0) {
+            return j;
+        }
+    }
+    logMessage(LOG_WARNING_LEVEL,"Unknown cache policy [%s], using LRU",name);
+    return LC_CACHE_LRU;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : noteHit
+// Description  : Records that a line was hit. Without locking the policy
+//                sees the hit right away. With locking the caller only holds
+//                the shared lock, so unless the policy can take the hit
+//                concurrently it is buffered and replayed by the next caller
+//                to take the exclusive lock. If the buffer is full the hit is
+//                dropped, recency is approximate.
+//
+// Inputs       : s - the shard, line - the line that was hit
+// Outputs      : none
+void noteHit(CACHE_SHARD *s, int line) {
+    uint32_t slot;
+
+    if(!locking || policy->concurrentHit) {
+        policy->hit(s, line);
+        return;
+    }
+
+    slot = __atomic_fetch_add(&s->numTouched, 1, __ATOMIC_RELAXED);
+    if(slot < LC_CACHE_TOUCH_SLOTS) {
+        s->touched[slot] = line;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : applyTouches
+// Description  : Replays the hits recorded under the shared lock, oldest
+//                hit first. Caller must hold the exclusive lock.
+//
+// Inputs       : s - the shard
+// Outputs      : none
+void applyTouches(CACHE_SHARD *s) {
+    uint32_t n = s->numTouched;
+
+    if(n > LC_CACHE_TOUCH_SLOTS) {
+        n = LC_CACHE_TOUCH_SLOTS;
+    }
+    for(uint32_t j=0;j<n;j++) {
+        policy->hit(s, s->touched[j]);
+    }
+    s->numTouched = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlinkLine
+// Description  : Removes a line from the resident list it is on
+//
+// Inputs       : s - the shard, line - the line to remove
+// Outputs      : none
+void unlinkLine(CACHE_SHARD *s, int line) {
+    CACHE_LINE *cache = s->lines;
+    CACHE_LIST *l = &s->lists[cache[line].list];
+
+    if(cache[line].prev != LC_CACHE_NIL) {
+        cache[cache[line].prev].next = cache[line].next;
+    }
+    else {
+        l->mru = cache[line].next;
+    }
+    if(cache[line].next != LC_CACHE_NIL) {
+        cache[cache[line].next].prev = cache[line].prev;
+    }
+    else {
+        l->lru = cache[line].prev;
+    }
+    cache[line].prev = LC_CACHE_NIL;
+    cache[line].next = LC_CACHE_NIL;
+    l->size--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pushFront
+// Description  : Makes a line the most recently used line of a list
+//
+// Inputs       : s - the shard, list - which resident list,
+//                line - the line to insert at the head of the list
+// Outputs      : none
+void pushFront(CACHE_SHARD *s, int list, int line) {
+    CACHE_LINE *cache = s->lines;
+    CACHE_LIST *l = &s->lists[list];
+
+    cache[line].list = list;
+    cache[line].prev = LC_CACHE_NIL;
+    cache[line].next = l->mru;
+    if(l->mru != LC_CACHE_NIL) {
+        cache[l->mru].prev = line;
+    }
+    l->mru = line;
+    if(l->lru == LC_CACHE_NIL) {
+        l->lru = line;
+    }
+    l->size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unhashLine
+// Description  : Removes a line from the hash chain it is in
+//
+// Inputs       : s - the shard, line - the line to remove
+// Outputs      : none
+void unhashLine(CACHE_SHARD *s, int line) {
+    CACHE_INDEX *idx = s->index;
+    uint64_t hash;
+    int32_t *link;
+
+    getShard(idx[line].key, &hash);
+    link = &s->buckets[(uint32_t)(hash >> 32) & s->bucketMask];
+    while(*link != LC_CACHE_NIL) {
+        if(*link == line) {
+            *link = idx[line].hashNext;
+            break;
+        }
+        link = &idx[*link].hashNext;
+    }
+    idx[line].hashNext = LC_CACHE_NIL;
+    idx[line].key = LC_CACHE_NOKEY;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findGhost
+// Description  : Finds the ghost entry of a recently evicted block
+//
+// Inputs       : s - the shard, key - the block key
+// Outputs      : the ghost if found, LC_CACHE_NIL if not
+int findGhost(CACHE_SHARD *s, uint64_t key) {
+    uint64_t hash;
+    int32_t g;
+
+    getShard(key, &hash);
+    g = s->ghostBuckets[(uint32_t)(hash >> 32) & s->ghostMask];
+    while(g != LC_CACHE_NIL && s->ghosts[g].key != key) {
+        g = s->ghosts[g].hashNext;
+    }
+    return g;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addGhost
+// Description  : Remembers the key of an evicted block at the head of a
+//                ghost list. If every ghost is in use the oldest ghost of
+//                the longer list is forgotten first.
+//
+// Inputs       : s - the shard, list - which ghost list, key - the block key
+// Outputs      : none
+void addGhost(CACHE_SHARD *s, int list, uint64_t key) {
+    GHOST *gh = s->ghosts;
+    CACHE_LIST *l = &s->ghostLists[list];
+    uint64_t hash;
+    uint32_t bucket;
+    int32_t g;
+
+    if(s->ghostFree == LC_CACHE_NIL) {
+        dropGhost(s, s->ghostLists[s->ghostLists[1].size > s->ghostLists[0].size].lru);
+    }
+    g = s->ghostFree;
+    s->ghostFree = gh[g].next;
+
+    //Index it
+    getShard(key, &hash);
+    bucket = (uint32_t)(hash >> 32) & s->ghostMask;
+    gh[g].key = key;
+    gh[g].hashNext = s->ghostBuckets[bucket];
+    s->ghostBuckets[bucket] = g;
+
+    //Link it at the head of the list
+    gh[g].list = list;
+    gh[g].prev = LC_CACHE_NIL;
+    gh[g].next = l->mru;
+    if(l->mru != LC_CACHE_NIL) {
+        gh[l->mru].prev = g;
+    }
+    l->mru = g;
+    if(l->lru == LC_CACHE_NIL) {
+        l->lru = g;
+    }
+    l->size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dropGhost
+// Description  : Forgets a ghost, unlinking it from its list and hash chain
+//
+// Inputs       : s - the shard, ghost - the ghost to forget
+// Outputs      : none
+void dropGhost(CACHE_SHARD *s, int ghost) {
+    GHOST *gh = s->ghosts;
+    CACHE_LIST *l = &s->ghostLists[gh[ghost].list];
+    uint64_t hash;
+    int32_t *link;
+
+    if(gh[ghost].prev != LC_CACHE_NIL) {
+        gh[gh[ghost].prev].next = gh[ghost].next;
+    }
+    else {
+        l->mru = gh[ghost].next;
+    }
+    if(gh[ghost].next != LC_CACHE_NIL) {
+        gh[gh[ghost].next].prev = gh[ghost].prev;
+    }
+    else {
+        l->lru = gh[ghost].prev;
+    }
+    l->size--;
+
+    getShard(gh[ghost].key, &hash);
+    link = &s->ghostBuckets[(uint32_t)(hash >> 32) & s->ghostMask];
+    while(*link != ghost) {
+        link = &gh[*link].hashNext;
+    }
+    *link = gh[ghost].hashNext;
+
+    gh[ghost].next = s->ghostFree;
+    s->ghostFree = ghost;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : isPinned
+// Description  : Is a line pinned by a reader (and so not evictable)
+//
+// Inputs       : s - the shard, line - the line
+// Outputs      : non zero if pinned
+int isPinned(CACHE_SHARD *s, int line) {
+    return __atomic_load_n(&s->index[line].pins, __ATOMIC_ACQUIRE) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : takeVictim
+// Description  : Unlinks the least recently used line of a list that is not
+//                pinned. Pins are short lived, so this rarely walks far.
+//
+// Inputs       : s - the shard, list - which resident list
+// Outputs      : the line, LC_CACHE_NIL if every line on the list is pinned
+int takeVictim(CACHE_SHARD *s, int list) {
+    int line = s->lists[list].lru;
+
+    while(line != LC_CACHE_NIL && isPinned(s, line)) {
+        line = s->lines[line].prev;
+    }
+    if(line != LC_CACHE_NIL) {
+        unlinkLine(s, line);
+    }
+    return line;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dropLine
+// Description  : Forgets a line. It goes on the shard's free lines, which
+//                putLine takes before any line past topLine, so nothing
+//                else moves and a pinned line elsewhere is no obstacle. The
+//                line itself may not be pinned. Caller must hold the
+//                exclusive lock, with the touched lines applied.
+//
+// Inputs       : s - the shard, line - the line to drop
+// Outputs      : none
+void dropLine(CACHE_SHARD *s, int line) {
+    if(s->lines[line].dirty) {
+        s->numDirty--;
+        s->lines[line].dirty = 0;
+    }
+    devStats(s, s->index[line].key)->resident--;
+    unlinkLine(s, line);
+    unhashLine(s, line);
+    s->index[line].hashNext = s->freeLine;
+    s->freeLine = line;
+    s->numLines--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : keepVictim
+// Description  : Puts a line the policy picked for eviction back in the
+//                shard, as the most recent line of its list, and forgets
+//                the ghost the policy may have made of it. Used when the
+//                line is dirty and could not be written back.
+//
+// Inputs       : s - the shard, line - the unlinked victim
+// Outputs      : none
+void keepVictim(CACHE_SHARD *s, int line) {
+    int g;
+
+    if(policy->ghosts && (g = findGhost(s, s->index[line].key)) != LC_CACHE_NIL) {
+        dropGhost(s, g);
+    }
+    pushFront(s, s->lines[line].list, line);
+}
+
+//
+// Replacement policies. Each sees a shard through its resident lists
+// (lists[0], lists[1]) and, for 2Q and ARC, its ghost lists.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lruHit, lruMiss, lruInsert
+// Description  : Least recently used, a single list in recency order
+//
+// Inputs       : s - the shard, line - the line, key - the missing block
+//                (lruMiss has no ghosts to look it up in, it only takes it
+//                to fit the policy table)
+// Outputs      : lruMiss returns the evicted line, LC_CACHE_NIL if not full
+void lruHit(CACHE_SHARD *s, int line) {
+    if(line != s->lists[0].mru) {
+        unlinkLine(s, line);
+        pushFront(s, 0, line);
+    }
+}
+
+int lruMiss(CACHE_SHARD *s, uint64_t key) {
+    if(s->numLines < s->maxLines) {
+        return LC_CACHE_NIL;
+    }
+    return takeVictim(s, 0);
+}
+
+void lruInsert(CACHE_SHARD *s, int line) {
+    pushFront(s, 0, line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clockHit, clockMiss, clockInsert
+// Description  : CLOCK (second chance). A hit only sets the reference bit,
+//                so it needs no relinking and is safe under the shared lock.
+//                The hand is the tail of the list, a referenced line is given
+//                another trip around by moving it to the head.
+//
+// Inputs       : s - the shard, line - the line, key - the missing block
+//                (unused, as for lruMiss)
+// Outputs      : clockMiss returns the evicted line, LC_CACHE_NIL if not full
+void clockHit(CACHE_SHARD *s, int line) {
+    __atomic_store_n(&s->lines[line].ref, 1, __ATOMIC_RELAXED);
+}
+
+int clockMiss(CACHE_SHARD *s, uint64_t key) {
+    int hand;
+
+    if(s->numLines < s->maxLines) {
+        return LC_CACHE_NIL;
+    }
+
+    //Two trips around clears every reference bit, after that only pins remain
+    for(int n=s->lists[0].size*2;n>0;n--) {
+        hand = s->lists[0].lru;
+        if(!__atomic_load_n(&s->lines[hand].ref, __ATOMIC_RELAXED) && !isPinned(s, hand)) {
+            unlinkLine(s, hand);
+            return hand;
+        }
+        __atomic_store_n(&s->lines[hand].ref, 0, __ATOMIC_RELAXED);
+        unlinkLine(s, hand);
+        pushFront(s, 0, hand);
+    }
+    return LC_CACHE_NIL;
+}
+
+void clockInsert(CACHE_SHARD *s, int line) {
+    __atomic_store_n(&s->lines[line].ref, 0, __ATOMIC_RELAXED);
+    pushFront(s, 0, line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoQHit, twoQMiss
+// Description  : 2Q (Johnson and Shasha). New blocks enter the FIFO A1in
+//                (lists[0]), blocks evicted from it are remembered in the
+//                ghost FIFO A1out (ghostLists[0]) and only a block referenced
+//                again while remembered is promoted into the LRU Am
+//                (lists[1]). A linear scan therefore only cycles A1in.
+//
+// Inputs       : s - the shard, line - the line, key - the missing block
+// Outputs      : twoQMiss returns the evicted line, LC_CACHE_NIL if not full
+void twoQHit(CACHE_SHARD *s, int line) {
+    if(s->lines[line].list == 1 && line != s->lists[1].mru) {
+        unlinkLine(s, line);
+        pushFront(s, 1, line);
+    }
+}
+
+int twoQMiss(CACHE_SHARD *s, uint64_t key) {
+    int kin = CMPSC311_MAXVAL(s->maxLines / 4, 1);      //Size of A1in
+    int kout = CMPSC311_MAXVAL(s->maxLines / 2, 1);     //Size of A1out
+    int victim;
+    int from;
+    int g = findGhost(s, key);
+
+    //Seen recently, goes straight into Am
+    s->pending = 0;
+    if(g != LC_CACHE_NIL) {
+        dropGhost(s, g);
+        s->pending = 1;
+    }
+
+    if(s->numLines < s->maxLines) {
+        return LC_CACHE_NIL;
+    }
+
+    //Evict from A1in while it is over its share, otherwise from Am
+    from = (s->lists[0].size > kin || s->lists[1].size == 0) ? 0 : 1;
+    victim = takeVictim(s, from);
+    if(victim == LC_CACHE_NIL) {
+        victim = takeVictim(s, 1 - from);
+    }
+
+    //Blocks leaving A1in are remembered
+    if(victim != LC_CACHE_NIL && s->lines[victim].list == 0) {
+        while(s->ghostLists[0].size >= kout) {
+            dropGhost(s, s->ghostLists[0].lru);
+        }
+        addGhost(s, 0, s->index[victim].key);
+    }
+    return victim;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arcHit, arcMiss, arcReplace
+// Description  : ARC (Megiddo and Modha). T1 (lists[0]) holds blocks seen
+//                once, T2 (lists[1]) blocks seen at least twice, and the
+//                ghost lists B1/B2 (ghostLists[0]/[1]) remember what was
+//                evicted from each. Hits in the ghosts move the target size
+//                of T1 towards whichever side is losing useful blocks.
+//
+// Inputs       : s - the shard, line - the line, key - the missing block,
+//                inB2 - was the missing block a B2 ghost
+// Outputs      : arcMiss and arcReplace return the evicted line,
+//                LC_CACHE_NIL if not full
+void arcHit(CACHE_SHARD *s, int line) {
+    if(s->lines[line].list == 0 || line != s->lists[1].mru) {
+        unlinkLine(s, line);
+        pushFront(s, 1, line);
+    }
+}
+
+int arcMiss(CACHE_SHARD *s, uint64_t key) {
+    int c = s->maxLines;
+    int full = (s->numLines >= c);             //Over c only while shrinking
+    int t1 = s->lists[0].size;
+    int b1 = s->ghostLists[0].size;
+    int b2 = s->ghostLists[1].size;
+    int victim = LC_CACHE_NIL;
+    int g = findGhost(s, key);
+
+    //Ghost hit in B1, T1 was too small
+    if(g != LC_CACHE_NIL && s->ghosts[g].list == 0) {
+        s->target = CMPSC311_MINVAL(s->target + CMPSC311_MAXVAL(b2 / b1, 1), c);
+        dropGhost(s, g);
+        if(full) {
+            victim = arcReplace(s, 0);
+        }
+        s->pending = 1;
+        return victim;
+    }
+
+    //Ghost hit in B2, T2 was too small
+    if(g != LC_CACHE_NIL) {
+        s->target = CMPSC311_MAXVAL(s->target - CMPSC311_MAXVAL(b1 / b2, 1), 0);
+        dropGhost(s, g);
+        if(full) {
+            victim = arcReplace(s, 1);
+        }
+        s->pending = 1;
+        return victim;
+    }
+
+    //Complete miss
+    s->pending = 0;
+    if(t1 + b1 >= c) {
+        if(t1 < c) {
+            dropGhost(s, s->ghostLists[0].lru);
+            if(full) {
+                victim = arcReplace(s, 0);
+            }
+        }
+        else {
+            victim = takeVictim(s, 0);
+        }
+    }
+    else if(t1 + b1 + s->lists[1].size + b2 >= c) {
+        if(t1 + b1 + s->lists[1].size + b2 >= 2 * c && b2 > 0) {
+            dropGhost(s, s->ghostLists[1].lru);
+        }
+        if(full) {
+            victim = arcReplace(s, 0);
+        }
+    }
+    return victim;
+}
+
+int arcReplace(CACHE_SHARD *s, int inB2) {
+    int t1 = s->lists[0].size;
+    int from;
+    int victim;
+
+    if(t1 >= 1 && (t1 > s->target || (inB2 && t1 == s->target) || s->lists[1].size == 0)) {
+        from = 0;
+    }
+    else {
+        from = 1;
+    }
+    victim = takeVictim(s, from);
+    if(victim == LC_CACHE_NIL) {
+        from = 1 - from;
+        victim = takeVictim(s, from);
+    }
+    if(victim != LC_CACHE_NIL) {
+        addGhost(s, from, s->index[victim].key);
+    }
+    return victim;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pendingInsert
+// Description  : Inserts a new line on the list the last miss picked (2Q, ARC)
+//
+// Inputs       : s - the shard, line - the new line
+// Outputs      : none
+void pendingInsert(CACHE_SHARD *s, int line) {
+    pushFront(s, s->pending, line);
+}
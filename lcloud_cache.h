@@ -13,10 +13,59 @@
 
 // Includes 
 #include <stdint.h>
+#include <stddef.h>
 #include <lcloud_controller.h>
 
 // Defines 
+#ifndef LC_CACHE_MAXBLOCKS
 #define LC_CACHE_MAXBLOCKS 64
+#endif
+#define LC_CACHE_MAXSHARDS 256
+#define LC_CACHE_SHARDLINES 64
+#define LC_CACHE_MAXDEVICES 16
+#define LC_CACHE_CURVE_POINTS 8
+#define LC_CACHE_HIST_SECTORS 256
+
+// Type definitions
+
+/* Cache replacement policies */
+typedef enum {
+    LC_CACHE_POLICY_DEFAULT = 0,  // Take the policy from LC_CACHE_POLICY (lru, clock, 2q, arc)
+    LC_CACHE_LRU            = 1,  // Least recently used
+    LC_CACHE_CLOCK          = 2,  // Second chance, hits never relink
+    LC_CACHE_2Q             = 3,  // Scan resistant FIFO/LRU pair with a ghost queue
+    LC_CACHE_ARC            = 4,  // Adaptive replacement cache
+    LC_CACHE_MAX_POLICY     = 5   // Maximum policy number
+} LcCachePolicy;
+
+/* A block pinned in the cache by lcloud_pincache */
+typedef struct {
+    char *data;      // The block, valid until unpinned
+    int32_t shard;   // Where the line lives
+    int32_t line;
+} LcCacheRef;
+
+/* Cache counters for one device */
+typedef struct {
+    uint64_t hits;         // Lookups that found the block
+    uint64_t misses;       // Lookups that did not
+    uint64_t inserts;      // Blocks brought into the cache
+    uint64_t evictions;    // Blocks pushed out by the replacement policy
+    uint64_t flushes;      // Dirty blocks written back to the device
+    uint64_t resident;     // Blocks in the cache right now
+    uint64_t prefetches;   // Blocks brought in by read ahead
+    uint64_t prefetchHits; // Prefetched blocks later looked up (first use only)
+    uint64_t rmwSkips;     // Writes that did not need the block's old contents
+} LcCacheStats;
+
+/* One point of the estimated hit ratio curve */
+typedef struct {
+    int blocks;          // Cache size
+    double hitRatio;     // Estimated LRU hit ratio at that size
+} LcCacheCurvePoint;
+
+/* Writes a dirty block back to its device, 0 if successful, -1 if failure */
+typedef int (*LcCacheWriteback)( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
 
 //
 // Functional Prototypes
@@ -24,12 +73,75 @@
 char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk );
     // Search the cache for a block 
 
+int lcloud_readcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf );
+    // Copy a block out of the cache (safe with concurrent callers)
+
+int lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk, LcCacheRef *ref );
+    // Look up a block and pin it so it can be copied without evicting it
+
+void lcloud_unpincache( LcCacheRef *ref );
+    // Release a block pinned by lcloud_pincache
+
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
     // Put a value in the cache 
 
+int lcloud_dirtycache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Put a value in the cache that still has to be written to the device
+
+int lcloud_fillcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Put a block read ahead in the cache unless it is cached already
+
+int lcloud_peekcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf );
+    // Check for a block without counting a hit or miss
+
+int lcloud_skipread( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Count a write that did not read the block first
+
+int lcloud_setwriteback( LcCacheWriteback fn );
+    // Set the function that writes dirty blocks back (enables dirtycache)
+
+int lcloud_flushblock( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Write a block back to the device if it is dirty
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Forget a block without writing it back, for blocks that were freed
+
+int lcloud_flushcache( void );
+    // Write every dirty block back to the device
+
 int lcloud_initcache( int maxblocks );
     // Initialze the cache by setting up metadata a cache elements.
 
+int lcloud_initcache_sharded( int maxblocks, int nshards );
+    // Initialize a thread-safe cache split into independently locked shards
+
+int lcloud_initcache_policy( int maxblocks, int nshards, LcCachePolicy pol );
+    // Initialize the cache with a replacement policy (nshards 0 = unlocked)
+
+int lcloud_initcache_budget( size_t bytes, int nshards, LcCachePolicy pol );
+    // Initialize the cache with as many blocks as fit in a memory budget
+
+int lcloud_resizecache( int maxblocks );
+    // Grow or shrink the cache while it is in use (fails if blocks are pinned)
+
+int lcloud_cachecurve( LcCacheCurvePoint *pts, int max );
+    // Get the estimated hit ratio at other cache sizes
+
+int lcloud_tunecache( void );
+    // Resize the cache to the smallest size the curve says is good enough
+
+int lcloud_cachestats( int did, LcCacheStats *stats );
+    // Get the cache counters of a device while running
+
+int lcloud_cachehistogram( int did, uint64_t *counts, int max );
+    // Count a device's resident blocks in each sector while running
+
+int lcloud_loadsnapshot( uint64_t tag );
+    // Fill the cache from the LC_CACHE_SNAPSHOT file if it was saved with this tag
+
+void lcloud_snapshottag( uint64_t tag );
+    // Set the tag the snapshot is saved with at close (0 saves none)
+
 int lcloud_closecache( void );
     // Clean up the cache when program is closing.
 
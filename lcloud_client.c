@@ -12,7 +12,15 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <stdio.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -20,25 +28,79 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 // Project Include Files
 #include <lcloud_network.h>
+#include <lcloud_shm.h>
 #include <cmpsc311_log.h>
 #include "lcloud_filesys.h"
 #include <assert.h>
 #include "cmpsc311_util.h"
 
+//Defines
+#define LC_BUS_WINDOW 16            //Requests sent before waiting for the oldest response, unless LC_BUS_WINDOW says otherwise
+#define LC_BUS_MAX_WINDOW 256
+#define LC_BUS_SEND_BATCH 64        //Most frames the engine sends in one writev
+#define LC_BUS_RX_BYTES 16384       //Responses the engine reads in one call
+
+//typedefs and structs
+
+typedef struct BUS_FRAME {          //Request posted, its response not read yet
+    LCloudRegisterFrame reg;
+    LCloudRegisterFrame wire;       //reg in network byte order
+    void *buf;                      //Where a block read goes, or the block written
+    LCloudRegisterFrame *answer;    //Where the answer goes, NULL if nobody waits for it
+    uint32_t ready;                 //Request number + 1 once the frame is filled in, the engine sends it then
+} BUS_FRAME;
+
+typedef struct BUS_CONN {           //Connection to the server, used by one thread at a time (the filesystem holds its bus lock) unless the engine runs it
+    int socket;                     //-1 when not connected
+    int tcp;                        //Is it TCP (not a Unix domain socket)
+    LcShmConn *shm;                 //The connection of a shared memory server instead of a socket, NULL if none
+    BUS_FRAME inFlight[LC_BUS_MAX_WINDOW]; //Requests waiting for a response, request n is at n % LC_BUS_MAX_WINDOW
+    uint32_t posted;                //Requests posted so far, with the engine the slots claimed so far
+    uint32_t sent;                  //Requests the engine has sent
+    uint32_t answered;              //Requests answered so far
+    char rx[LC_BUS_RX_BYTES];       //Responses read by the engine and not matched yet
+    int rxLen;
+    pthread_mutex_t lock;           //With answeredCond, lets a caller sleep until the engine reads its answer
+    pthread_cond_t answeredCond;
+    int waiting;                    //Callers asleep on answeredCond
+} BUS_CONN;
+
 //Global Variables
-int socket_handle = -1;     //Socket
-int q;                      //Used in for loops, declared now for convinience
-//Registers
-uint8_t b0;
-uint8_t b1;
-uint8_t c0;
-uint8_t c1;
-uint8_t c2;
-uint16_t d0;
-uint16_t d1;
+BUS_CONN pool[LC_BUS_MAX_CONNECTIONS]; //The connections, device d uses pool[d % connections]
+int connections = 0;        //Connections in the pool, set when the first is made
+int window = 1;             //Most requests in flight on a connection, set when connecting
+int engine = 0;             //Does the engine thread do the socket I/O (LC_BUS_ENGINE)
+pthread_t engineThread;
+int epollFd = -1;           //Watches every connection and wakeFd for the engine
+int wakeFd = -1;            //eventfd a caller writes to wake an idle engine
+int engineIdle = 0;         //Is the engine asleep in epoll_wait (or about to be)
+int engineStop = 0;         //Tells the engine to exit
+LcShmConn *shmConns = NULL; //A shared memory server's connections, mapped while the pool uses them
+
+//Help functions
+BUS_CONN *connFor(LCloudRegisterFrame reg); //Connection a request goes on, connected if need be
+void busConnect(BUS_CONN *conn); //Connects to the server
+int serverAddress(struct sockaddr_storage *addr, socklen_t *len); //Where the server is
+char *shmServer();          //Name of the shared memory server, NULL for a socket
+void closePool();           //Closes every connection once its requests are answered
+void sendFull(BUS_CONN *conn, struct iovec *iov, int cnt); //Writes all of a frame
+void recvFull(BUS_CONN *conn, struct iovec *iov, int cnt); //Reads all of a response
+void quickAck(BUS_CONN *conn); //Has the next answer acked as soon as it arrives
+int isBlockRead(LCloudRegisterFrame reg); //Does a request's answer carry a block
+void completeOldest(BUS_CONN *conn); //Reads the response of the oldest request in flight
+void waitFor(BUS_CONN *conn, uint32_t n); //Waits until the first n requests are answered
+void drain(BUS_CONN *conn); //Reads the responses of every request in flight
+void startEngine();         //Starts the engine thread
+void stopEngine();          //Stops the engine thread
+void *engineWorker(void *arg); //Sends posted requests and reads their answers
+void sendPosted(BUS_CONN *conn); //Sends what has been posted on a connection
+uint32_t postFrame(BUS_CONN *conn, LCloudRegisterFrame reg, void *buf, LCloudRegisterFrame *answer); //Posts a request, telling where its answer goes
+uint32_t claimFrame(BUS_CONN *conn); //Claims the next slot of a connection's ring for a request
+void readAnswers(BUS_CONN *conn); //Reads and matches what the server has answered
 
 //
 // Functions
@@ -46,93 +108,821 @@ uint16_t d1;
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : client_lcloud_bus_request
-// Description  : This the client regstateeration that sends a request to the 
+// Description  : This the client regstateeration that sends a request to the
 //                lion client server.   It will:
 //
 //                1) if INIT make a connection to the server
 //                2) send any request to the server, returning results
 //                3) if CLOSE, will close the connection
 //
+//                Requests sent earlier on the same connection with
+//                client_lcloud_bus_post finish first, the server answers
+//                in order.
+//
 // Inputs       : reg - the request reqisters for the command
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
 
 LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *buf ) {
-
-    char subBuf[1024];                      //Buffer that communicates with network
     LCloudRegisterFrame response;           //Register frame as recieved from network
-    LCloudRegisterFrame nReg = htonll64(reg); //Network ordered register frame
+    uint8_t b0, b1, c0, c1, c2;             //Registers of the request
+    uint16_t d0, d1;
+    BUS_CONN *conn;
+    uint32_t n;
+
+    //Shutdown, every other connection is finished and closed first
+    extract_lcloud_registers(reg, &b0,&b1,&c0,&c1,&c2,&d0,&d1);
+    if(c0 == LC_POWER_OFF) {
+        for(int k=1;k<connections;k++) {
+            drain(&pool[k]);
+        }
+    }
+
+    conn = connFor(reg);
+    n = postFrame(conn, reg, buf, &response);
+    waitFor(conn, n);
+
+    if(c0 == LC_POWER_OFF) {
+        closePool();
+    }
+
+    return response;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_post
+// Description  : Sends a request without waiting for its response, so a
+//                run of block transfers costs about one round trip instead
+//                of one each. Up to the window of requests are in flight
+//                on a connection, past that the oldest response is read
+//                first. With the engine, several threads can post on a
+//                connection at once.
+//
+// Inputs       : reg - the request registers, buf - the block to write, or
+//                where a block read goes (either must stay valid until
+//                the request is waited for, the engine sends a block
+//                written straight from it)
+// Outputs      : none
+void client_lcloud_bus_post( LCloudRegisterFrame reg, void *buf ) {
+    postFrame(connFor(reg), reg, buf, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_wait
+// Description  : Reads the responses of every request in flight on the
+//                connection a device uses, so the blocks read from it are in
+//                their buffers
+//
+// Inputs       : did - the device
+// Outputs      : none
+void client_lcloud_bus_wait( LcDeviceId did ) {
+    if(connections > 0) {
+        drain(&pool[client_lcloud_bus_channel(did)]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_channel
+// Description  : Tells which connection a device's requests go on. Callers
+//                must not use a connection from two threads at once, unless
+//                client_lcloud_bus_shared says they can.
+//
+// Inputs       : did - the device
+// Outputs      : the connection number, 0 before the first request
+int client_lcloud_bus_channel( LcDeviceId did ) {
+    return (connections > 0) ? did % connections : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_shared
+// Description  : Tells whether several threads can post and wait on a
+//                connection at once, which they can when the engine does
+//                the socket I/O. Known once the first request is made.
+//
+// Inputs       : none
+// Outputs      : 1 if they can, 0 if not
+int client_lcloud_bus_shared( void ) {
+    return engine;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : postFrame
+// Description  : Posts a request on a connection. Without the engine it is
+//                sent at once, the caller holding the connection. With the
+//                engine the request claims a slot of the ring, fills it in
+//                and marks it ready, and the engine sends it in order once
+//                every slot before it is ready too.
+//
+// Inputs       : conn - the connection, reg - the request registers, buf -
+//                the block to write or where a block read goes, answer -
+//                where the answer goes (NULL if nobody needs it)
+// Outputs      : the number of requests to wait for to have its answer
+uint32_t postFrame(BUS_CONN *conn, LCloudRegisterFrame reg, void *buf, LCloudRegisterFrame *answer) {
+    struct iovec iov[2];                    //Header, then the block written if any
+    uint8_t b0, b1, c0, c1, c2;             //Registers of the request
+    uint16_t d0, d1;
+    BUS_FRAME *f;
+    uint32_t n;
+    int cnt = 1;
+
+    if(engine) {
+        n = claimFrame(conn);
+    }
+    else {
+        waitFor(conn, conn->posted - window + 1);
+        n = conn->posted;
+    }
+    f = &conn->inFlight[n % LC_BUS_MAX_WINDOW];
+    f->reg = reg;
+    f->wire = htonll64(reg);
+    f->buf = buf;
+    f->answer = answer;
+    extract_lcloud_registers(reg, &b0,&b1,&c0,&c1,&c2,&d0,&d1);
+
+    //The engine sends it later, the block written straight from buf
+    if(engine) {
+        __atomic_store_n(&f->ready, n + 1, __ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&engineIdle, 0, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            assert(write(wakeFd, &one, sizeof(one)) == sizeof(one));
+        }
+        return n + 1;
+    }
+
+    //Only a block write carries a payload, sent from the caller's buffer
+    iov[0].iov_base = &f->wire;
+    iov[0].iov_len = LCLOUD_NET_HEADER_SIZE;
+    if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_WRITE) {
+        iov[1].iov_base = buf;
+        iov[1].iov_len = LC_DEVICE_BLOCK_SIZE;
+        cnt = 2;
+    }
+    sendFull(conn, iov, cnt);
+    conn->posted++;
+    return n + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : claimFrame
+// Description  : Claims the next slot of a connection's ring, moving posted
+//                on with a compare and swap so threads posting at once each
+//                get their own. A slot is only claimed once the request a
+//                window before it is answered, so the engine is done with
+//                what was in it.
+//
+// Inputs       : conn - the connection
+// Outputs      : the request number, its slot is n % LC_BUS_MAX_WINDOW
+uint32_t claimFrame(BUS_CONN *conn) {
+    uint32_t n = __atomic_load_n(&conn->posted, __ATOMIC_SEQ_CST);
+
+    while(1) {
+        if((int32_t)(n - __atomic_load_n(&conn->answered, __ATOMIC_SEQ_CST)) >= window) {
+            waitFor(conn, n - window + 1);
+            n = __atomic_load_n(&conn->posted, __ATOMIC_SEQ_CST);
+        }
+        else if(__atomic_compare_exchange_n(&conn->posted, &n, n + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return n;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : connFor
+// Description  : Finds the connection a request goes on, by the device in
+//                it (power and probe requests name device 0), connecting
+//                it if need be. The pool size comes from
+//                LC_BUS_CONNECTIONS when the first connection is made.
+//
+// Inputs       : reg - the request registers
+// Outputs      : the connection
+BUS_CONN *connFor(LCloudRegisterFrame reg) {
+    uint8_t b0, b1, c0, c1, c2;
+    uint16_t d0, d1;
+    char *env = getenv("LC_BUS_CONNECTIONS");
+    BUS_CONN *conn;
+
+    //A new pool, the engine's connections are all made before it starts
+    if(connections == 0) {
+        connections = (env != NULL) ? atoi(env) : 1;
+        connections = CMPSC311_MAXVAL(1, CMPSC311_MINVAL(connections, LC_BUS_MAX_CONNECTIONS));
+        engine = (getenv("LC_BUS_ENGINE") != NULL && atoi(getenv("LC_BUS_ENGINE")) != 0);
+        //The engine waits on sockets, a shared memory connection has none
+        if(engine && shmServer() != NULL) {
+            logMessage(LOG_WARNING_LEVEL,"LC_BUS_ENGINE is ignored with a shared memory server");
+            engine = 0;
+        }
+        for(int k=0;k<connections;k++) {
+            pool[k].socket = -1;
+            pool[k].shm = NULL;
+            pthread_mutex_init(&pool[k].lock, NULL);
+            pthread_cond_init(&pool[k].answeredCond, NULL);
+            if(engine) {
+                busConnect(&pool[k]);
+            }
+        }
+        if(engine) {
+            startEngine();
+        }
+    }
 
-    for(q = 0; q < 8; q++) {
-        subBuf[q] = ((char *)&nReg)[q];        //Pack frame into buffer
+    extract_lcloud_registers(reg, &b0,&b1,&c0,&c1,&c2,&d0,&d1);
+    conn = &pool[client_lcloud_bus_channel(c1)];
+    if(conn->socket == -1 && conn->shm == NULL) {
+        busConnect(conn);
     }
+    return conn;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : busConnect
+// Description  : Connects to the server, or claims a connection of a shared
+//                memory server, and sets the window from LC_BUS_WINDOW (1
+//                sends a request only once the last one is answered)
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void busConnect(BUS_CONN *conn) {
+    struct sockaddr_storage caddr;
+    socklen_t clen;
+    char *env = getenv("LC_BUS_WINDOW");
+    int one = 1;
 
-    //Connect to server if not connected
-    if (socket_handle == -1) {
-        socket_handle = socket(AF_INET, SOCK_STREAM, 0);
-        if (socket_handle == -1) {
+    //A shared memory server, its connections are mapped once for the pool
+    if(shmServer() != NULL) {
+        if(shmConns == NULL) {
+            shmConns = lcloud_shm_map(shmServer(), 0);
+        }
+        conn->shm = (shmConns != NULL) ? lcloud_shm_claim(shmConns) : NULL;
+        if(conn->shm == NULL) {
+            logMessage(LOG_ERROR_LEVEL,"Could not connect to the shared memory server [%s]",shmServer());
             assert(0);
         }
-        
-        struct sockaddr_in caddr;
-        caddr.sin_family = AF_INET;
-        caddr.sin_port = htons(LCLOUD_DEFAULT_PORT);
-        if(inet_aton(LCLOUD_DEFAULT_IP, &caddr.sin_addr) == 0) {
+        conn->tcp = 0;
+    }
+    else {
+        if(serverAddress(&caddr, &clen) == -1) {
             assert(0);
         }
+        conn->tcp = (caddr.ss_family != AF_UNIX);
 
-        if(connect(socket_handle,(const struct sockaddr *)&caddr, sizeof(caddr)) == -1) {
+        conn->socket = socket(caddr.ss_family, SOCK_STREAM, 0);
+        if (conn->socket == -1) {
             assert(0);
         }
+
+        if(connect(conn->socket,(const struct sockaddr *)&caddr, clen) == -1) {
+            logMessage(LOG_ERROR_LEVEL,"Could not connect to the server [%s]",strerror(errno));
+            assert(0);
+        }
+        if(conn->tcp) {
+            setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
     }
 
-    //Determine operation and act accordingly
+    window = (env != NULL) ? atoi(env) : LC_BUS_WINDOW;
+    window = CMPSC311_MAXVAL(1, CMPSC311_MINVAL(window, LC_BUS_MAX_WINDOW));
+    conn->posted = conn->sent = conn->answered = 0;
+    for(int k=0;k<LC_BUS_MAX_WINDOW;k++) {
+        conn->inFlight[k].ready = 0;
+    }
+    conn->rxLen = 0;
+    conn->waiting = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serverAddress
+// Description  : Works out where the server is from LC_BUS_SERVER, either
+//                unix:<path> for a Unix domain socket or <host>[:<port>]
+//                for TCP (shm:<name> is not a socket, see shmServer). An
+//                IPv6 address with a port goes in brackets, [<addr>]:<port>,
+//                and one without brackets is all host. Anything left out is
+//                LCLOUD_DEFAULT_IP and LCLOUD_DEFAULT_PORT.
+//
+// Inputs       : addr - filled in with the address, len - its length
+// Outputs      : 0 if successful, -1 if failure
+int serverAddress(struct sockaddr_storage *addr, socklen_t *len) {
+    char *env = getenv("LC_BUS_SERVER");
+    char host[256] = LCLOUD_DEFAULT_IP;
+    char port[16];
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    struct addrinfo hints, *res;
+    char *colon, *end;
+
+    memset(addr, 0, sizeof(*addr));
+    snprintf(port, sizeof(port), "%d", LCLOUD_DEFAULT_PORT);
+
+    //Unix domain socket
+    if(env != NULL && strncmp(env, "unix:", 5) == 0) {
+        if(strlen(env + 5) == 0 || strlen(env + 5) >= sizeof(un->sun_path)) {
+            logMessage(LOG_ERROR_LEVEL,"Bad LC_BUS_SERVER socket path [%s]",env + 5);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, env + 5);
+        *len = sizeof(*un);
+        return 0;
+    }
+
+    //TCP, the port is after the closing bracket, or after the colon if
+    //there is just one (more than one is an IPv6 address and no port)
+    if(env != NULL && *env != '\0') {
+        snprintf(host, sizeof(host), "%s", env);
+        if(host[0] == '[') {
+            end = strchr(host, ']');
+            if(end == NULL || (end[1] != '\0' && end[1] != ':')) {
+                logMessage(LOG_ERROR_LEVEL,"Bad LC_BUS_SERVER address [%s]",env);
+                return -1;
+            }
+            if(end[1] == ':') {
+                snprintf(port, sizeof(port), "%s", end + 2);
+            }
+            *end = '\0';
+            memmove(host, host + 1, strlen(host + 1) + 1);
+        } else if((colon = strchr(host, ':')) != NULL && colon == strrchr(host, ':')) {
+            snprintf(port, sizeof(port), "%s", colon + 1);
+            *colon = '\0';
+        }
+        if(host[0] == '\0') {
+            snprintf(host, sizeof(host), "%s", LCLOUD_DEFAULT_IP);
+        }
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, port, &hints, &res) != 0) {
+        logMessage(LOG_ERROR_LEVEL,"Could not find the server [%s:%s]",host,port);
+        return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shmServer
+// Description  : Tells if LC_BUS_SERVER names a shared memory server,
+//                shm:<name>, which the client reaches through the rings
+//                of lcloud_shm instead of a socket
+//
+// Inputs       : none
+// Outputs      : the shared memory object's name, NULL if not shm
+char *shmServer() {
+    char *env = getenv("LC_BUS_SERVER");
+
+    if(env != NULL && strncmp(env, "shm:", 4) == 0 && env[4] != '\0') {
+        return env + 4;
+    }
+    return NULL;
+}
+
+////
+//
+// Function     : closePool
+// Description  : Closes every connection, last first, once its requests are
+//                answered. The next request makes a new pool.
+//
+// Inputs       : none
+// Outputs      : none
+void closePool() {
+    for(int k=connections-1;k>=0;k--) {
+        drain(&pool[k]);
+    }
+    if(engine) {
+        stopEngine();
+    }
+    for(int k=connections-1;k>=0;k--) {
+        if(pool[k].socket != -1) {
+            assert(close(pool[k].socket) != -1);
+            pool[k].socket = -1;
+        }
+        if(pool[k].shm != NULL) {
+            lcloud_shm_release(pool[k].shm);
+            pool[k].shm = NULL;
+        }
+        pthread_mutex_destroy(&pool[k].lock);
+        pthread_cond_destroy(&pool[k].answeredCond);
+    }
+    if(shmConns != NULL) {
+        lcloud_shm_unmap(shmConns);
+        shmConns = NULL;
+    }
+    connections = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sendFull
+// Description  : Writes a frame in one call, carrying on after short
+//                writes, or copies it into a shared memory connection's
+//                request ring
+//
+// Inputs       : conn - the connection, iov - the pieces of the frame
+//                (moved along as they are sent), cnt - how many
+// Outputs      : none
+void sendFull(BUS_CONN *conn, struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    if(conn->shm != NULL) {
+        lcloud_shm_write(&conn->shm->requests, iov, cnt);
+        return;
+    }
+    while(cnt > 0) {
+        n = writev(conn->socket, iov, cnt);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            assert(0);
+            return;
+        }
+        while(cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : quickAck
+// Description  : Has the next answer acked as soon as it arrives, which the
+//                server waits for before it sends the one after. Linux
+//                leaves quick ack mode again after a few segments, so it is
+//                set again before each read that has to wait (or, by the
+//                engine, after each read of answers) rather than once at
+//                connect.
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void quickAck(BUS_CONN *conn) {
+    int one = 1;
+
+    if(conn->tcp) {
+        setsockopt(conn->socket, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : recvFull
+// Description  : Reads exactly one response's bytes, carrying on after short
+//                reads. Responses to requests in flight arrive back to
+//                back, so reading more would take part of the next one.
+//                Answers already received are taken without waiting, so
+//                quick ack is only set when the read is about to block. A
+//                shared memory connection reads its answer ring instead.
+//
+// Inputs       : conn - the connection, iov - where the pieces go (moved
+//                along as they arrive), cnt - how many
+// Outputs      : none
+void recvFull(BUS_CONN *conn, struct iovec *iov, int cnt) {
+    struct msghdr msg;
+    ssize_t n;
+    int flags = MSG_DONTWAIT;
+
+    if(conn->shm != NULL) {
+        lcloud_shm_read(&conn->shm->answers, iov, cnt);
+        return;
+    }
+    while(cnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        n = recvmsg(conn->socket, &msg, flags);
+        //Only an answer not here yet needs acking quickly, then wait for it
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            quickAck(conn);
+            flags = 0;
+            continue;
+        }
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            assert(0);
+            return;
+        }
+        while(cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : isBlockRead
+// Description  : Tells if a request's answer is followed by a block
+//
+// Inputs       : reg - the request registers
+// Outputs      : 1 if it is a block read, 0 if not
+int isBlockRead(LCloudRegisterFrame reg) {
+    uint8_t b0, b1, c0, c1, c2;
+    uint16_t d0, d1;
+
     extract_lcloud_registers(reg, &b0,&b1,&c0,&c1,&c2,&d0,&d1);
-    //Block transfer
-    if(c0 == LC_BLOCK_XFER) {
+    return (c0 == LC_BLOCK_XFER && c2 == LC_XFER_READ);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : completeOldest
+// Description  : Reads the response of the oldest request in flight, and
+//                the block after it if the request was a block read
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void completeOldest(BUS_CONN *conn) {
+    BUS_FRAME *f = &conn->inFlight[conn->answered % LC_BUS_MAX_WINDOW];
+    struct iovec iov[2];                    //Header, then the block read if any
+    LCloudRegisterFrame response;
+    int cnt = 1;
+
+    //A block read goes straight into the caller's buffer
+    iov[0].iov_base = &response;
+    iov[0].iov_len = LCLOUD_NET_HEADER_SIZE;
+    if(isBlockRead(f->reg)) {
+        iov[1].iov_base = f->buf;
+        iov[1].iov_len = LC_DEVICE_BLOCK_SIZE;
+        cnt = 2;
+    }
+    recvFull(conn, iov, cnt);
+    if(f->answer != NULL) {
+        *f->answer = ntohll64(response);
+    }
+    conn->answered++;
+}
 
-        //Block read
-        if(c2 == LC_XFER_READ) {
-            assert(write(socket_handle, subBuf, 8) != -1);
-            assert(read(socket_handle,&subBuf[0],1024) != -1);
-            memcpy(buf,&subBuf[8],256);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : waitFor
+// Description  : Waits until the first n requests posted on a connection
+//                are answered, reading the answers itself or, with the
+//                engine, sleeping until the engine has read them
+//
+// Inputs       : conn - the connection, n - how many requests
+// Outputs      : none
+void waitFor(BUS_CONN *conn, uint32_t n) {
+    if(!engine) {
+        while((int32_t)(n - conn->answered) > 0) {
+            completeOldest(conn);
         }
+        return;
+    }
 
-        //Block write
-        else {
-            memcpy(&subBuf[8],buf,256);
-            assert(write(socket_handle, subBuf, 264) != -1);
-            assert(read(socket_handle, subBuf, 1024) != -1);
+    //The engine checks waiting after it moves answered on
+    if((int32_t)(n - __atomic_load_n(&conn->answered, __ATOMIC_ACQUIRE)) <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&conn->lock);
+    __atomic_add_fetch(&conn->waiting, 1, __ATOMIC_SEQ_CST);
+    while((int32_t)(n - __atomic_load_n(&conn->answered, __ATOMIC_SEQ_CST)) > 0) {
+        pthread_cond_wait(&conn->answeredCond, &conn->lock);
+    }
+    __atomic_sub_fetch(&conn->waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain
+// Description  : Reads the responses of every request in flight on a
+//                connection
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void drain(BUS_CONN *conn) {
+    if(conn->socket != -1 || conn->shm != NULL) {
+        waitFor(conn, __atomic_load_n(&conn->posted, __ATOMIC_SEQ_CST));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startEngine
+// Description  : Starts the thread that does the socket I/O for every
+//                connection in the pool. Callers post requests into each
+//                connection's ring and the engine sends them in batches,
+//                reads the answers as they come and wakes whoever waits.
+//
+// Inputs       : none
+// Outputs      : none
+void startEngine() {
+    struct epoll_event ev;
+
+    epollFd = epoll_create1(0);
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    if(epollFd == -1 || wakeFd == -1) {
+        assert(0);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    assert(epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) == 0);
+    for(int k=0;k<connections;k++) {
+        ev.data.ptr = &pool[k];
+        assert(epoll_ctl(epollFd, EPOLL_CTL_ADD, pool[k].socket, &ev) == 0);
+    }
+
+    engineIdle = 0;
+    engineStop = 0;
+    if(pthread_create(&engineThread, NULL, engineWorker, NULL) != 0) {
+        assert(0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopEngine
+// Description  : Stops the engine thread, once nothing is in flight
+//
+// Inputs       : none
+// Outputs      : none
+void stopEngine() {
+    uint64_t one = 1;
+
+    __atomic_store_n(&engineStop, 1, __ATOMIC_SEQ_CST);
+    assert(write(wakeFd, &one, sizeof(one)) == sizeof(one));
+    pthread_join(engineThread, NULL);
+    close(epollFd);
+    close(wakeFd);
+    epollFd = wakeFd = -1;
+    engine = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : engineWorker
+// Description  : The engine thread. It sends whatever has been posted, then
+//                sleeps in epoll_wait until a connection has answers to read
+//                or a caller posts more. A caller only writes to wakeFd if
+//                the engine said it was going to sleep, so a busy engine
+//                costs callers no system calls. A slot claimed but not
+//                ready yet is not work: its caller marks it ready before
+//                looking at engineIdle, so it wakes the engine then.
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+void *engineWorker(void *arg) {
+    struct epoll_event evs[LC_BUS_MAX_CONNECTIONS + 1];
+    uint64_t count;
+    int pending, n;
+
+    while(!__atomic_load_n(&engineStop, __ATOMIC_SEQ_CST)) {
+        for(int k=0;k<connections;k++) {
+            sendPosted(&pool[k]);
         }
 
-    } 
+        //Say we are going to sleep, then look again so a post is not missed
+        __atomic_store_n(&engineIdle, 1, __ATOMIC_SEQ_CST);
+        pending = 0;
+        for(int k=0;k<connections;k++) {
+            if(__atomic_load_n(&pool[k].inFlight[pool[k].sent % LC_BUS_MAX_WINDOW].ready, __ATOMIC_SEQ_CST) == pool[k].sent + 1) {
+                pending = 1;
+            }
+        }
 
-    //Shutdown
-    else if(c0 == LC_POWER_OFF) {
-        assert(write(socket_handle,subBuf,8) != -1);
-        assert(read(socket_handle,&subBuf[0],1024) != -1);
-        //Close socket
-        assert(close(socket_handle) != -1);
-        socket_handle = -1;
+        n = epoll_wait(epollFd, evs, LC_BUS_MAX_CONNECTIONS + 1, pending ? 0 : -1);
+        __atomic_store_n(&engineIdle, 0, __ATOMIC_SEQ_CST);
+        for(int e=0;e<n;e++) {
+            if(evs[e].data.ptr == NULL) {
+                if(read(wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    assert(0);
+                }
+            }
+            else {
+                readAnswers((BUS_CONN *)evs[e].data.ptr);
+            }
+        }
+        if(n == -1 && errno != EINTR) {
+            assert(0);
+        }
     }
+    return NULL;
+}
 
-    //Device Probe
-    else if (c0 == LC_DEVPROBE) {
-        assert(write(socket_handle,subBuf,8) != -1);
-        assert(read(socket_handle,&subBuf[0],1024) != -1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sendPosted
+// Description  : Sends the requests posted on a connection and not sent
+//                yet, up to LC_BUS_SEND_BATCH of them in each writev, and
+//                stops at the first slot claimed but not ready yet. The
+//                window keeps what the server owes well under what the
+//                socket buffers hold, so the write cannot block behind
+//                answers the engine has not read.
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void sendPosted(BUS_CONN *conn) {
+    struct iovec iov[2 * LC_BUS_SEND_BATCH];
+    uint32_t posted = __atomic_load_n(&conn->posted, __ATOMIC_ACQUIRE);
+    uint8_t b0, b1, c0, c1, c2;
+    uint16_t d0, d1;
+    BUS_FRAME *f;
+    int cnt, k;
+
+    while(conn->sent != posted) {
+        cnt = 0;
+        for(k=0;k<LC_BUS_SEND_BATCH && conn->sent + k != posted;k++) {
+            f = &conn->inFlight[(conn->sent + k) % LC_BUS_MAX_WINDOW];
+            if(__atomic_load_n(&f->ready, __ATOMIC_ACQUIRE) != conn->sent + k + 1) {
+                break;
+            }
+            iov[cnt].iov_base = &f->wire;
+            iov[cnt++].iov_len = LCLOUD_NET_HEADER_SIZE;
+            extract_lcloud_registers(f->reg, &b0,&b1,&c0,&c1,&c2,&d0,&d1);
+            if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_WRITE) {
+                iov[cnt].iov_base = f->buf;
+                iov[cnt++].iov_len = LC_DEVICE_BLOCK_SIZE;
+            }
+        }
+        if(k == 0) {
+            break;
+        }
+        sendFull(conn, iov, cnt);
+        conn->sent += k;
     }
+}
 
-    //Any other operation
-    else {
-        assert(write(socket_handle,subBuf,8) != -1);
-        read(socket_handle,&subBuf[0],1024);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAnswers
+// Description  : Reads what a connection has ready without blocking, hands
+//                each complete answer (and its block) to its request in
+//                order and wakes any caller waiting on them
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void readAnswers(BUS_CONN *conn) {
+    BUS_FRAME *f;
+    ssize_t n;
+    size_t need;
+    int pos = 0;
+    uint32_t answered = conn->answered;
+
+    n = recv(conn->socket, &conn->rx[conn->rxLen], LC_BUS_RX_BYTES - conn->rxLen, MSG_DONTWAIT);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    //The server hangs up once it is powered off, nothing is owed by then
+    if(n == 0 && answered == __atomic_load_n(&conn->posted, __ATOMIC_ACQUIRE)) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->socket, NULL);
+        return;
+    }
+    if(n <= 0) {
+        logMessage(LOG_ERROR_LEVEL,"Lost the connection to the server [%s]",(n == 0) ? "closed" : strerror(errno));
+        assert(0);
+        return;
     }
+    conn->rxLen += n;
+    quickAck(conn);
 
-    //Pack server response into frame. then put into host byte order
-    for(q = 0; q < 8; q++) {
-        ((char *)&response)[q] = subBuf[q];
+    while(answered != conn->sent) {
+        f = &conn->inFlight[answered % LC_BUS_MAX_WINDOW];
+        need = LCLOUD_NET_HEADER_SIZE + (isBlockRead(f->reg) ? LC_DEVICE_BLOCK_SIZE : 0);
+        if((size_t)(conn->rxLen - pos) < need) {
+            break;
+        }
+        if(f->answer != NULL) {
+            memcpy(f->answer, &conn->rx[pos], LCLOUD_NET_HEADER_SIZE);
+            *f->answer = ntohll64(*f->answer);
+        }
+        if(need > LCLOUD_NET_HEADER_SIZE) {
+            memcpy(f->buf, &conn->rx[pos + LCLOUD_NET_HEADER_SIZE], LC_DEVICE_BLOCK_SIZE);
+        }
+        pos += need;
+        answered++;
     }
-    response = ntohll64(response);   
+    memmove(conn->rx, &conn->rx[pos], conn->rxLen - pos);
+    conn->rxLen -= pos;
 
-    return response;
+    if(answered != conn->answered) {
+        __atomic_store_n(&conn->answered, answered, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&conn->waiting, __ATOMIC_SEQ_CST) > 0) {
+            pthread_mutex_lock(&conn->lock);
+            pthread_cond_broadcast(&conn->answeredCond);
+            pthread_mutex_unlock(&conn->lock);
+        }
+    }
 }
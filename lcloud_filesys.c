@@ -15,7 +15,11 @@
 #include "cmpsc311_log.h"
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "lcloud_cache.h"
+#include "cmpsc311_util.h"
 
 
 
@@ -26,58 +30,179 @@
 #include "lcloud_support.h"
 
 
+//Defines
+#define LC_READAHEAD_MIN 4            //Blocks read ahead when a stream is first seen
+#define LC_READAHEAD_QUEUE 256        //Blocks waiting to be read ahead, across all files
+#define LC_HANDLE_SLOT_BITS 20        //Low bits of a handle are its slot in the file table, the rest its generation
+#define LC_HANDLE_SLOT_MASK ((1 << LC_HANDLE_SLOT_BITS) - 1)
+#define LC_HANDLE_GEN_MASK ((1 << (31 - LC_HANDLE_SLOT_BITS)) - 1)
+#define LC_FS_MAGIC "LCFSYS1"         //First 8 bytes of the superblock (with the NUL)
+#define LC_FS_VERSION 2              //1 had no list of blocks set aside but not written, it still mounts
+#define LC_META_NONE 0xFFFFFFFF       //End of the metadata block chain
+#define LC_META_PAYLOAD (LC_DEVICE_BLOCK_SIZE - 4) //Metadata bytes in a chain block, after the next block's address
+#define LC_ASYNC_WORKERS 4            //Threads running asynchronous requests, unless LC_ASYNC_THREADS says otherwise
+#define LC_ASYNC_MAX_WORKERS 64
+#define LC_ASYNC_SLOT_BITS 20         //Like a handle, a request ID is its slot and the slot's generation
+#define LC_ASYNC_SLOT_MASK ((1 << LC_ASYNC_SLOT_BITS) - 1)
+#define LC_ASYNC_GEN_MASK ((1 << (31 - LC_ASYNC_SLOT_BITS)) - 1)
+#define LC_ASYNC_FREE 0               //Request slot states
+#define LC_ASYNC_QUEUED 1
+#define LC_ASYNC_RUNNING 2
+#define LC_ASYNC_DONE 3
+#define LC_DEFRAG_BATCH 16            //Blocks a defrag copies before letting the other calls in
+#define LC_READ_BATCH 64              //Block reads a file read sends before waiting for them
+#define LC_WRITE_BATCH 64             //Block writes a file write sends before waiting for them
+
 //typedefs and structs
 
-typedef struct MEMORY_ENTRY {       //Used to keep track of where each byte is in the device
-    uint32_t startByte;
-    uint16_t length;
+typedef struct MEMORY_ENTRY {       //A run of the file held in consecutive blocks of one sector
+    uint32_t startByte;             //Always at a block boundary
+    uint32_t length;                //Bytes mapped, a hole or the end of the file can follow part way into the last block
+    uint16_t block;                 //First block of the run
     uint8_t sec;
-    uint8_t block;
     LcDeviceId device;
 } MEMORY_ENTRY;
 
+typedef struct INODE {              //A file on the devices, found by its path
+    char *path;
+    uint32_t length;
+    MEMORY_ENTRY *pos;               //Memory entries, sorted by startByte
+    uint32_t entries;
+    uint32_t capacity;               //Memory entries allocated
+    pthread_rwlock_t lock;           //Shared to read the file, exclusive to write it
+    uint32_t writes;                 //Bumped by every write, so a defrag can tell the file changed under it
+    uint32_t *held;                  //Addresses of blocks written to the cache only (write back), for flushData
+    uint32_t numHeld;
+    uint32_t heldCap;                //Addresses allocated in held
+} INODE;
+
 typedef struct FILE_INFO {          //General file info
     LcFHandle handle;
-    uint32_t length;
     uint32_t loc;
 } FILE_INFO;
 
-typedef struct FILE_OBJ {           //File object
+typedef struct FILE_OBJ {           //File object, an open handle to an inode
     FILE_INFO info;
-    MEMORY_ENTRY *pos; 
-    uint32_t entries;
+    uint32_t ino;                    //Index of the file's inode
+    uint32_t raExpect;               //Where the next read starts if the file is read sequentially
+    uint32_t raWindow;               //Read ahead window in blocks, 0 if not streaming
+    uint32_t raLimit;                //Largest window for this file, cut when read ahead blocks are wasted
+    uint32_t raStart;                //First file block read ahead for the stream
+    uint32_t raNext;                 //Next file block to read ahead
+    uint32_t gen;                    //Generation of the slot, bumped on close so old handles stop matching
+    int nextFree;                    //Next free slot in the file table, -1 if none
+    int open;                        //Is the slot in use
+    pthread_mutex_t lock;            //Guards the position and read ahead state
 } FILE_OBJ;
 
-typedef struct BLOCK {             //Block object
+typedef struct RA_REQ {             //Block waiting to be read ahead
+    LcFHandle handle;
+    LcDeviceId device;
+    uint8_t sec;
+    uint16_t block;
+} RA_REQ;
+
+typedef struct POSTED_READ {       //Block read sent straight into a reader's buffer
+    LcDeviceId device;
+    uint8_t sec;
+    uint16_t block;
+    char *data;                     //Where the block goes
+} POSTED_READ;
+
+typedef struct ASYNC_REQ {         //Read or write started by lcread_async or lcwrite_async
     LcFHandle handle;
-    uint16_t spaceUsed;
+    size_t off;                     //Where in the file it starts
+    char *buf;
+    size_t len;
+    int write;                      //Is it a write
+    LcCompletion done;              //Called with the result, NULL if it is polled for
+    void *arg;                      //Passed to done
+    int result;                     //Bytes read or written, -1 if failure
+    int state;                      //LC_ASYNC_FREE, _QUEUED, _RUNNING or _DONE
+    uint32_t gen;                   //Generation of the slot, bumped when it is freed
+    int next;                       //Next request queued or free, -1 if none
+} ASYNC_REQ;
+
+typedef struct FREE_RUN {          //Free blocks in a row in one sector
+    uint32_t first;                 //Block number, sector major
+    uint32_t length;
+} FREE_RUN;
+
+typedef struct BLOCK {             //Block object
+    uint16_t spaceUsed;             //Bytes of file data from the start of the block, the rest reads as zeros. 0 until a reserved block is written
 } BLOCK;
 
 typedef BLOCK* SECTOR;             //Sector object
 
+typedef struct SUPERBLOCK {        //Block 0 of sector 0 of the first device, where a mount starts
+    char magic[8];                 //LC_FS_MAGIC
+    uint32_t version;              //LC_FS_VERSION
+    uint32_t imageLength;          //Bytes of metadata in the chain
+    uint64_t geometry;             //Hash of the devices' IDs and sizes it was formatted on
+    uint64_t checksum;             //Of the metadata
+    uint32_t firstMeta;            //Address of the first chain block, LC_META_NONE if none
+    uint64_t generation;           //Bumped at every power on, 0 in superblocks older than it
+} SUPERBLOCK;
+
 typedef struct DEVICE_OBJ {        //Device object
     LcDeviceId id;
     uint16_t numSectors;
     uint16_t numBlocks;
     SECTOR *table;
+    uint64_t *freeMap;             //Bit per block (sector major), set while the block is free
+    uint32_t numFree;              //Free blocks left
+    uint32_t freeHint;             //No free blocks in the freeMap words before this one
+    pthread_mutex_t lock;          //Guards the free map, count and hint
 } DEVICE_OBJ;
 
 
 //Global Variables
-FILE_OBJ files[256];                  //Contains info for each file
+FILE_OBJ **files = NULL;              //Contains info for each file, indexed by handle slot. Each is allocated once, so its lock never moves
+uint32_t fileSlots = 0;               //Slots allocated in files
 uint32_t numHandles = 0;              //Number of open files
+int freeSlot = -1;                    //First free slot in files, the rest are chained through nextFree
+INODE **inodes = NULL;                //Every file on the devices, each allocated once
+uint32_t numInodes = 0;
+uint32_t inodeSlots = 0;              //Inodes allocated
+int32_t *pathIndex = NULL;            //Open addressed hash of paths to inodes, -1 if empty
+uint32_t pathSlots = 0;               //Size of pathIndex, a power of 2
+uint32_t *metaBlocks = NULL;          //Addresses of the metadata chain blocks, in order
+uint32_t numMeta = 0;
+char *metaCopy = NULL;                //The chain blocks as last written, so a sync with nothing changed writes nothing
+char superCopy[LC_DEVICE_BLOCK_SIZE]; //The superblock as last written
 DEVICE_OBJ devices[16];              //Device IDs
 int numDevices = 0;                  //Number of devices
 int on = 0;                          //Power state
-int i;                               //Used in for loops, declared now for convienience
-//Registers
-uint8_t b0;
-uint8_t b1;
-uint8_t c0;
-uint8_t c1;
-uint8_t c2;
-uint16_t d0;
-uint16_t d1;
+int writeBack = 0;                   //Are writes held in the cache until flushed
+int sharedBus = 0;                   //Can file I/O wait for answers without its bus lock (the client's engine, no write back)
+int readAhead = 0;                   //Largest read ahead window in blocks, 0 if off
+int stripeUnit = 0;                  //Blocks of a file on one device before the next, 0 fills one device at a time
+int defragRate = 0;                  //Most blocks a second a defrag copies, 0 for no limit
+uint32_t mountGen = 0;               //Bumped by every unmount, so a defrag can tell the devices went away under it
+uint64_t fsGeneration = 0;           //Generation of the mounted filesystem, what cache snapshots are tagged with
+//Locks are taken in this order: fsLock, a handle's lock, its inode's lock, a device's lock, bus locks (lowest first), raLock
+pthread_rwlock_t fsLock = PTHREAD_RWLOCK_INITIALIZER; //Shared for file I/O, exclusive to open or close a handle, sync the metadata or power on or off
+pthread_mutex_t busLock[LC_BUS_MAX_CONNECTIONS] = { [0 ... LC_BUS_MAX_CONNECTIONS-1] = PTHREAD_MUTEX_INITIALIZER }; //One per connection, held across each bus transfer on it and the cache update that goes with it, unless fsLock is held exclusive (with sharedBus, file I/O only holds it to post and update the cache)
+pthread_mutex_t raLock = PTHREAD_MUTEX_INITIALIZER;  //Guards the read ahead queue
+pthread_cond_t raCond = PTHREAD_COND_INITIALIZER;    //Signals the read ahead thread
+pthread_t raThread;                  //Reads blocks ahead of the readers
+RA_REQ raQueue[LC_READAHEAD_QUEUE];  //Blocks to read ahead, oldest at raHead
+int raHead = 0;
+int raCount = 0;
+int raStop = 0;                      //Tells the read ahead thread to exit
+uint32_t raEpoch = 0;                //Bumped when freed blocks are taken off the queue, a block dequeued before is not filled in
+ASYNC_REQ *asyncReqs = NULL;         //Asynchronous requests, indexed by request ID slot
+uint32_t asyncSlots = 0;             //Slots allocated in asyncReqs
+int asyncFree = -1;                  //First free request slot, the rest are chained through next
+int asyncHead = -1;                  //Oldest queued request, the rest are chained through next
+int asyncTail = -1;
+int asyncPending = 0;                //Requests queued or running
+pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER; //Guards the requests, never held while calling into the filesystem
+pthread_cond_t asyncCond = PTHREAD_COND_INITIALIZER;   //Signals the request threads
+pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER;   //Signals a finished request
+pthread_t asyncThreads[LC_ASYNC_MAX_WORKERS]; //Run the requests
+int asyncWorkers = 0;                //Request threads started, none until the first request
+int asyncStop = 0;                   //Tells the request threads to exit
 
 
 // File system interface prototypes in header
@@ -85,44 +210,187 @@ uint16_t d1;
 //Help functions
 int checkHandle(LcFHandle h);   //used to match handle to file
 
+int growFiles();                //Adds free slots to the file table
+
+void releaseSlot(int slot);     //Frees a closed file's slot
+
+int fileTransfer(LcFHandle fh, const size_t *at, char *buf, size_t len, int write); //Reads or writes at the position or an offset
+
+int readFile(FILE_OBJ *fl, INODE *ip, uint32_t *loc, char *buf, size_t len); //Reads from a file
+
+int writeFile(FILE_OBJ *fl, INODE *ip, uint32_t *loc, char *buf, size_t len); //Writes to a file
+
+void finishReads(POSTED_READ *posted, int n, int cache); //Waits for the block reads a file read sent
+
+void finishWrites(uint16_t posted); //Waits for the block writes a file write sent
+
 int checkId(LcDeviceId d);      //Used to match id to device
 
+pthread_mutex_t *busFor(LcDeviceId did); //The bus lock of the connection a device uses
+
+void lockBuses(LcDeviceId a, LcDeviceId b); //Takes the bus locks of two devices
+
+void unlockBuses(LcDeviceId a, LcDeviceId b); //Releases the bus locks of two devices
+
+int flushData(INODE *ip);       //Writes a file's dirty cached blocks
+
+int holdBlock(INODE *ip, uint32_t addr); //Remembers a block of the file left dirty in the cache
+
+int compareAddress(const void *a, const void *b); //qsort order of block addresses
+
+int lookupPath(const char *path); //Finds the inode of a path
+
+int newInode(const char *path); //Creates an empty file
+
+uint64_t pathHash(const char *path); //Hash of a path for the path index
+
+int mountFs();                  //Reads the filesystem metadata, formatting the devices if there is none
+
+int syncFs();                   //Writes the filesystem metadata
+
+void freeChain(const uint32_t *blocks, uint32_t n); //Frees the blocks of a metadata chain
+
+void takeChain(const uint32_t *blocks, uint32_t n); //Marks the blocks of a freed metadata chain used again
+
+void unmountFs();               //Forgets the filesystem, for the next power on
+
+size_t imageSize();             //Bytes of metadata
+
+void buildImage(char *img);     //Serializes the metadata
+
+int parseImage(const char *img, size_t len, uint32_t version); //Loads serialized metadata
+
+uint32_t unwrittenBlocks(char *addrs); //Lists the file blocks set aside but not written
+
+uint64_t fsGeometry();          //Hash of the devices' IDs and sizes
+
+uint64_t fsChecksum(const char *p, size_t len); //Checksum of the metadata
+
+uint32_t metaAddress(DEVICE_OBJ *dev, uint32_t b); //Packs a block's device and number
+
+int metaTransfer(uint32_t addr, int op, char *data); //Reads or writes a metadata block
+
+void freeBlock(DEVICE_OBJ *dev, uint32_t b); //Gives a block back to the free map
+
+void dropInodes();              //Forgets every file
+
 int powerOn();                  //Powers bus on the system
 
 int convertId(uint16_t mask);   //Converts device id from mask;
 
-int availableSpace(LcDeviceId device, LcFHandle fh, uint8_t *sec, uint16_t *block); //Checks which block to write to
+int allocBlocks(int want, const MEMORY_ENTRY *after, int target, DEVICE_OBJ **dev, uint8_t *sec, uint16_t *block); //Allocates a run of free blocks
+
+int stripeDevice(FILE_OBJ *fl, uint32_t fileBlock); //Which device a file block is striped to
+
+int takeRun(DEVICE_OBJ *dev, uint32_t first, int want); //Marks free blocks from one on as used
+
+int writeBlock(LcDeviceId did, uint16_t sec, uint16_t blk, char *data); //Writes a block to a device
+
+int findExtent(INODE *ip, uint32_t loc); //Finds the memory entry holding a file offset's block
+
+int prevExtent(INODE *ip, uint32_t loc); //Finds the last memory entry starting at or before a file offset
+
+int addExtent(INODE *ip, uint32_t loc, uint32_t len, LcDeviceId did, uint8_t sec, uint16_t blk); //Maps bytes of a file to a block
+
+uint32_t holeBlocks(INODE *ip, uint32_t loc, uint64_t end); //Counts the unmapped blocks from an offset on
+
+int allocFor(FILE_OBJ *fl, INODE *ip, uint32_t fileBlock, uint32_t want, DEVICE_OBJ **dev, uint8_t *sec, uint16_t *block); //Allocates blocks for a hole in a file
+
+void readAheadFrom(FILE_OBJ *fl, uint32_t fileBlock); //Queues the blocks after a sequential read
+
+void cancelReadAhead(FILE_OBJ *fl); //Forgets the blocks queued for a file
+
+int dequeueReadAhead(LcDeviceId did, uint8_t sec, uint16_t blk); //Takes a block back off the read ahead queue
+
+void readAheadFeedback(FILE_OBJ *fl, uint32_t fileBlock, int used, int late); //Adapts a file's window to how its read ahead fared
+
+void *readAheadWorker(void *arg);   //Read ahead thread
+
+LcRequestId submitAsync(LcFHandle fh, size_t off, char *buf, size_t len, int write, LcCompletion done, void *arg); //Queues an asynchronous request
+
+int checkRequest(LcRequestId req); //Used to match a request ID to its slot
+
+int growAsync();                    //Adds free slots to the request table
+
+void releaseRequest(int slot);      //Frees a finished request's slot
+
+int startAsync();                   //Starts the request threads
+
+void stopAsync();                   //Waits for the requests, then stops their threads
+
+void *asyncWorker(void *arg);       //Request thread
+
+int onAsyncThread();                //Is the caller one of the request threads
+
+int planRuns(DEVICE_OBJ *dev, uint32_t need, FREE_RUN *runs); //Picks the fewest free runs of a device that hold a file
+
+int compareRuns(const void *a, const void *b); //qsort order of free runs, longest first
+
+void freeExtents(const MEMORY_ENTRY *pos, uint32_t entries); //Gives the blocks of memory entries back to the free maps
+
+void forgetExtents(const MEMORY_ENTRY *pos, uint32_t entries); //Drops the cached and queued read ahead blocks of memory entries
+
+int inExtent(const MEMORY_ENTRY *m, LcDeviceId did, uint8_t sec, uint16_t blk); //Is a block one of a memory entry's
+
+int copyBlock(const MEMORY_ENTRY *from, uint32_t fromBlock, DEVICE_OBJ *to, uint32_t toBlock); //Copies a block for a defrag
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcopen
-// Description  : Open the file for for reading and writing
+// Description  : Open the file for for reading and writing, creating it if
+//                there is no file with that path on the devices
 //
 // Inputs       : path - the path/filename of the file to be read
 // Outputs      : file handle if successful test, -1 if failure
 
 
 LcFHandle lcopen( const char *path ) {
+    int ino;
 
-    if(!on) {
-        powerOn();
+    if(path == NULL) {
+        return -1;
+    }
+
+    //The tables may grow, so no other call can be using them
+    pthread_rwlock_wrlock(&fsLock);
+    if(!on && powerOn() == -1) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+
+    //Find the file, or make it
+    ino = lookupPath(path);
+    if(ino == -1) {
+        ino = newInode(path);
+        if(ino == -1) {
+            pthread_rwlock_unlock(&fsLock);
+            return -1;
+        }
     }
 
-    LcFHandle handle = numHandles;      //Make Handle
-    if(checkHandle(handle) != -1) {     //Fail if file already opened
+    //Take a free slot, the handle is the slot and its generation
+    if(freeSlot == -1 && growFiles() == -1) {
+        pthread_rwlock_unlock(&fsLock);
         return -1;
     }
+    int slot = freeSlot;
+    FILE_OBJ *fl = files[slot];
+    freeSlot = fl->nextFree;
+    LcFHandle handle = (LcFHandle)(fl->gen << LC_HANDLE_SLOT_BITS | slot);
 
     //Create new file object
-    FILE_OBJ fl;
-    fl.info.handle = handle;
-    fl.info.loc = 0;
-    fl.info.length = 0; 
-    fl.entries = 0;
-    fl.pos = malloc(0);
-    //Add to list of open files
-    files[numHandles] = fl; 
+    fl->info.handle = handle;
+    fl->info.loc = 0;
+    fl->ino = ino;
+    fl->raExpect = 0;
+    fl->raWindow = 0;
+    fl->raLimit = readAhead;
+    fl->raStart = 0;
+    fl->raNext = 0;
+    fl->nextFree = -1;
+    fl->open = 1;
     numHandles++;
+    pthread_rwlock_unlock(&fsLock);
 
     return handle;
 } 
@@ -139,216 +407,418 @@ LcFHandle lcopen( const char *path ) {
 // Outputs      : number of bytes read, -1 if failure
 
 int lcread( LcFHandle fh, char *buf, size_t len ) {
-    uint8_t sec = 0;                                //Sector to read from
-    uint16_t block = 0;                             //Block to read from
-    DEVICE_OBJ dev;                                 //Device object
-    size_t subLen;                                  //How much of the read to do (if read spans multiple blocks)
-    char *subBuf  = (char *)malloc(LC_DEVICE_BLOCK_SIZE); //Temporary holder
-    int subPos = 0;                                 //How far along read
-    FILE_OBJ *fl;                                   //File to read from
-    int fIndex;                                     //Which file in array of files
-    int off;                                        //Where in memory entry the read starts
-    int memPos;
+    return fileTransfer(fh, NULL, buf, len, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcwrite
+// Description  : write data to the file
+//
+// Inputs       : fh - file handle for the file to write to
+//                buf - pointer to data to write
+//                len - the length of the write
+// Outputs      : number of bytes written if successful test, -1 if failure
+int lcwrite( LcFHandle fh, char *buf, size_t len ) {
+    return fileTransfer(fh, NULL, buf, len, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileTransfer
+// Description  : Reads or writes a file at the handle's position, which
+//                then moves past the bytes done, or at a given offset,
+//                which leaves the position alone
+//
+// Inputs       : fh - the file handle, at - the offset (NULL for the
+//                handle's position), buf - the data, len - its length,
+//                write - is it a write
+// Outputs      : number of bytes read or written, -1 if failure
+int fileTransfer(LcFHandle fh, const size_t *at, char *buf, size_t len, int write) {
+    FILE_OBJ *fl;
+    uint32_t loc;
+    int fIndex;
+    int ret;
+
+    if(at != NULL && *at > UINT32_MAX) {
+        return -1;
+    }
 
     //Ensure the handle exist, then get the file object
-    fIndex = checkHandle(fh);                        
+    pthread_rwlock_rdlock(&fsLock);
+    fIndex = checkHandle(fh);
     if(fIndex == -1) {
+        pthread_rwlock_unlock(&fsLock);
         return -1;
     }
-    fl = &files[fIndex];
+    fl = files[fIndex];
+    pthread_mutex_lock(&fl->lock);
+
+    loc = (at == NULL) ? fl->info.loc : *at;
+    if(write) {
+        ret = writeFile(fl, inodes[fl->ino], &loc, buf, len);
+    }
+    else {
+        ret = readFile(fl, inodes[fl->ino], &loc, buf, len);
+    }
+    if(at == NULL) {
+        fl->info.loc = loc;
+    }
+    pthread_mutex_unlock(&fl->lock);
+    pthread_rwlock_unlock(&fsLock);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFile
+// Description  : Reads from a file. Other readers of the file may go on at
+//                the same time, its writers wait. Holes, and the part of a
+//                block past its spaceUsed, read as zeros without going to
+//                the devices. Called holding fsLock shared and the handle's
+//                lock.
+//
+// Inputs       : fl - the handle, ip - its inode, loc - where to read,
+//                moved past the bytes read, buf - place to put the data,
+//                len - the length of the read
+// Outputs      : number of bytes read (0 at or past the end), -1 if failure
+int readFile(FILE_OBJ *fl, INODE *ip, uint32_t *loc, char *buf, size_t len) {
+    uint8_t sec = 0;                                //Sector to read from
+    uint16_t block = 0;                             //Block to read from
+    DEVICE_OBJ *dev = NULL;                         //Device object
+    size_t subLen;                                  //How much of the read to do (if read spans multiple blocks)
+    int used = 0;                                   //Bytes of file data in the block
+    char subBuf[LC_DEVICE_BLOCK_SIZE];              //Holds a block fetched from a device
+    LcCacheRef ref;                                 //Block pinned in the cache
+    int subPos = 0;                                 //How far along read
+    int off;                                        //Where in the block the read starts
+    int memPos = 0;
+    int hit;                                        //Was the block in the cache
+    int late;                                       //Was the block still waiting to be read ahead
+    int seq;                                        //Does the read carry on from the last one
+    int direct;                                     //Does the block go straight into buf
+    POSTED_READ posted[LC_READ_BATCH];              //Block reads sent and not waited for yet
+    int numPosted = 0;
+
+    pthread_rwlock_rdlock(&ip->lock);
 
     //If the length of read goes past the end of the file, make it go to end of file
-    if(len >= fl->info.length - fl->info.loc) {
-        len = fl->info.length - fl->info.loc;
+    if(*loc >= ip->length) {
+        len = 0;
+    }
+    else if(len >= ip->length - *loc) {
+        len = ip->length - *loc;
+    }
+
+    //Only a read that starts where the last one ended keeps a stream going
+    seq = (*loc == fl->raExpect);
+    if(!seq) {
+        cancelReadAhead(fl);
     }
 
     //Keep reading until read completes
     while (subPos < len) {
         //Where in block the file position is in
-        off = fl->info.loc%LC_DEVICE_BLOCK_SIZE;
-
-        //Find which memory entry the file position is in
-        for(memPos=0;memPos<fl->entries;memPos++) {
-            if (fl->info.loc >= fl->pos[memPos].startByte && fl->info.loc < fl->pos[memPos].startByte + fl->pos[memPos].length) {
-                sec = fl->pos[memPos].sec;
-                block = fl->pos[memPos].block;
-                dev = devices[checkId(fl->pos[memPos].device)];
-                break;
-            }
+        off = *loc%LC_DEVICE_BLOCK_SIZE;
+
+        //Find which memory entry, then which of its blocks, the file position is in
+        memPos = findExtent(ip, *loc);
+        if(memPos != -1) {
+            sec = ip->pos[memPos].sec;
+            block = ip->pos[memPos].block + (*loc - ip->pos[memPos].startByte) / LC_DEVICE_BLOCK_SIZE;
+            dev = &devices[checkId(ip->pos[memPos].device)];
+            used = dev->table[sec][block].spaceUsed;
         }
 
-        //Determine if read can be done in one go
-        if ((fl->pos[memPos].length + fl->pos[memPos].startByte) - fl->info.loc >= len - subPos) {
-            subLen = len-subPos;
-            }
-        else {
-            subLen = fl->pos[memPos].length - off;
+        //Read to the end of the block at most, len already stops at the end of file
+        subLen = CMPSC311_MINVAL(len - subPos, LC_DEVICE_BLOCK_SIZE - off);
+
+        //A hole, or a part of the block nothing was written to, is zeros
+        if(memPos == -1 || used <= off) {
+            memset(&buf[subPos], 0, subLen);
+            subPos += subLen;
+            *loc += subLen;
+            continue;
+        }
+        if(off + subLen > used) {
+            memset(&buf[subPos + used - off], 0, off + subLen - used);
         }
 
-        //read from block and copy the necessary chunk to buf
-        if(lcloud_getcache(dev.id,sec,block) == NULL) {
-            client_lcloud_bus_request(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev.id,LC_XFER_READ,sec,block),subBuf);
+        //Copy the necessary chunk to buf, straight from the cache if it is there.
+        //On a miss, read ahead may be fetching the block, so look again once the bus is ours.
+        hit = (lcloud_pincache(dev->id,sec,block,&ref) == 0);
+        late = 0;
+        if(hit) {
+            memcpy(&buf[subPos],&ref.data[off],CMPSC311_MINVAL(subLen, used - off));
+            lcloud_unpincache(&ref);
         }
         else {
-            memcpy(subBuf,lcloud_getcache(dev.id,sec,block),LC_DEVICE_BLOCK_SIZE);
+            late = readAhead && dequeueReadAhead(dev->id,sec,block);
+            pthread_mutex_lock(busFor(dev->id));
+            hit = readAhead && lcloud_peekcache(dev->id,sec,block,subBuf) == 0;
+            direct = !hit && off == 0 && subLen == LC_DEVICE_BLOCK_SIZE && used == LC_DEVICE_BLOCK_SIZE;
+            //A whole block is read straight into buf, and waited for along with the ones after it
+            if(direct) {
+                client_lcloud_bus_post(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,LC_XFER_READ,sec,block),&buf[subPos]);
+                posted[numPosted].device = dev->id;
+                posted[numPosted].sec = sec;
+                posted[numPosted].block = block;
+                posted[numPosted].data = &buf[subPos];
+                numPosted++;
+            }
+            else if(!hit) {
+                //Nobody writes the file meanwhile, so with sharedBus the answer is waited for without the lock
+                if(sharedBus) {
+                    pthread_mutex_unlock(busFor(dev->id));
+                }
+                client_lcloud_bus_request(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,LC_XFER_READ,sec,block),subBuf);
+                if(sharedBus) {
+                    pthread_mutex_lock(busFor(dev->id));
+                }
+                //The stream's blocks may be queued again, caching it keeps them from being fetched twice
+                if(readAhead && seq) {
+                    lcloud_putcache(dev->id,sec,block,subBuf);
+                }
+            }
+            pthread_mutex_unlock(busFor(dev->id));
+            if(!direct) {
+                memcpy(&buf[subPos],&subBuf[off],CMPSC311_MINVAL(subLen, used - off));
+            }
+            if(numPosted == LC_READ_BATCH) {
+                finishReads(posted, numPosted, readAhead && seq);
+                numPosted = 0;
+            }
+        }
+        if(fl->raWindow) {
+            readAheadFeedback(fl, *loc / LC_DEVICE_BLOCK_SIZE, hit, late);
         }
-
-        memcpy(&buf[subPos],&subBuf[(off)],subLen);
 
         //file tracking
         subPos += subLen; 
-        fl->info.loc += subLen;
+        *loc += subLen;
     }
 
-    //cleanup
-    free(subBuf);
-    subBuf = NULL;
+    if(numPosted > 0) {
+        finishReads(posted, numPosted, readAhead && seq);
+    }
+    fl->raExpect = *loc;
+    if(readAhead && seq && len > 0) {
+        readAheadFrom(fl, (*loc - 1) / LC_DEVICE_BLOCK_SIZE);
+    }
+    pthread_rwlock_unlock(&ip->lock);
 
     return( len );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcwrite
-// Description  : write data to the file
+// Function     : finishReads
+// Description  : Waits for the block reads a file read sent without
+//                waiting, a connection at a time, then caches the blocks if
+//                the read is a stream being read ahead, as a block read one
+//                at a time would be. With sharedBus the bus lock is not
+//                needed, nobody writes the blocks meanwhile.
 //
-// Inputs       : fh - file handle for the file to write to
-//                buf - pointer to data to write
-//                len - the length of the write
-// Outputs      : number of bytes written if successful test, -1 if failure
-int lcwrite( LcFHandle fh, char *buf, size_t len ) {
+// Inputs       : posted - the reads, n - how many, cache - put the blocks
+//                in the cache
+// Outputs      : none
+void finishReads(POSTED_READ *posted, int n, int cache) {
+    uint32_t waited = 0;                            //Connections already waited for
+    int c;
+
+    for(int k=0;k<n;k++) {
+        c = client_lcloud_bus_channel(posted[k].device);
+        if(waited & (1u << c)) {
+            continue;
+        }
+        waited |= 1u << c;
+
+        if(!sharedBus) {
+            pthread_mutex_lock(busFor(posted[k].device));
+        }
+        client_lcloud_bus_wait(posted[k].device);
+        for(int j=k;j<n && cache;j++) {
+            if(client_lcloud_bus_channel(posted[j].device) == c) {
+                lcloud_putcache(posted[j].device, posted[j].sec, posted[j].block, posted[j].data);
+            }
+        }
+        if(!sharedBus) {
+            pthread_mutex_unlock(busFor(posted[k].device));
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : finishWrites
+// Description  : Waits for the block writes a file write sent without
+//                waiting, on each device they went to. With sharedBus the
+//                bus lock is not needed for that.
+//
+// Inputs       : posted - the devices written to, a bit each
+// Outputs      : none
+void finishWrites(uint16_t posted) {
+    for(int d=0;posted != 0;d++) {
+        if(posted & (1u << d)) {
+            if(!sharedBus) {
+                pthread_mutex_lock(busFor(d));
+            }
+            client_lcloud_bus_wait(d);
+            if(!sharedBus) {
+                pthread_mutex_unlock(busFor(d));
+            }
+            posted &= ~(1u << d);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFile
+// Description  : Writes to a file, keeping everyone else out of it. A write
+//                past the end leaves a hole between the end and where it
+//                starts. Called holding fsLock shared and the handle's lock.
+//
+// Inputs       : fl - the handle, ip - its inode, loc - where to write,
+//                moved past the bytes written, buf - pointer to data to
+//                write, len - the length of the write
+// Outputs      : number of bytes written if successful, -1 if failure
+int writeFile(FILE_OBJ *fl, INODE *ip, uint32_t *loc, char *buf, size_t len) {
     uint8_t sec = 0;                                //Sector to write to
     uint16_t block = 0;                            //block to write to
     size_t subLen;                                  //How much to write for this pass
-    char *subBuf = (char *)malloc(LC_DEVICE_BLOCK_SIZE); //Temporary holder
+    char *subBuf;                                   //The block being written, in bufs
+    char *bufs;                                     //One block per write sent and not waited for yet
+    int numBufs;
+    int nextBuf = 0;
     int subPos = 0;                                 //How far along current write
-    FILE_OBJ *fl;                                   //File to write to
-    int fIndex;                                     //Which file in array of files
     int memPos = -1;
-    int overwrite = 0;
+    int off;                                        //Where in the block the write starts
+    int used;                                       //Bytes of file data in the block before the write
     DEVICE_OBJ *dev;
-
-    //Ensure the handle exist, then get the file object
-    fIndex = checkHandle(fh);
-    if(fIndex == -1) {
+    DEVICE_OBJ *runDev = NULL;                      //Blocks allocated for the rest of the write
+    uint8_t runSec = 0;
+    uint16_t runBlock = 0;
+    int runLeft = 0;
+    uint32_t oldLength;                             //File length before the write
+    uint16_t posted = 0;                            //Devices block writes were sent to without waiting for them
+    int ret = len;
+
+    if((uint64_t)*loc + len > UINT32_MAX) {
         return -1;
     }
-    fl = &files[fIndex];
-
-    //Check if overwriting old data
-    if(fl->info.loc < fl->info.length) {
-        overwrite = 1;
+    //The client sends a block written straight from its buffer, so each
+    //stays put until the write is waited for
+    numBufs = CMPSC311_MAXVAL(1, CMPSC311_MINVAL(LC_WRITE_BATCH, (*loc % LC_DEVICE_BLOCK_SIZE + len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE));
+    bufs = (char *)malloc((size_t)numBufs * LC_DEVICE_BLOCK_SIZE);
+    if(bufs == NULL) {
+        logMessage(LOG_ERROR_LEVEL,"Could not allocate the write buffers");
+        return -1;
     }
+    pthread_rwlock_wrlock(&ip->lock);
+    oldLength = ip->length;
+    ip->writes++;
 
     //increase file length if necessary
-    if(fl->info.loc + len > fl->info.length) {
-        fl->info.length += len - (fl->info.length - fl->info.loc);
+    if(*loc + len > ip->length) {
+        ip->length = *loc + len;
     }
 
     //Keep writing until write is complete
     while (subPos < len) {
-
-        //Find next available block to write to
-        if(!overwrite) {
-            for(int q=0;q<numDevices;q++) {
-                if(availableSpace(devices[q].id,fh,&sec,&block) == 0) {
-                    dev = &devices[q];
-                    break;
-                }
-            }
+        off = *loc%LC_DEVICE_BLOCK_SIZE;
+        if(nextBuf == numBufs) {
+            finishWrites(posted);
+            posted = 0;
+            nextBuf = 0;
+        }
+        subBuf = &bufs[nextBuf * LC_DEVICE_BLOCK_SIZE];
+
+        //Find which block to overwrite if the file has one there
+        memPos = findExtent(ip, *loc);
+        if(memPos != -1) {
+            sec = ip->pos[memPos].sec;
+            block = ip->pos[memPos].block + (*loc - ip->pos[memPos].startByte) / LC_DEVICE_BLOCK_SIZE;
+            dev = &devices[checkId(ip->pos[memPos].device)];
         }
-        //Find which block to overwrite if overwriting
+        //Otherwise take the next new block, allocating them for the rest of the hole the write covers at once
         else {
-            for(memPos=0;memPos<fl->entries;memPos++) {
-                if (fl->info.loc >= fl->pos[memPos].startByte && fl->info.loc < fl->pos[memPos].startByte + fl->pos[memPos].length) {
-                    sec = fl->pos[memPos].sec;
-                    block = fl->pos[memPos].block;
-                    dev = &devices[checkId(fl->pos[memPos].device)];
-                    break;
-                }
+            if(runLeft == 0) {
+                runLeft = allocFor(fl, ip, *loc / LC_DEVICE_BLOCK_SIZE, holeBlocks(ip, *loc, (uint64_t)*loc + len - subPos),
+                    &runDev, &runSec, &runBlock);
+            }
+            if(runLeft == 0) {
+                logMessage(LOG_ERROR_LEVEL,"No free blocks left on the devices");
+                ip->length = CMPSC311_MAXVAL(oldLength, subPos ? *loc : 0);
+                ret = -1;
+                break;
             }
+            dev = runDev;
+            sec = runSec;
+            block = runBlock++;
+            runLeft--;
         }
 
-        //Get whats already in block to prevent unintentional overwritting
-        
-        if(lcloud_getcache(dev->id,sec,block) == NULL) {
-            client_lcloud_bus_request(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,LC_XFER_READ,sec,block),subBuf);
+        //Write to the end of the block at most
+        subLen = CMPSC311_MINVAL(len - subPos, LC_DEVICE_BLOCK_SIZE - off);
+
+        //Get whats already in block to prevent unintentional overwritting. A write
+        //covering the whole block, or to a block no file data was put in yet, has
+        //nothing to keep, only a partial update of a used block needs the read.
+        //Past spaceUsed the block may hold bytes cut off by lctruncate, which must
+        //read as zeros once the write takes the file data past them.
+        used = dev->table[sec][block].spaceUsed;
+        pthread_mutex_lock(busFor(dev->id));
+        if(subLen == LC_DEVICE_BLOCK_SIZE || used == 0) {
+            memset(subBuf, 0, LC_DEVICE_BLOCK_SIZE);
+            lcloud_skipread(dev->id,sec,block);
         }
         else {
-            memcpy(subBuf,lcloud_getcache(dev->id,sec,block),LC_DEVICE_BLOCK_SIZE);
-        }
-
-        //Check if write can be done in one pass
-        if(len-subPos <= LC_DEVICE_BLOCK_SIZE - dev->table[sec][block].spaceUsed) {
-            subLen = len-subPos;
-        }  
-        else if(overwrite==1) {
-            if(len - subPos >= (fl->pos[memPos].startByte + fl->pos[memPos].length) - fl->info.loc) {
-                subLen = LC_DEVICE_BLOCK_SIZE - fl->info.loc%LC_DEVICE_BLOCK_SIZE;
-            }
-            else{
-                subLen = len - subPos;
+            if(lcloud_readcache(dev->id,sec,block,subBuf) == -1) {
+                if(sharedBus) {
+                    pthread_mutex_unlock(busFor(dev->id));
+                }
+                client_lcloud_bus_request(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,LC_XFER_READ,sec,block),subBuf);
+                if(sharedBus) {
+                    pthread_mutex_lock(busFor(dev->id));
+                }
             }
-        }       
-        else {
-            subLen = LC_DEVICE_BLOCK_SIZE - dev->table[sec][block].spaceUsed;
+            memset(&subBuf[used], 0, LC_DEVICE_BLOCK_SIZE - used);
         }
-        
-        //Insert write into block
-        memcpy(&subBuf[fl->info.loc%LC_DEVICE_BLOCK_SIZE],&buf[subPos],subLen);
-        client_lcloud_bus_request(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,LC_XFER_WRITE,sec,block),subBuf);
-        lcloud_putcache(dev->id, sec, block, subBuf);
-
-        //House keeping
-        dev->table[sec][block].handle = fh;
-        subPos += subLen;
 
-        //If overwriting and write goes beyond end of memoryEntry, increase file length and alter memory entry
-        if(overwrite && subLen + (fl->info.loc - fl->pos[memPos].startByte) > fl->pos[memPos].length) {
-            fl->pos[memPos].length = subLen + (fl->info.loc - fl->pos[memPos].startByte);
-            dev->table[sec][block].spaceUsed = fl->pos[memPos].length;
-            assert(fl->pos[memPos].length<=256);
-            assert(dev->table[sec][block].spaceUsed <=256);
+        //Insert write into block, sending it on without waiting for the answer
+        memcpy(&subBuf[off],&buf[subPos],subLen);
+        if(!writeBack || lcloud_dirtycache(dev->id, sec, block, subBuf) == -1) {
+            client_lcloud_bus_post(create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,LC_XFER_WRITE,sec,block),subBuf);
+            lcloud_putcache(dev->id, sec, block, subBuf);
+            posted |= 1u << dev->id;
+            nextBuf++;
         }
-
-        //Otherwise if overwriting, do nothing
-        else if(overwrite) {
-            assert(dev->table[sec][block].spaceUsed <= 256);
+        else if(holdBlock(ip, metaAddress(dev, (uint32_t)sec * dev->numBlocks + block)) == -1) {
+            lcloud_flushblock(dev->id, sec, block);
         }
+        pthread_mutex_unlock(busFor(dev->id));
 
-        //If this is not the first write, but not overwriting, increase file length, alter memory entry
-        else if(fl->entries && fl->pos[fl->entries-1].startByte + fl->pos[fl->entries-1].length == fl->info.loc && 
-            fl->pos[fl->entries-1].sec == sec && fl->pos[fl->entries-1].block == block && fl->pos[fl->entries-1].device == dev->id) {
-            fl->pos[fl->entries-1].length += subLen;
-            if(fl->pos[fl->entries-1].length > 256){
-            assert(fl->pos[fl->entries-1].length <= 256);}
-            dev->table[sec][block].spaceUsed += subLen;
-            assert(dev->table[sec][block].spaceUsed <= 256);
-        }
+        //House keeping, the block is used up to the end of the write if that is further than before
+        dev->table[sec][block].spaceUsed = CMPSC311_MAXVAL(dev->table[sec][block].spaceUsed, off + subLen);
+        assert(dev->table[sec][block].spaceUsed <= LC_DEVICE_BLOCK_SIZE);
 
-        //Make new memory entry
-        else {
-            fl->pos = (MEMORY_ENTRY *)realloc(fl->pos,sizeof(MEMORY_ENTRY) * (fl->entries+1));
-            fl->pos[fl->entries].startByte = fl->info.loc;
-            fl->pos[fl->entries].length = subLen;
-            fl->pos[fl->entries].sec = sec;
-            fl->pos[fl->entries].block = block;
-            fl->pos[fl->entries].device = dev->id;
-            fl->entries++;
-            dev->table[sec][block].spaceUsed += subLen;
-            assert(fl->pos[fl->entries-1].length <= 256);
-            assert(dev->table[sec][block].spaceUsed <= 256);
-        }
+        //The block is mapped up to the end of the write
+        addExtent(ip, *loc - off, off + subLen, dev->id, sec, block);
 
         //Set file position
-        fl->info.loc += subLen;
+        subPos += subLen;
+        *loc += subLen;
     }
 
-    //Cleanup
-    free(subBuf);
-    subBuf = NULL;
+    //Cleanup, once every block written is answered
+    finishWrites(posted);
+    pthread_rwlock_unlock(&ip->lock);
+    free(bufs);
+    bufs = NULL;
 
-    return( len );
+    return( ret );
 }
 
 
@@ -357,87 +827,722 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcseek
-// Description  : Seek to a specific place in the file
+// Description  : Seek to a specific place in the file. Past the end is
+//                allowed, a write there leaves a hole that reads as zeros.
 //
 // Inputs       : fh - the file handle of the file to seek in
 //                off - offset within the file to seek to
 // Outputs      : 0 if successful test, -1 if failure
 
 int lcseek( LcFHandle fh, size_t off ) {
+    if(off > UINT32_MAX) {
+        return -1;
+    }
 
     //Ensure the handle exist, then get the file object
+    pthread_rwlock_rdlock(&fsLock);
     int fIndex = checkHandle(fh);
     if(fIndex == -1) {
+        pthread_rwlock_unlock(&fsLock);
         return -1;
     }
 
     //Set file
-    FILE_OBJ *fl = &files[fIndex];
+    FILE_OBJ *fl = files[fIndex];
+    pthread_mutex_lock(&fl->lock);
 
-    //Fail if offset is bigger than length
-    if(off > fl->info.length) {
-        return -1;
+    //Jumping anywhere but where the stream left off ends it
+    if(off != fl->raExpect) {
+        cancelReadAhead(fl);
     }
 
     //Update position
     fl->info.loc = off;
+    pthread_mutex_unlock(&fl->lock);
+    pthread_rwlock_unlock(&fsLock);
 
     return( off );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcclose
-// Description  : Close the file
+// Function     : lcfallocate
+// Description  : Sets aside blocks for a range of a file, so writes to it
+//                later allocate nothing and the range is laid out in as few
+//                runs as the free maps allow. Each hole in the range takes
+//                one allocation call per run found. The blocks read as zeros
+//                until written. The file grows to the end of the range if
+//                it is shorter.
 //
-// Inputs       : fh - the file handle of the file to close
-// Outputs      : 0 if successful test, -1 if failure
-
-int lcclose( LcFHandle fh ) {   //Optimize honors if need be
-    FILE_OBJ *temp = files;
+// Inputs       : fh - the file handle, off - where the range starts,
+//                len - its length
+// Outputs      : 0 if successful, -1 if failure (blocks set aside before
+//                the devices filled up stay with the file)
+int lcfallocate( LcFHandle fh, size_t off, size_t len ) {
+    FILE_OBJ *fl;
+    INODE *ip;
+    DEVICE_OBJ *dev;
+    uint8_t sec;
+    uint16_t block;
+    uint64_t end = (uint64_t)off + len;
+    uint32_t fb;
+    uint32_t n;
+    int e;
+    int ret = 0;
+
+    if(end > UINT32_MAX) {
+        return -1;
+    }
 
-    //Get position in file array, fail if file handle is invalid
+    pthread_rwlock_rdlock(&fsLock);
     int fIndex = checkHandle(fh);
-    if(fIndex==-1) {
+    if(fIndex == -1) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    fl = files[fIndex];
+    ip = inodes[fl->ino];
+    pthread_rwlock_wrlock(&ip->lock);
+    ip->writes++;
+
+    //Skip the blocks the file has, fill each hole with as few runs as possible
+    for(fb=off/LC_DEVICE_BLOCK_SIZE;(uint64_t)fb * LC_DEVICE_BLOCK_SIZE < end;fb+=n) {
+        e = findExtent(ip, fb * LC_DEVICE_BLOCK_SIZE);
+        if(e != -1) {
+            n = (ip->pos[e].startByte + ip->pos[e].length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE - fb;
+            continue;
+        }
+        n = allocFor(fl, ip, fb, holeBlocks(ip, fb * LC_DEVICE_BLOCK_SIZE, end), &dev, &sec, &block);
+        if(n == 0) {
+            logMessage(LOG_ERROR_LEVEL,"No free blocks left on the devices");
+            ret = -1;
+            break;
+        }
+        addExtent(ip, fb * LC_DEVICE_BLOCK_SIZE, CMPSC311_MINVAL((uint64_t)n * LC_DEVICE_BLOCK_SIZE, end - fb * LC_DEVICE_BLOCK_SIZE),
+            dev->id, sec, block);
+    }
+    if(ret == 0 && end > ip->length) {
+        ip->length = end;
+    }
+    pthread_rwlock_unlock(&ip->lock);
+    pthread_rwlock_unlock(&fsLock);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lctruncate
+// Description  : Sets a file's length. Growing leaves a hole at the end.
+//                Shrinking cuts the memory entries, writes the metadata and
+//                only then frees the blocks past the new end, so the
+//                metadata on the devices never names a block another file
+//                may get. Nothing else runs meanwhile. The bytes cut off
+//                in the new last block are left on the device, its
+//                spaceUsed makes them read as zeros.
+//
+// Inputs       : fh - the file handle, len - the new length
+// Outputs      : 0 if successful, -1 if failure (the file is unchanged)
+int lctruncate( LcFHandle fh, size_t len ) {
+    INODE *ip;
+    DEVICE_OBJ *dev;
+    MEMORY_ENTRY cut;                    //The blocks cut off the entry the new end is in
+    MEMORY_ENTRY *m = NULL;
+    uint32_t keep;                       //Bytes in the blocks kept
+    uint32_t oldLength, oldEntries, oldMapped = 0;
+    uint32_t first;                      //First entry dropped whole
+    uint16_t b;
+    int e;
+
+    if(len > UINT32_MAX) {
         return -1;
     }
 
-    free(temp[i].pos);
+    pthread_rwlock_wrlock(&fsLock);
+    int fIndex = checkHandle(fh);
+    if(fIndex == -1) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    ip = inodes[files[fIndex]->ino];
+    ip->writes++;
+    if(len >= ip->length) {
+        ip->length = len;
+        pthread_rwlock_unlock(&fsLock);
+        return 0;
+    }
 
+    //Entries starting at or past the kept blocks go, the one before may lose its tail
+    keep = (uint32_t)(((uint64_t)len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE * LC_DEVICE_BLOCK_SIZE);
+    first = (keep == 0) ? 0 : prevExtent(ip, keep - 1) + 1;
+    cut.length = 0;
+    if(first > 0) {
+        m = &ip->pos[first - 1];
+        oldMapped = m->length;
+        if(m->startByte + m->length > len) {
+            m->length = len - m->startByte;
+        }
+        if(m->startByte + oldMapped > keep) {
+            cut = *m;
+            cut.startByte = keep;
+            cut.length = m->startByte + oldMapped - keep;
+            cut.block = m->block + (keep - m->startByte) / LC_DEVICE_BLOCK_SIZE;
+        }
+    }
+    oldLength = ip->length;
+    oldEntries = ip->entries;
+    ip->entries = first;
+    ip->length = len;
+    if(syncFs() == -1) {
+        ip->entries = oldEntries;
+        ip->length = oldLength;
+        if(m != NULL) {
+            m->length = oldMapped;
+        }
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
 
-    //Copy each file after the one to close to position before
-    for(i=fIndex+1;i<numHandles;i++) {
-        temp[i-1] = temp[i];
+    //The dropped entries are still in the array past the new count
+    freeExtents(&ip->pos[first], oldEntries - first);
+    if(cut.length > 0) {
+        freeExtents(&cut, 1);
+    }
+    e = (len % LC_DEVICE_BLOCK_SIZE) ? findExtent(ip, len - 1) : -1;
+    if(e != -1) {
+        m = &ip->pos[e];
+        dev = &devices[checkId(m->device)];
+        b = m->block + (len - 1 - m->startByte) / LC_DEVICE_BLOCK_SIZE;
+        dev->table[m->sec][b].spaceUsed = CMPSC311_MINVAL(dev->table[m->sec][b].spaceUsed, len % LC_DEVICE_BLOCK_SIZE);
     }
+    pthread_rwlock_unlock(&fsLock);
 
-    numHandles--;
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcshutdown
-// Description  : Shut down the filesystem
+// Function     : lcflush
+// Description  : Write the file's dirty cached blocks to the devices, then
+//                the filesystem metadata, so the file is all on the devices
 //
-// Inputs       : none
+// Inputs       : fh - the file handle of the file to flush
 // Outputs      : 0 if successful test, -1 if failure
 
-int lcshutdown( void ) {
+int lcflush( LcFHandle fh ) {
+    INODE *ip;
+    int ret;
 
-    //Send shutdown 
-    LCloudRegisterFrame frame = create_lcloud_registers(0,0,LC_POWER_OFF,0,0,0,0);
-    if(extract_lcloud_registers(client_lcloud_bus_request(frame, NULL), &b0,&b1,&c0,&c1,&c2,&d0,&d1)==-1 || b1 != 1) {
+    pthread_rwlock_rdlock(&fsLock);
+    int fIndex = checkHandle(fh);
+    if(fIndex==-1) {
+        pthread_rwlock_unlock(&fsLock);
         return -1;
     }
-
-    //Close all files
-    for(i=0;i<numHandles;i++) {
-        lcclose(files[i].info.handle);
+    ip = inodes[files[fIndex]->ino];
+    pthread_rwlock_rdlock(&ip->lock);
+    ret = flushData(ip);
+    pthread_rwlock_unlock(&ip->lock);
+    pthread_rwlock_unlock(&fsLock);
+    if(ret == -1) {
+        return -1;
     }
 
-    lcloud_closecache();
-
-    return( 0 );
+    //The metadata covers every file, none can change while it is written
+    pthread_rwlock_wrlock(&fsLock);
+    ret = syncFs();
+    pthread_rwlock_unlock(&fsLock);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushData
+// Description  : Write a file's dirty cached blocks to the devices. Only
+//                the blocks its writes left in the cache are looked at, the
+//                ones that fail stay on the list for the next flush.
+//
+// Inputs       : ip - the file's inode
+// Outputs      : 0 if successful, -1 if failure
+
+int flushData( INODE *ip ) {
+    DEVICE_OBJ *dev;
+    uint32_t addr;
+    uint32_t kept = 0;
+    int ret = 0;
+
+    if(!writeBack) {
+        return 0;
+    }
+
+    //With write back every device shares the first bus lock, which also
+    //guards the list against another flush under the shared inode lock
+    pthread_mutex_lock(&busLock[0]);
+    for(uint32_t k=0;k<ip->numHeld;k++) {
+        addr = ip->held[k];
+        dev = &devices[checkId(addr >> 24)];
+        if(lcloud_flushblock(dev->id, (addr & 0xFFFFFF) / dev->numBlocks, (addr & 0xFFFFFF) % dev->numBlocks) == -1) {
+            ip->held[kept++] = addr;
+            ret = -1;
+        }
+    }
+    ip->numHeld = kept;
+    pthread_mutex_unlock(&busLock[0]);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : holdBlock
+// Description  : Adds a block to the file's list of blocks written to the
+//                cache only. A block written again is only added again if
+//                something else was written in between, repeats are dropped
+//                when the list fills. Called with the inode locked exclusive
+//                and the first bus lock held.
+//
+// Inputs       : ip - the file's inode, addr - the block (as metaAddress)
+// Outputs      : 0 if successful, -1 if failure
+int holdBlock( INODE *ip, uint32_t addr ) {
+    uint32_t *grown;
+    uint32_t n = 0;
+
+    if(ip->numHeld > 0 && ip->held[ip->numHeld - 1] == addr) {
+        return 0;
+    }
+    if(ip->numHeld == ip->heldCap && ip->numHeld > 0) {
+        qsort(ip->held, ip->numHeld, sizeof(uint32_t), compareAddress);
+        for(uint32_t k=0;k<ip->numHeld;k++) {
+            if(n == 0 || ip->held[n - 1] != ip->held[k]) {
+                ip->held[n++] = ip->held[k];
+            }
+        }
+        ip->numHeld = n;
+    }
+
+    //Grow while more than half full, so the repeats are not sorted out every time
+    if(ip->numHeld * 2 >= ip->heldCap) {
+        grown = (uint32_t *)realloc(ip->held, sizeof(uint32_t) * (ip->heldCap ? ip->heldCap * 2 : 16));
+        if(grown == NULL) {
+            return -1;
+        }
+        ip->held = grown;
+        ip->heldCap = ip->heldCap ? ip->heldCap * 2 : 16;
+    }
+    ip->held[ip->numHeld++] = addr;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compareAddress
+// Description  : Orders block addresses for qsort
+//
+// Inputs       : a, b - the addresses
+// Outputs      : <0, 0 or >0 as a is before, the same as or after b
+int compareAddress( const void *a, const void *b ) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcclose
+// Description  : Close the file
+//
+// Inputs       : fh - the file handle of the file to close
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcclose( LcFHandle fh ) {   //Optimize honors if need be
+    INODE *ip;
+    int ret;
+
+    //Get position in file array, fail if file handle is invalid
+    pthread_rwlock_rdlock(&fsLock);
+    int fIndex = checkHandle(fh);
+    if(fIndex==-1) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    ip = inodes[files[fIndex]->ino];
+
+    //Push any blocks held back by write back to the devices, the metadata waits
+    //for lcflush or lcshutdown
+    pthread_rwlock_rdlock(&ip->lock);
+    ret = flushData(ip);
+    pthread_rwlock_unlock(&ip->lock);
+    pthread_rwlock_unlock(&fsLock);
+    if(ret == -1) {
+        return -1;
+    }
+
+    //Free the slot, unless another thread closed the handle meanwhile
+    pthread_rwlock_wrlock(&fsLock);
+    if(checkHandle(fh) != fIndex) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    releaseSlot(fIndex);
+    pthread_rwlock_unlock(&fsLock);
+
+    //Nothing is pinned between calls, so let the cache size itself to the workload.
+    //Only dirty blocks go on the bus, and with write back every device shares the first bus lock.
+    pthread_mutex_lock(&busLock[0]);
+    lcloud_tunecache();
+    pthread_mutex_unlock(&busLock[0]);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcshutdown
+// Description  : Shut down the filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcshutdown( void ) {
+    uint8_t rb0, rb1, rc0, rc1, rc2;
+    uint16_t rd0, rd1;
+
+    //A completion callback would wait on its own thread in stopAsync
+    if(onAsyncThread()) {
+        logMessage(LOG_ERROR_LEVEL,"lcshutdown called from an asynchronous request's callback");
+        return -1;
+    }
+
+    //Requests already started finish first
+    stopAsync();
+
+    //Close all files, then make sure nothing is left dirty before power off
+    pthread_rwlock_wrlock(&fsLock);
+    for(int slot=0;slot<fileSlots && numHandles>0;slot++) {
+        if(files[slot]->open) {
+            releaseSlot(slot);
+        }
+    }
+    if(readAhead) {
+        pthread_mutex_lock(&raLock);
+        raStop = 1;
+        pthread_cond_signal(&raCond);
+        pthread_mutex_unlock(&raLock);
+        pthread_join(raThread, NULL);
+    }
+    //Powering off now would lose the blocks that did not make it, so the
+    //devices stay up and the call can be retried
+    if(lcloud_flushcache() == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not write back the cache, not powering off");
+        if(readAhead) {
+            raStop = 0;
+            if(pthread_create(&raThread, NULL, readAheadWorker, NULL) != 0) {
+                readAhead = 0;
+            }
+        }
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    if(syncFs() == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not write the filesystem metadata");
+    }
+
+    //Send shutdown 
+    LCloudRegisterFrame frame = create_lcloud_registers(0,0,LC_POWER_OFF,0,0,0,0);
+    if(extract_lcloud_registers(client_lcloud_bus_request(frame, NULL), &rb0,&rb1,&rc0,&rc1,&rc2,&rd0,&rd1)==-1 || rb1 != 1) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+
+    //Everything is on the devices, the next lcopen powers on and mounts again
+    lcloud_closecache();
+    unmountFs();
+    on = 0;
+    pthread_rwlock_unlock(&fsLock);
+
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcread_async
+// Description  : Starts reading the file at an offset, the handle's position
+//                is left alone. The read runs on a filesystem thread, with
+//                others started before it finishes. Its result is passed
+//                to done, or if done is NULL it is kept for lcpoll or
+//                lcwait. buf must be left alone until then.
+//
+// Inputs       : fh - file handle for the file to read from
+//                off - where in the file to start
+//                buf - place to put the data
+//                len - the length of the read
+//                done - called with the result (NULL to poll for it)
+//                arg - passed to done
+// Outputs      : the request ID, -1 if failure
+LcRequestId lcread_async( LcFHandle fh, size_t off, char *buf, size_t len, LcCompletion done, void *arg ) {
+    return submitAsync(fh, off, buf, len, 0, done, arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcwrite_async
+// Description  : Starts writing the file at an offset, as lcread_async. An
+//                offset past the file's length when the write runs leaves
+//                a hole. Requests run in no set order, so two that overlap
+//                should not both be outstanding.
+//
+// Inputs       : fh - file handle for the file to write to
+//                off - where in the file to start
+//                buf - pointer to data to write
+//                len - the length of the write
+//                done - called with the result (NULL to poll for it)
+//                arg - passed to done
+// Outputs      : the request ID, -1 if failure
+LcRequestId lcwrite_async( LcFHandle fh, size_t off, char *buf, size_t len, LcCompletion done, void *arg ) {
+    return submitAsync(fh, off, buf, len, 1, done, arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcpoll
+// Description  : Checks on an asynchronous request started without a
+//                callback. Once it is done its ID is freed.
+//
+// Inputs       : req - the request ID
+//                result - set to the bytes read or written (-1 if the
+//                         request failed) once done, may be NULL
+// Outputs      : 1 if done, 0 if not yet, -1 if the ID is not a request
+int lcpoll( LcRequestId req, int *result ) {
+    int slot;
+
+    pthread_mutex_lock(&asyncLock);
+    slot = checkRequest(req);
+    if(slot == -1 || asyncReqs[slot].done != NULL) {
+        pthread_mutex_unlock(&asyncLock);
+        return -1;
+    }
+    if(asyncReqs[slot].state != LC_ASYNC_DONE) {
+        pthread_mutex_unlock(&asyncLock);
+        return 0;
+    }
+    if(result != NULL) {
+        *result = asyncReqs[slot].result;
+    }
+    releaseRequest(slot);
+    pthread_mutex_unlock(&asyncLock);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcwait
+// Description  : Waits for an asynchronous request started without a
+//                callback, then frees its ID
+//
+// Inputs       : req - the request ID
+// Outputs      : bytes read or written, -1 if failure or not a request
+int lcwait( LcRequestId req ) {
+    int slot;
+    int result;
+
+    pthread_mutex_lock(&asyncLock);
+    slot = checkRequest(req);
+    if(slot == -1 || asyncReqs[slot].done != NULL) {
+        pthread_mutex_unlock(&asyncLock);
+        return -1;
+    }
+    //The table may grow while waiting, and another waiter may take the result
+    while(checkRequest(req) == slot && asyncReqs[slot].state != LC_ASYNC_DONE) {
+        pthread_cond_wait(&asyncDone, &asyncLock);
+    }
+    if(checkRequest(req) != slot) {
+        pthread_mutex_unlock(&asyncLock);
+        return -1;
+    }
+    result = asyncReqs[slot].result;
+    releaseRequest(slot);
+    pthread_mutex_unlock(&asyncLock);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcdefrag
+// Description  : Moves a file's blocks into as few runs as fit on one
+//                device. The blocks are copied a batch at a time, letting
+//                the other calls in between batches (and no faster than
+//                LC_DEFRAG_RATE blocks a second, if set). Then the new
+//                memory entries replace the old ones and the metadata is
+//                written, all while no other call runs, and only then are
+//                the old blocks freed. A write to the file during the copy
+//                makes the defrag give up. Striped files, and files with
+//                holes or blocks set aside past the end, are left alone.
+//
+// Inputs       : fh - the file handle of the file to defragment
+// Outputs      : 0 if successful (or there was nothing to gain), -1 if failure
+int lcdefrag( LcFHandle fh ) {
+    INODE *ip;
+    DEVICE_OBJ *dev;
+    FREE_RUN *runs;
+    MEMORY_ENTRY *newPos;
+    MEMORY_ENTRY *oldPos;
+    uint32_t oldEntries;
+    uint32_t gen, writes, length, nb;
+    uint32_t total = 0;
+    uint32_t mapped = 0;
+    uint32_t fb;
+    int numRuns;
+    int bestRuns;
+    int bestDev = -1;
+    int failed = 0;
+    int k, n;
+    double wait;
+    struct timespec start, now, pause;
+
+    pthread_rwlock_rdlock(&fsLock);
+    int fIndex = checkHandle(fh);
+    if(fIndex == -1) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    ip = inodes[files[fIndex]->ino];
+    gen = mountGen;
+    pthread_rwlock_rdlock(&ip->lock);
+    writes = ip->writes;
+    length = ip->length;
+    bestRuns = ip->entries;
+    for(uint32_t e=0;e<ip->entries;e++) {
+        mapped += (ip->pos[e].length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    }
+    pthread_rwlock_unlock(&ip->lock);
+    nb = (length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    if(stripeUnit || bestRuns <= 1 || mapped != nb) {
+        pthread_rwlock_unlock(&fsLock);
+        return 0;
+    }
+
+    //Pick the device that holds the file in the fewest runs
+    for(int d=0;d<numDevices;d++) {
+        total = CMPSC311_MAXVAL(total, (uint32_t)devices[d].numSectors * devices[d].numBlocks);
+    }
+    runs = (FREE_RUN *)malloc(sizeof(FREE_RUN) * total);
+    if(runs == NULL) {
+        pthread_rwlock_unlock(&fsLock);
+        return -1;
+    }
+    for(int d=0;d<numDevices;d++) {
+        pthread_mutex_lock(&devices[d].lock);
+        n = planRuns(&devices[d], nb, runs);
+        pthread_mutex_unlock(&devices[d].lock);
+        if(n != -1 && n < bestRuns) {
+            bestRuns = n;
+            bestDev = d;
+        }
+    }
+
+    //Take the runs, unless writers to other files took too many meanwhile
+    numRuns = -1;
+    newPos = (MEMORY_ENTRY *)malloc(sizeof(MEMORY_ENTRY) * bestRuns);
+    if(bestDev != -1 && newPos != NULL) {
+        dev = &devices[bestDev];
+        pthread_mutex_lock(&dev->lock);
+        numRuns = planRuns(dev, nb, runs);
+        if(numRuns != -1 && numRuns <= bestRuns) {
+            for(k=0;k<numRuns;k++) {
+                takeRun(dev, runs[k].first, runs[k].length);
+            }
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+    if(numRuns == -1 || numRuns > bestRuns) {
+        n = (newPos == NULL) ? -1 : 0;
+        free(runs);
+        free(newPos);
+        pthread_rwlock_unlock(&fsLock);
+        return n;
+    }
+
+    //The new memory entries, the file's blocks in order
+    fb = 0;
+    for(k=0;k<numRuns;k++) {
+        newPos[k].startByte = fb * LC_DEVICE_BLOCK_SIZE;
+        newPos[k].length = CMPSC311_MINVAL(runs[k].length * LC_DEVICE_BLOCK_SIZE, length - newPos[k].startByte);
+        newPos[k].sec = runs[k].first / dev->numBlocks;
+        newPos[k].block = runs[k].first % dev->numBlocks;
+        newPos[k].device = dev->id;
+        fb += runs[k].length;
+    }
+    free(runs);
+
+    //Copy a batch at a time, letting the other calls in between batches
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_rdlock(&ip->lock);
+    for(fb=0,k=0;fb<nb && !failed && ip->writes==writes;fb++) {
+        if(fb > 0 && fb % LC_DEFRAG_BATCH == 0) {
+            pthread_rwlock_unlock(&ip->lock);
+            pthread_rwlock_unlock(&fsLock);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wait = defragRate ? (double)fb / defragRate - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9) : 0;
+            if(wait > 0) {
+                pause.tv_sec = (time_t)wait;
+                pause.tv_nsec = (long)((wait - pause.tv_sec) * 1e9);
+                nanosleep(&pause, NULL);
+            }
+            else {
+                sched_yield();
+            }
+            pthread_rwlock_rdlock(&fsLock);
+            if(!on || mountGen != gen) {
+                pthread_rwlock_unlock(&fsLock);
+                free(newPos);
+                return -1;
+            }
+            pthread_rwlock_rdlock(&ip->lock);
+            if(ip->writes != writes) {
+                break;
+            }
+        }
+        if(fb * LC_DEVICE_BLOCK_SIZE >= newPos[k].startByte + newPos[k].length) {
+            k++;
+        }
+        n = findExtent(ip, fb * LC_DEVICE_BLOCK_SIZE);
+        failed = copyBlock(&ip->pos[n], ip->pos[n].block + (fb * LC_DEVICE_BLOCK_SIZE - ip->pos[n].startByte) / LC_DEVICE_BLOCK_SIZE,
+            dev, (uint32_t)newPos[k].sec * dev->numBlocks + newPos[k].block + (fb * LC_DEVICE_BLOCK_SIZE - newPos[k].startByte) / LC_DEVICE_BLOCK_SIZE);
+    }
+    pthread_rwlock_unlock(&ip->lock);
+    pthread_rwlock_unlock(&fsLock);
+
+    //Swap the memory entries in and write the metadata with nothing else running
+    pthread_rwlock_wrlock(&fsLock);
+    if(!on || mountGen != gen) {
+        pthread_rwlock_unlock(&fsLock);
+        free(newPos);
+        return -1;
+    }
+    if(failed || ip->writes != writes) {
+        freeExtents(newPos, numRuns);
+        pthread_rwlock_unlock(&fsLock);
+        free(newPos);
+        return -1;
+    }
+    oldPos = ip->pos;
+    oldEntries = ip->entries;
+    ip->pos = newPos;
+    ip->entries = ip->capacity = numRuns;
+    if(syncFs() == -1) {
+        ip->pos = oldPos;
+        ip->entries = ip->capacity = oldEntries;
+        freeExtents(newPos, numRuns);
+        pthread_rwlock_unlock(&fsLock);
+        free(newPos);
+        return -1;
+    }
+    freeExtents(oldPos, oldEntries);
+    free(oldPos);
+    logMessage(LcDriverLLevel,"Defragmented [%s] from %u memory entries to %d",ip->path,oldEntries,numRuns);
+    pthread_rwlock_unlock(&fsLock);
+
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -475,18 +1580,81 @@ int extract_lcloud_registers(LCloudRegisterFrame resp, uint8_t *b0, uint8_t *b1,
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : checkHandle
-// Description  : findes which file the handle represents
+// Description  : findes which file the handle represents, its slot is in
+//                the low bits and a closed file's handle has an old generation
 //
 // Inputs       : h - the handle to check
 // Outputs      : the index, in the files array, of the file, -1 if invalid handle
 int checkHandle(LcFHandle h) {
-    for(i=0;i<numHandles;i++) {
-        if(h == files[i].info.handle) {
-            return i;
-        }
+    int slot = h & LC_HANDLE_SLOT_MASK;
+
+    if(h < 0 || slot >= fileSlots || !files[slot]->open || files[slot]->info.handle != h) {
+        return -1;
     }
+    return slot;
+}
 
-    return -1;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : growFiles
+// Description  : Doubles the file table, the new slots go on the free list
+//                lowest first. The table holds pointers, so a file object
+//                (and its lock) never moves once allocated.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int growFiles() {
+    uint32_t slots = fileSlots ? fileSlots * 2 : 64;
+    FILE_OBJ **grown;
+    FILE_OBJ *added;
+
+    slots = CMPSC311_MINVAL(slots, (uint32_t)LC_HANDLE_SLOT_MASK + 1);
+    if(slots == fileSlots) {
+        logMessage(LOG_ERROR_LEVEL,"Too many open files");
+        return -1;
+    }
+    //Both allocations first, so a failure leaves the table as it was
+    added = (FILE_OBJ *)calloc(slots - fileSlots, sizeof(FILE_OBJ));
+    if(added == NULL) {
+        return -1;
+    }
+    grown = (FILE_OBJ **)realloc(files, sizeof(FILE_OBJ *) * slots);
+    if(grown == NULL) {
+        free(added);
+        return -1;
+    }
+    files = grown;
+
+    for(uint32_t slot=slots;slot>fileSlots;slot--) {
+        files[slot-1] = &added[slot-1-fileSlots];
+        pthread_mutex_init(&files[slot-1]->lock, NULL);
+        files[slot-1]->gen = 0;
+        files[slot-1]->open = 0;
+        files[slot-1]->nextFree = freeSlot;
+        freeSlot = slot - 1;
+    }
+    fileSlots = slots;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseSlot
+// Description  : Frees a closed file's slot. A new generation keeps the old
+//                handle from matching the slot's next file. Called holding
+//                fsLock exclusive.
+//
+// Inputs       : slot - the slot in the file table
+// Outputs      : none
+void releaseSlot(int slot) {
+    FILE_OBJ *fl = files[slot];
+
+    cancelReadAhead(fl);
+    fl->open = 0;
+    fl->gen = (fl->gen + 1) & LC_HANDLE_GEN_MASK;
+    fl->nextFree = freeSlot;
+    freeSlot = slot;
+    numHandles--;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -497,15 +1665,63 @@ int checkHandle(LcFHandle h) {
 // Inputs       : d - the ID to check
 // Outputs      : the index, in the files array, of the device, -1 if invalid ID
 int checkId(LcDeviceId d) {
-    for(i=0;i<numDevices;i++) {
-        if(d == devices[i].id) {
-            return i;
+    for(int k=0;k<numDevices;k++) {
+        if(d == devices[k].id) {
+            return k;
         }
     }
 
     return -1;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : busFor
+// Description  : Finds the bus lock of the connection a device's requests go
+//                on, so devices on different connections transfer at the
+//                same time. With write back, putting any block in the cache
+//                may write another device's block back, so every device
+//                shares the first lock.
+//
+// Inputs       : did - the device
+// Outputs      : the lock
+pthread_mutex_t *busFor(LcDeviceId did) {
+    return &busLock[writeBack ? 0 : client_lcloud_bus_channel(did)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lockBuses
+// Description  : Takes the bus locks of two devices, lowest first, once if
+//                they share one
+//
+// Inputs       : a, b - the devices
+// Outputs      : none
+void lockBuses(LcDeviceId a, LcDeviceId b) {
+    pthread_mutex_t *la = busFor(a), *lb = busFor(b);
+
+    pthread_mutex_lock(CMPSC311_MINVAL(la, lb));
+    if(la != lb) {
+        pthread_mutex_lock(CMPSC311_MAXVAL(la, lb));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlockBuses
+// Description  : Releases the bus locks taken by lockBuses
+//
+// Inputs       : a, b - the devices
+// Outputs      : none
+void unlockBuses(LcDeviceId a, LcDeviceId b) {
+    pthread_mutex_t *la = busFor(a), *lb = busFor(b);
+
+    if(la != lb) {
+        pthread_mutex_unlock(lb);
+    }
+    pthread_mutex_unlock(la);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : powerOn
@@ -516,53 +1732,111 @@ int checkId(LcDeviceId d) {
 int powerOn() {
     LCloudRegisterFrame frame;
     uint16_t idFinder;
-    DEVICE_OBJ dev;
     DEVICE_OBJ *devObj;
-    i = 0;
+    uint8_t rb0, rb1, rc0, rc1, rc2;
+    uint16_t rd0, rd1;
+    int id = 0;
+    int shardCount;
+    int mounted;
 
     //Power on command
     client_lcloud_bus_request(create_lcloud_registers(0,0,LC_POWER_ON,0,0,0,0),NULL);
 
     //Device probe
-    extract_lcloud_registers(client_lcloud_bus_request(create_lcloud_registers(0,0,LC_DEVPROBE,0,0,0,0),NULL),&b0,&b1,&c0,&c1,&c2,&d0,&d1);
-    if (d0 == -1) {
+    extract_lcloud_registers(client_lcloud_bus_request(create_lcloud_registers(0,0,LC_DEVPROBE,0,0,0,0),NULL),&rb0,&rb1,&rc0,&rc1,&rc2,&rd0,&rd1);
+    if (rd0 == -1) {
         return -1;
     }
-    idFinder = d0;
+    idFinder = rd0;
 
     while(idFinder != 0 ) {
         if ((idFinder & 0x0001) == 1) {
-            dev.id = i;
-            devices[numDevices] = dev;
+            devices[numDevices].id = id;
             numDevices++;
         }
         idFinder = idFinder >> 1;
-        i++;
+        id++;
     }
 
-    for(i=0;i<numDevices;i++) {
-        devObj = &devices[i];
+    for(int k=0;k<numDevices;k++) {
+        devObj = &devices[k];
         frame = create_lcloud_registers(0,0,LC_DEVINIT,(uint8_t)(devObj->id),0,0,0);
-        extract_lcloud_registers(client_lcloud_bus_request(frame,NULL),&b0,&b1,&c0,&c1,&c2,&d0,&d1);
-        devObj->numSectors = d0;
-        devObj->numBlocks = d1;
-        devObj->table = (BLOCK**)malloc(sizeof(BLOCK*)*d0);
-        for(int j=0;j<d0;j++) {
-            devObj->table[j] = (BLOCK *)calloc(d1,sizeof(BLOCK));
-        }
-        for(int j=0;j<d0;j++) {
-            for(int k=0;k<d1;k++) {
-                devObj->table[j][k].handle = -1;
-            }
+        extract_lcloud_registers(client_lcloud_bus_request(frame,NULL),&rb0,&rb1,&rc0,&rc1,&rc2,&rd0,&rd1);
+        devObj->numSectors = rd0;
+        devObj->numBlocks = rd1;
+        devObj->table = (BLOCK**)malloc(sizeof(BLOCK*)*rd0);
+        for(int j=0;j<rd0;j++) {
+            devObj->table[j] = (BLOCK *)calloc(rd1,sizeof(BLOCK));
         }
 
+        //Filled in by the mount
+        devObj->numFree = 0;
+        devObj->freeHint = 0;
+        devObj->freeMap = (uint64_t *)calloc(((uint32_t)rd0 * rd1 + 63) / 64, sizeof(uint64_t));
+        pthread_mutex_init(&devObj->lock, NULL);
     } 
 
-    //Initialize Cache
-    lcloud_initcache(LC_CACHE_MAXBLOCKS);
+    //Initialize Cache, writes are held in it if write back is asked for. It
+    //is always locked, callers and read ahead may use it from several threads.
+    if(getenv("LC_READ_AHEAD") != NULL) {
+        readAhead = CMPSC311_MINVAL(CMPSC311_MAXVAL(atoi(getenv("LC_READ_AHEAD")), 0), LC_READAHEAD_QUEUE);
+    }
+    //One shard per CPU unless LC_CACHE_SHARDS says otherwise, so threads
+    //hitting different blocks rarely wait on the same shard lock. The cache
+    //makes fewer if the shards would be under LC_CACHE_SHARDLINES.
+    shardCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(getenv("LC_CACHE_SHARDS") != NULL) {
+        shardCount = atoi(getenv("LC_CACHE_SHARDS"));
+    }
+    shardCount = CMPSC311_MINVAL(CMPSC311_MAXVAL(shardCount, 1), LC_CACHE_MAXSHARDS);
+    if(lcloud_initcache_sharded(LC_CACHE_MAXBLOCKS, shardCount) == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not set up the block cache");
+        unmountFs();
+        return -1;
+    }
+    if(getenv("LC_STRIPE_UNIT") != NULL) {
+        stripeUnit = CMPSC311_MAXVAL(atoi(getenv("LC_STRIPE_UNIT")), 0);
+    }
+    if(getenv("LC_DEFRAG_RATE") != NULL) {
+        defragRate = CMPSC311_MAXVAL(atoi(getenv("LC_DEFRAG_RATE")), 0);
+    }
+    if(getenv("LC_WRITE_BACK") != NULL && atoi(getenv("LC_WRITE_BACK")) != 0) {
+        lcloud_setwriteback(writeBlock);
+        writeBack = 1;
+    }
+    //With write back, putting a block in the cache may write another back,
+    //so only without it can a wait go on while others use the connection
+    sharedBus = client_lcloud_bus_shared() && !writeBack;
+    mounted = mountFs();
+    if(mounted == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not mount the filesystem");
+        lcloud_closecache();
+        unmountFs();
+        return -1;
+    }
 
-    //House keeping
+    //A snapshot is only good for the generation it was saved at. The new
+    //one is written before any block is, so a run that dies without saving
+    //a snapshot still makes the older ones stale.
+    if(mounted == 0) {
+        lcloud_loadsnapshot(fsGeneration);
+    }
+    fsGeneration++;
     on = 1;
+    if(syncFs() == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not write the filesystem generation");
+        on = 0;
+        lcloud_closecache();
+        unmountFs();
+        return -1;
+    }
+    lcloud_snapshottag(fsGeneration);
+    raStop = 0;
+    raHead = raCount = 0;
+    if(readAhead && pthread_create(&raThread, NULL, readAheadWorker, NULL) != 0) {
+        logMessage(LOG_ERROR_LEVEL,"Could not start read ahead, reading on demand only");
+        readAhead = 0;
+    }
 
     return 0;
 }
@@ -575,46 +1849,1630 @@ int powerOn() {
 // Inputs       : mask - Mask from device probe
 // Outputs      : The device ID, -1 if failure
 int convertId(uint16_t mask) {
-    i = 0;
+    int id = 0;
     while (mask != 0) {
         if((mask & 0x1) == 1) {
-            return i;
+            return id;
         }
         mask = mask >> 1;
-        i++;
+        id++;
     }
     return -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : availableSpace
-// Description  : Finds the proper block to write to
+// Function     : allocBlocks
+// Description  : Allocates up to want consecutive free blocks in one
+//                sector. The block right after the file's last memory entry
+//                is tried first, so the file stays in one run, then the
+//                first free block of the target device, then of the first
+//                device with any left. Each device's free bitmap and count
+//                make that a few word reads instead of a scan of the device.
+//                Only the device looked at is locked, so writers allocating
+//                on different devices do not wait for each other.
+//
+// Inputs       : want - blocks wanted, after - the file's last memory entry
+//                (NULL if none), target - index of the device the blocks
+//                should go on (-1 for any), *dev, *sec, *block - set to the
+//                first block
+// Outputs      : number of blocks allocated, 0 if the devices are full
+int allocBlocks(int want, const MEMORY_ENTRY *after, int target, DEVICE_OBJ **dev, uint8_t *sec, uint16_t *block) {
+    DEVICE_OBJ *d;
+    uint32_t next;
+    uint32_t w;
+    int n;
+
+    if(after != NULL && (target == -1 || devices[target].id == after->device)) {
+        d = &devices[checkId(after->device)];
+        next = (uint32_t)after->sec * d->numBlocks + after->block + (after->length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+        pthread_mutex_lock(&d->lock);
+        if(next % d->numBlocks != 0 && next < (uint32_t)d->numSectors * d->numBlocks &&
+            (d->freeMap[next / 64] >> (next % 64) & 1)) {
+            *dev = d;
+            *sec = next / d->numBlocks;
+            *block = next % d->numBlocks;
+            n = takeRun(d, next, want);
+            pthread_mutex_unlock(&d->lock);
+            return n;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    //A full target device spills over to the others
+    for(int q=-1;q<numDevices;q++) {
+        if(q == -1 && target == -1) {
+            continue;
+        }
+        d = &devices[q == -1 ? target : q];
+        pthread_mutex_lock(&d->lock);
+        if(d->numFree == 0) {
+            pthread_mutex_unlock(&d->lock);
+            continue;
+        }
+        for(w=d->freeHint;d->freeMap[w]==0;w++);
+        d->freeHint = w;
+        next = w * 64 + __builtin_ctzll(d->freeMap[w]);
+        *dev = d;
+        *sec = next / d->numBlocks;
+        *block = next % d->numBlocks;
+        n = takeRun(d, next, want);
+        pthread_mutex_unlock(&d->lock);
+        return n;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripeDevice
+// Description  : Picks the device a file block goes on when striping. Each
+//                stripe unit of the file goes on the next device round
+//                robin, starting from a device that depends on the file's
+//                inode so small files spread out too. The inode, unlike the
+//                handle, is the same every time the file is opened, so a
+//                file keeps one layout across reopens and power cycles.
 //
-// Inputs       : device - the device ID to check, fh - the file handle to check, *sec - pointer to sector variable
-//                 *block - pointer to block variable
-// Outputs      : 0 if success, -1 if device is full and cant be overwritten
-int availableSpace(LcDeviceId device, LcFHandle fh, uint8_t *sec, uint16_t *block) {
-    int dIndex;
-    DEVICE_OBJ dev;
+// Inputs       : fl - the file, fileBlock - the block of the file
+// Outputs      : index of the device in devices
+int stripeDevice(FILE_OBJ *fl, uint32_t fileBlock) {
+    return (fl->ino + fileBlock / stripeUnit) % numDevices;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : takeRun
+// Description  : Marks a free block and up to want - 1 free blocks after it
+//                in the same sector as used. Called holding the device's
+//                lock (or fsLock exclusive).
+//
+// Inputs       : dev - the device, first - the first block (sector major),
+//                want - the most blocks to take
+// Outputs      : number of blocks taken
+int takeRun(DEVICE_OBJ *dev, uint32_t first, int want) {
+    uint32_t b = first;
+    int n = 0;
+
+    do {
+        dev->freeMap[b / 64] &= ~(1ULL << (b % 64));
+        b++;
+        n++;
+    } while(n < want && b % dev->numBlocks != 0 && (dev->freeMap[b / 64] >> (b % 64) & 1));
+    dev->numFree -= n;
+    return n;
+}
 
-    dIndex = checkId(device);
-    if(dIndex == -1) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeBlock
+// Description  : Writes a block to a device, used by the cache to write back
+//                dirty blocks
+//
+// Inputs       : did - the device, sec - the sector, blk - the block
+//                data - the block to write
+// Outputs      : 0 if success, -1 if failure
+int writeBlock(LcDeviceId did, uint16_t sec, uint16_t blk, char *data) {
+    uint8_t rb0, rb1, rc0, rc1, rc2;
+    uint16_t rd0, rd1;
+
+    LCloudRegisterFrame frame = create_lcloud_registers(0,0,LC_BLOCK_XFER,did,LC_XFER_WRITE,sec,blk);
+    extract_lcloud_registers(client_lcloud_bus_request(frame,data),&rb0,&rb1,&rc0,&rc1,&rc2,&rd0,&rd1);
+    if(rb1 != 1) {
         return -1;
     }
-    dev = devices[dIndex];
+    return 0;
+}
 
-    for(i=0;i<dev.numSectors;i++) {
-        for(int j=0;j<dev.numBlocks;j++) {
-            if(dev.table[i][j].spaceUsed < LC_DEVICE_BLOCK_SIZE && (dev.table[i][j].handle == fh || 
-            dev.table[i][j].handle == -1)) {
-                *sec = i;
-                *block = j;
-                return 0;
-            }
-        }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pathHash
+// Description  : FNV-1a hash of a path, for the path index
+//
+// Inputs       : path - the path
+// Outputs      : the hash
+uint64_t pathHash(const char *path) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for(;*path;path++) {
+        h = (h ^ (uint8_t)*path) * 0x100000001B3ULL;
     }
+    return h;
+}
 
-    return -1;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lookupPath
+// Description  : Finds the inode of a path in the path index
+//
+// Inputs       : path - the path
+// Outputs      : index of the inode, -1 if there is no such file
+int lookupPath(const char *path) {
+    uint32_t slot;
+
+    if(pathSlots == 0) {
+        return -1;
+    }
+    for(slot=pathHash(path)&(pathSlots-1);pathIndex[slot]!=-1;slot=(slot+1)&(pathSlots-1)) {
+        if(strcmp(inodes[pathIndex[slot]]->path, path) == 0) {
+            return pathIndex[slot];
+        }
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : newInode
+// Description  : Creates an empty file and adds it to the path index. The
+//                inode table doubles when full, the index when half full.
+//                Inodes are allocated one by one so their locks never move.
+//
+// Inputs       : path - the path of the file
+// Outputs      : index of the inode, -1 if failure
+int newInode(const char *path) {
+    INODE **grownInodes;
+    INODE *ip;
+    int32_t *grownIndex;
+    uint32_t slots;
+    uint32_t slot;
+
+    if(numInodes == inodeSlots) {
+        grownInodes = (INODE **)realloc(inodes, sizeof(INODE *) * (inodeSlots ? inodeSlots * 2 : 64));
+        if(grownInodes == NULL) {
+            return -1;
+        }
+        inodes = grownInodes;
+        inodeSlots = inodeSlots ? inodeSlots * 2 : 64;
+    }
+    if((numInodes + 1) * 2 > pathSlots) {
+        slots = pathSlots ? pathSlots * 2 : 128;
+        grownIndex = (int32_t *)malloc(sizeof(int32_t) * slots);
+        if(grownIndex == NULL) {
+            return -1;
+        }
+        memset(grownIndex, 0xFF, sizeof(int32_t) * slots);
+        for(uint32_t j=0;j<numInodes;j++) {
+            for(slot=pathHash(inodes[j]->path)&(slots-1);grownIndex[slot]!=-1;slot=(slot+1)&(slots-1));
+            grownIndex[slot] = j;
+        }
+        free(pathIndex);
+        pathIndex = grownIndex;
+        pathSlots = slots;
+    }
+
+    ip = (INODE *)malloc(sizeof(INODE));
+    if(ip == NULL) {
+        return -1;
+    }
+    ip->path = strdup(path);
+    if(ip->path == NULL) {
+        free(ip);
+        return -1;
+    }
+    ip->length = 0;
+    ip->pos = NULL;
+    ip->entries = 0;
+    ip->capacity = 0;
+    ip->writes = 0;
+    ip->held = NULL;
+    ip->numHeld = 0;
+    ip->heldCap = 0;
+    pthread_rwlock_init(&ip->lock, NULL);
+    inodes[numInodes] = ip;
+    for(slot=pathHash(path)&(pathSlots-1);pathIndex[slot]!=-1;slot=(slot+1)&(pathSlots-1));
+    pathIndex[slot] = numInodes;
+
+    return numInodes++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dropInodes
+// Description  : Forgets every file (not the devices' blocks)
+//
+// Inputs       : none
+// Outputs      : none
+void dropInodes() {
+    for(uint32_t j=0;j<numInodes;j++) {
+        free(inodes[j]->path);
+        free(inodes[j]->pos);
+        free(inodes[j]->held);
+        pthread_rwlock_destroy(&inodes[j]->lock);
+        free(inodes[j]);
+    }
+    numInodes = 0;
+    if(pathSlots) {
+        memset(pathIndex, 0xFF, sizeof(int32_t) * pathSlots);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fsGeometry
+// Description  : Hash of the probed devices' IDs and sizes, a filesystem is
+//                only mounted on the devices it was made on
+//
+// Inputs       : none
+// Outputs      : the hash
+uint64_t fsGeometry() {
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for(int d=0;d<numDevices;d++) {
+        h = (h ^ devices[d].id) * 0x100000001B3ULL;
+        h = (h ^ devices[d].numSectors) * 0x100000001B3ULL;
+        h = (h ^ devices[d].numBlocks) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fsChecksum
+// Description  : FNV-1a checksum of the metadata
+//
+// Inputs       : p - the metadata, len - its length
+// Outputs      : the checksum
+uint64_t fsChecksum(const char *p, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for(size_t j=0;j<len;j++) {
+        h = (h ^ (uint8_t)p[j]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : imageSize
+// Description  : Bytes of metadata: the inode count, each device's free
+//                map, each inode (path, length and memory entries), then
+//                the count and addresses of the file blocks set aside but
+//                not written
+//
+// Inputs       : none
+// Outputs      : the size
+size_t imageSize() {
+    size_t size = sizeof(uint32_t) + sizeof(uint32_t) * (1 + unwrittenBlocks(NULL));
+
+    for(int d=0;d<numDevices;d++) {
+        size += ((uint32_t)devices[d].numSectors * devices[d].numBlocks + 63) / 64 * sizeof(uint64_t);
+    }
+    for(uint32_t j=0;j<numInodes;j++) {
+        size += sizeof(uint16_t) + strlen(inodes[j]->path) + 2 * sizeof(uint32_t) + inodes[j]->entries * 12;
+    }
+    return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buildImage
+// Description  : Serializes the metadata, laid out as imageSize describes.
+//                A memory entry is its start, length, block, sector and
+//                device in 12 bytes.
+//
+// Inputs       : img - where to put it, imageSize bytes
+// Outputs      : none
+void buildImage(char *img) {
+    char *p = img;
+    uint16_t plen;
+    uint32_t count;
+    size_t n;
+
+    memcpy(p, &numInodes, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    for(int d=0;d<numDevices;d++) {
+        n = ((uint32_t)devices[d].numSectors * devices[d].numBlocks + 63) / 64 * sizeof(uint64_t);
+        memcpy(p, devices[d].freeMap, n);
+        p += n;
+    }
+    for(uint32_t j=0;j<numInodes;j++) {
+        INODE *ip = inodes[j];
+        plen = strlen(ip->path);
+        memcpy(p, &plen, sizeof(plen));
+        memcpy(p + 2, ip->path, plen);
+        p += 2 + plen;
+        memcpy(p, &ip->length, sizeof(uint32_t));
+        memcpy(p + 4, &ip->entries, sizeof(uint32_t));
+        p += 8;
+        for(uint32_t e=0;e<ip->entries;e++) {
+            memcpy(p, &ip->pos[e].startByte, 4);
+            memcpy(p + 4, &ip->pos[e].length, 4);
+            memcpy(p + 8, &ip->pos[e].block, 2);
+            p[10] = ip->pos[e].sec;
+            p[11] = ip->pos[e].device;
+            p += 12;
+        }
+    }
+    count = unwrittenBlocks(p + sizeof(uint32_t));
+    memcpy(p, &count, sizeof(uint32_t));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unwrittenBlocks
+// Description  : Finds the file blocks lcfallocate set aside that nothing
+//                was written to yet. They are mapped like any other block,
+//                so the metadata lists them for a mount to know they hold
+//                no file data.
+//
+// Inputs       : addrs - where to put their addresses, 4 bytes each (NULL
+//                to only count them)
+// Outputs      : how many there are
+uint32_t unwrittenBlocks(char *addrs) {
+    DEVICE_OBJ *dev;
+    MEMORY_ENTRY *m;
+    uint32_t count = 0;
+    uint32_t addr;
+
+    for(uint32_t j=0;j<numInodes;j++) {
+        for(uint32_t e=0;e<inodes[j]->entries;e++) {
+            m = &inodes[j]->pos[e];
+            dev = &devices[checkId(m->device)];
+            for(uint32_t b=0;b<(m->length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;b++) {
+                if(dev->table[m->sec][m->block + b].spaceUsed == 0) {
+                    if(addrs != NULL) {
+                        addr = metaAddress(dev, (uint32_t)m->sec * dev->numBlocks + m->block + b);
+                        memcpy(addrs + count * sizeof(addr), &addr, sizeof(addr));
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parseImage
+// Description  : Loads serialized metadata into the free maps and inodes,
+//                and marks how much of each file block is used. Anything
+//                out of bounds fails the whole load. Version 1 has no list
+//                of blocks set aside.
+//
+// Inputs       : img - the metadata, len - its length, version - the
+//                superblock's version
+// Outputs      : 0 if successful, -1 if failure
+int parseImage(const char *img, size_t len, uint32_t version) {
+    const char *p = img;
+    const char *end = img + len;
+    uint32_t addr;
+    uint32_t count, total, entries, left;
+    char path[UINT16_MAX + 1];
+    MEMORY_ENTRY *m;
+    DEVICE_OBJ *dev;
+    uint16_t plen;
+    size_t n;
+    int d, ino;
+
+    if(len < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(&count, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    for(d=0;d<numDevices;d++) {
+        dev = &devices[d];
+        total = (uint32_t)dev->numSectors * dev->numBlocks;
+        n = (total + 63) / 64 * sizeof(uint64_t);
+        if(end - p < n) {
+            return -1;
+        }
+        memcpy(dev->freeMap, p, n);
+        p += n;
+        if(total % 64) {
+            dev->freeMap[total / 64] &= (1ULL << (total % 64)) - 1;
+        }
+        dev->numFree = 0;
+        for(uint32_t w=0;w<(total+63)/64;w++) {
+            dev->numFree += __builtin_popcountll(dev->freeMap[w]);
+        }
+        dev->freeHint = 0;
+    }
+
+    for(uint32_t j=0;j<count;j++) {
+        if(end - p < 2) {
+            return -1;
+        }
+        memcpy(&plen, p, 2);
+        if(end - p < 2 + plen + 8) {
+            return -1;
+        }
+        memcpy(path, p + 2, plen);
+        path[plen] = '\0';
+        p += 2 + plen;
+        ino = newInode(path);
+        if(ino == -1) {
+            return -1;
+        }
+        memcpy(&inodes[ino]->length, p, 4);
+        memcpy(&entries, p + 4, 4);
+        p += 8;
+        if(end - p < (size_t)entries * 12) {
+            return -1;
+        }
+        inodes[ino]->pos = (MEMORY_ENTRY *)malloc(sizeof(MEMORY_ENTRY) * (entries ? entries : 1));
+        if(inodes[ino]->pos == NULL) {
+            return -1;
+        }
+        inodes[ino]->capacity = entries;
+        for(uint32_t e=0;e<entries;e++) {
+            m = &inodes[ino]->pos[e];
+            memcpy(&m->startByte, p, 4);
+            memcpy(&m->length, p + 4, 4);
+            memcpy(&m->block, p + 8, 2);
+            m->sec = p[10];
+            m->device = p[11];
+            p += 12;
+            d = checkId(m->device);
+            if(d == -1 || m->sec >= devices[d].numSectors ||
+                m->block + (m->length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE > devices[d].numBlocks) {
+                return -1;
+            }
+            left = m->length;
+            for(uint16_t b=m->block;left>0;b++) {
+                devices[d].table[m->sec][b].spaceUsed = CMPSC311_MINVAL(left, LC_DEVICE_BLOCK_SIZE);
+                left -= devices[d].table[m->sec][b].spaceUsed;
+            }
+            inodes[ino]->entries++;
+        }
+    }
+
+    //Blocks set aside are mapped like the rest, but hold no file data yet
+    if(version >= 2) {
+        if(end - p < 4) {
+            return -1;
+        }
+        memcpy(&count, p, 4);
+        p += 4;
+        if((size_t)(end - p) / 4 < count) {
+            return -1;
+        }
+        for(uint32_t k=0;k<count;k++) {
+            memcpy(&addr, p, 4);
+            p += 4;
+            d = checkId(addr >> 24);
+            if(d == -1 || (addr & 0xFFFFFF) >= (uint32_t)devices[d].numSectors * devices[d].numBlocks) {
+                return -1;
+            }
+            devices[d].table[(addr & 0xFFFFFF) / devices[d].numBlocks][(addr & 0xFFFFFF) % devices[d].numBlocks].spaceUsed = 0;
+        }
+    }
+    return (p == end) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : metaAddress
+// Description  : Packs a block's device and number (sector major) into the
+//                address used by the metadata chain
+//
+// Inputs       : dev - the device, b - the block number
+// Outputs      : the address
+uint32_t metaAddress(DEVICE_OBJ *dev, uint32_t b) {
+    return (uint32_t)dev->id << 24 | b;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : metaTransfer
+// Description  : Reads or writes a block of the superblock or metadata
+//                chain. A written block goes in the cache too, so the cache
+//                never holds an older copy of it.
+//
+// Inputs       : addr - the block's address, op - LC_XFER_READ or
+//                LC_XFER_WRITE, data - the block
+// Outputs      : 0 if successful, -1 if failure
+int metaTransfer(uint32_t addr, int op, char *data) {
+    uint8_t rb0, rb1, rc0, rc1, rc2;
+    uint16_t rd0, rd1;
+    DEVICE_OBJ *dev;
+    uint32_t b = addr & 0xFFFFFF;
+    int d = checkId(addr >> 24);
+
+    if(d == -1 || b >= (uint32_t)devices[d].numSectors * devices[d].numBlocks) {
+        return -1;
+    }
+    dev = &devices[d];
+
+    pthread_mutex_lock(busFor(dev->id));
+    LCloudRegisterFrame frame = create_lcloud_registers(0,0,LC_BLOCK_XFER,dev->id,op,b / dev->numBlocks,b % dev->numBlocks);
+    extract_lcloud_registers(client_lcloud_bus_request(frame,data),&rb0,&rb1,&rc0,&rc1,&rc2,&rd0,&rd1);
+    if(rb1 == 1 && op == LC_XFER_WRITE) {
+        lcloud_putcache(dev->id, b / dev->numBlocks, b % dev->numBlocks, data);
+    }
+    pthread_mutex_unlock(busFor(dev->id));
+    return (rb1 == 1) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mountFs
+// Description  : Reads the filesystem metadata: the superblock, then the
+//                chain of metadata blocks it points to, so the cost depends
+//                on the metadata and not on the size of the devices. Only
+//                devices with no superblock of ours are formatted (all
+//                blocks free but the superblock, no files), or any devices
+//                if LC_FS_FORMAT is non zero. A new format gets a new
+//                generation, unlike any an older filesystem had. A
+//                superblock of ours whose metadata does not check out, or
+//                that was made on other devices, fails the mount rather
+//                than losing the files in it.
+//
+// Inputs       : none
+// Outputs      : 0 if mounted, 1 if formatted, -1 if failure
+int mountFs() {
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    SUPERBLOCK sb;
+    uint32_t addr, next;
+    char *img = NULL;
+    int valid;
+
+    if(numDevices == 0 || metaTransfer(metaAddress(&devices[0], 0), LC_XFER_READ, blk) == -1) {
+        return -1;
+    }
+    memcpy(&sb, blk, sizeof(sb));
+    if(memcmp(sb.magic, LC_FS_MAGIC, sizeof(sb.magic)) == 0 &&
+        (getenv("LC_FS_FORMAT") == NULL || atoi(getenv("LC_FS_FORMAT")) == 0)) {
+        if(sb.version != 1 && sb.version != LC_FS_VERSION) {
+            logMessage(LOG_ERROR_LEVEL,"Filesystem version %u is not supported, not mounting",sb.version);
+            return -1;
+        }
+        if(sb.geometry != fsGeometry()) {
+            logMessage(LOG_ERROR_LEVEL,"Filesystem was made on other devices, not mounting (LC_FS_FORMAT=1 formats them)");
+            return -1;
+        }
+
+        //Follow the chain, it is exactly as long as the metadata needs
+        numMeta = (sb.imageLength + LC_META_PAYLOAD - 1) / LC_META_PAYLOAD;
+        metaBlocks = (uint32_t *)malloc(sizeof(uint32_t) * (numMeta ? numMeta : 1));
+        metaCopy = (char *)malloc(LC_DEVICE_BLOCK_SIZE * (numMeta ? numMeta : 1));
+        img = (char *)malloc(numMeta * LC_META_PAYLOAD + 1);
+        if(metaBlocks == NULL || metaCopy == NULL || img == NULL) {
+            free(img);
+            return -1;
+        }
+        valid = 1;
+        addr = sb.firstMeta;
+        for(uint32_t k=0;k<numMeta;k++) {
+            if(addr == LC_META_NONE || metaTransfer(addr, LC_XFER_READ, &metaCopy[k * LC_DEVICE_BLOCK_SIZE]) == -1) {
+                valid = 0;
+                break;
+            }
+            metaBlocks[k] = addr;
+            memcpy(&next, &metaCopy[k * LC_DEVICE_BLOCK_SIZE], sizeof(next));
+            memcpy(&img[k * LC_META_PAYLOAD], &metaCopy[k * LC_DEVICE_BLOCK_SIZE + 4], LC_META_PAYLOAD);
+            addr = next;
+        }
+        valid = valid && fsChecksum(img, sb.imageLength) == sb.checksum && parseImage(img, sb.imageLength, sb.version) == 0;
+        free(img);
+        if(!valid) {
+            logMessage(LOG_ERROR_LEVEL,"Filesystem metadata is damaged, not mounting (LC_FS_FORMAT=1 formats the devices)");
+            return -1;
+        }
+        memcpy(superCopy, blk, LC_DEVICE_BLOCK_SIZE);
+        fsGeneration = sb.generation;
+        logMessage(LcDriverLLevel,"Mounted filesystem with %u files from %u metadata blocks",numInodes,numMeta);
+        return 0;
+    }
+
+    //Format
+    logMessage(LcDriverLLevel,"Formatting the devices");
+    dropInodes();
+    free(metaBlocks);
+    free(metaCopy);
+    metaBlocks = NULL;
+    metaCopy = NULL;
+    numMeta = 0;
+    memset(superCopy, 0, sizeof(superCopy));
+    for(int d=0;d<numDevices;d++) {
+        DEVICE_OBJ *dev = &devices[d];
+        uint32_t total = (uint32_t)dev->numSectors * dev->numBlocks;
+        memset(dev->freeMap, 0xFF, (total + 63) / 64 * sizeof(uint64_t));
+        if(total % 64) {
+            dev->freeMap[total / 64] = (1ULL << (total % 64)) - 1;
+        }
+        dev->numFree = total;
+        dev->freeHint = 0;
+        for(int j=0;j<dev->numSectors;j++) {
+            memset(dev->table[j], 0, sizeof(BLOCK) * dev->numBlocks);
+        }
+    }
+    takeRun(&devices[0], 0, 1);
+    fsGeneration = (uint64_t)time(NULL) << 32 | (uint32_t)getpid();
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : syncFs
+// Description  : Writes the filesystem metadata, copy on write. If any of
+//                it changed, the whole chain is written to newly allocated
+//                blocks and then the superblock is pointed at it, so the
+//                devices hold either the old metadata or the new one should
+//                a write fail or the system stop part way. The old chain's
+//                blocks are saved as free in the new metadata, but only
+//                given back once the superblock is written. Called holding
+//                fsLock exclusive, so no file changes under it.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int syncFs() {
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    SUPERBLOCK sb;
+    DEVICE_OBJ *dev;
+    uint32_t *newBlocks = NULL;
+    char *newCopy = NULL;
+    uint32_t next;
+    uint32_t need;
+    uint32_t k;
+    uint8_t sec;
+    uint16_t block;
+    size_t size;
+    char *img;
+    int same;
+
+    if(!on) {
+        return 0;
+    }
+
+    //The chain is left alone if it would come out the same
+    size = imageSize();
+    need = (size + LC_META_PAYLOAD - 1) / LC_META_PAYLOAD;
+    img = (char *)calloc(need ? need : 1, LC_META_PAYLOAD);
+    if(img == NULL) {
+        return -1;
+    }
+    buildImage(img);
+    same = (need == numMeta);
+    for(k=0;same && k<need;k++) {
+        same = memcmp(&img[k * LC_META_PAYLOAD], &metaCopy[k * LC_DEVICE_BLOCK_SIZE + 4], LC_META_PAYLOAD) == 0;
+    }
+
+    if(!same) {
+        newBlocks = (uint32_t *)malloc(sizeof(uint32_t) * (need ? need : 1));
+        newCopy = (char *)malloc(LC_DEVICE_BLOCK_SIZE * (need ? need : 1));
+        if(newBlocks == NULL || newCopy == NULL) {
+            free(newBlocks);
+            free(newCopy);
+            free(img);
+            return -1;
+        }
+        for(k=0;k<need;k++) {
+            if(allocBlocks(1, NULL, -1, &dev, &sec, &block) == 0) {
+                logMessage(LOG_ERROR_LEVEL,"No free blocks left for the filesystem metadata");
+                freeChain(newBlocks, k);
+                free(newBlocks);
+                free(newCopy);
+                free(img);
+                return -1;
+            }
+            newBlocks[k] = metaAddress(dev, (uint32_t)sec * dev->numBlocks + block);
+        }
+
+        //Saved with the old chain free and the new one used
+        freeChain(metaBlocks, numMeta);
+        buildImage(img);
+        takeChain(metaBlocks, numMeta);
+
+        for(k=0;k<need;k++) {
+            next = (k + 1 < need) ? newBlocks[k + 1] : LC_META_NONE;
+            memcpy(&newCopy[k * LC_DEVICE_BLOCK_SIZE], &next, sizeof(next));
+            memcpy(&newCopy[k * LC_DEVICE_BLOCK_SIZE + 4], &img[k * LC_META_PAYLOAD], LC_META_PAYLOAD);
+            if(metaTransfer(newBlocks[k], LC_XFER_WRITE, &newCopy[k * LC_DEVICE_BLOCK_SIZE]) == -1) {
+                freeChain(newBlocks, need);
+                free(newBlocks);
+                free(newCopy);
+                free(img);
+                return -1;
+            }
+        }
+    }
+
+    memset(blk, 0, sizeof(blk));
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.magic, LC_FS_MAGIC, sizeof(sb.magic));
+    sb.version = LC_FS_VERSION;
+    sb.imageLength = size;
+    sb.geometry = fsGeometry();
+    sb.checksum = fsChecksum(img, size);
+    sb.firstMeta = need ? (same ? metaBlocks[0] : newBlocks[0]) : LC_META_NONE;
+    sb.generation = fsGeneration;
+    memcpy(blk, &sb, sizeof(sb));
+    free(img);
+    if(memcmp(blk, superCopy, LC_DEVICE_BLOCK_SIZE) != 0) {
+        if(metaTransfer(metaAddress(&devices[0], 0), LC_XFER_WRITE, blk) == -1) {
+            if(!same) {
+                freeChain(newBlocks, need);
+                free(newBlocks);
+                free(newCopy);
+            }
+            return -1;
+        }
+        memcpy(superCopy, blk, LC_DEVICE_BLOCK_SIZE);
+    }
+
+    //The old chain is no longer reachable
+    if(!same) {
+        freeChain(metaBlocks, numMeta);
+        free(metaBlocks);
+        free(metaCopy);
+        metaBlocks = newBlocks;
+        metaCopy = newCopy;
+        numMeta = need;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeChain
+// Description  : Gives the blocks of a metadata chain back to the free
+//                maps, dropping them from the cache and the read ahead
+//                queue as freeExtents does
+//
+// Inputs       : blocks - the chain's addresses, n - how many
+// Outputs      : none
+void freeChain(const uint32_t *blocks, uint32_t n) {
+    MEMORY_ENTRY m;
+    DEVICE_OBJ *dev;
+
+    for(uint32_t k=0;k<n;k++) {
+        dev = &devices[checkId(blocks[k] >> 24)];
+        memset(&m, 0, sizeof(m));
+        m.device = dev->id;
+        m.sec = (blocks[k] & 0xFFFFFF) / dev->numBlocks;
+        m.block = (blocks[k] & 0xFFFFFF) % dev->numBlocks;
+        m.length = LC_DEVICE_BLOCK_SIZE;
+        freeExtents(&m, 1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : takeChain
+// Description  : Marks the blocks of a metadata chain used again after
+//                freeChain. Called holding fsLock exclusive.
+//
+// Inputs       : blocks - the chain's addresses, n - how many
+// Outputs      : none
+void takeChain(const uint32_t *blocks, uint32_t n) {
+    for(uint32_t k=0;k<n;k++) {
+        takeRun(&devices[checkId(blocks[k] >> 24)], blocks[k] & 0xFFFFFF, 1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unmountFs
+// Description  : Forgets the files and devices after power off, they are
+//                read back from the devices at the next power on
+//
+// Inputs       : none
+// Outputs      : none
+void unmountFs() {
+    mountGen++;
+    dropInodes();
+    free(inodes);
+    free(pathIndex);
+    free(metaBlocks);
+    free(metaCopy);
+    inodes = NULL;
+    pathIndex = NULL;
+    metaBlocks = NULL;
+    metaCopy = NULL;
+    inodeSlots = pathSlots = numMeta = 0;
+    memset(superCopy, 0, sizeof(superCopy));
+
+    for(int d=0;d<numDevices;d++) {
+        for(int j=0;j<devices[d].numSectors;j++) {
+            free(devices[d].table[j]);
+        }
+        free(devices[d].table);
+        free(devices[d].freeMap);
+        pthread_mutex_destroy(&devices[d].lock);
+    }
+    numDevices = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeBlock
+// Description  : Gives a block back to its device's free map
+//
+// Inputs       : dev - the device, b - the block number (sector major)
+// Outputs      : none
+void freeBlock(DEVICE_OBJ *dev, uint32_t b) {
+    pthread_mutex_lock(&dev->lock);
+    dev->freeMap[b / 64] |= 1ULL << (b % 64);
+    dev->numFree++;
+    dev->freeHint = CMPSC311_MINVAL(dev->freeHint, b / 64);
+    pthread_mutex_unlock(&dev->lock);
+    dev->table[b / dev->numBlocks][b % dev->numBlocks].spaceUsed = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findExtent
+// Description  : Finds the memory entry holding the block a file offset is
+//                in. The offset itself may be past the bytes mapped when
+//                the entry ends part way into that block.
+//
+// Inputs       : ip - the file's inode, loc - the file offset
+// Outputs      : index of the memory entry, -1 if the block is in a hole or
+//                past the last entry
+int findExtent(INODE *ip, uint32_t loc) {
+    int e = prevExtent(ip, loc);
+
+    if(e == -1 || loc / LC_DEVICE_BLOCK_SIZE >=
+        ((uint64_t)ip->pos[e].startByte + ip->pos[e].length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE) {
+        return -1;
+    }
+    return e;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prevExtent
+// Description  : Binary search of a file's memory entries for the last one
+//                starting at or before a file offset
+//
+// Inputs       : ip - the file's inode, loc - the file offset
+// Outputs      : index of the memory entry, -1 if none
+int prevExtent(INODE *ip, uint32_t loc) {
+    uint32_t lo = 0;
+    uint32_t n = ip->entries;
+    uint32_t half;
+
+    //Halving without a branch on the comparison so a lookup costs no mispredictions
+    if(n == 0 || ip->pos[0].startByte > loc) {
+        return -1;
+    }
+    while(n > 1) {
+        half = n / 2;
+        lo = (ip->pos[lo + half].startByte <= loc) ? lo + half : lo;
+        n -= half;
+    }
+    return (int)lo;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addExtent
+// Description  : Maps bytes of a file, starting at a block boundary, to a
+//                block or run of blocks. Bytes in the blocks of an entry, or
+//                carrying on from where it ends in the blocks right after
+//                it, grow that entry, otherwise they get a new entry in
+//                order. An entry that then meets the next one in the same
+//                run takes it in. The array grows by half again when full.
+//
+// Inputs       : ip - the file's inode, loc - file offset of the bytes, len - how
+//                many, did - the device, sec - the sector, blk - the first block
+// Outputs      : 0 if successful, -1 if failure
+int addExtent(INODE *ip, uint32_t loc, uint32_t len, LcDeviceId did, uint8_t sec, uint16_t blk) {
+    int e = prevExtent(ip, loc);
+    MEMORY_ENTRY *m = (e == -1) ? NULL : &ip->pos[e];
+    MEMORY_ENTRY *next;
+    MEMORY_ENTRY *grown;
+
+    if(m != NULL && m->device == did && m->sec == sec && loc <= m->startByte + m->length &&
+        blk == m->block + (loc - m->startByte) / LC_DEVICE_BLOCK_SIZE) {
+        m->length = CMPSC311_MAXVAL(m->length, loc + len - m->startByte);
+    }
+    else {
+        if(ip->entries == ip->capacity) {
+            grown = (MEMORY_ENTRY *)realloc(ip->pos, sizeof(MEMORY_ENTRY) * (ip->capacity + ip->capacity / 2 + 4));
+            if(grown == NULL) {
+                return -1;
+            }
+            ip->pos = grown;
+            ip->capacity += ip->capacity / 2 + 4;
+        }
+        e++;
+        memmove(&ip->pos[e + 1], &ip->pos[e], sizeof(MEMORY_ENTRY) * (ip->entries - e));
+        m = &ip->pos[e];
+        m->startByte = loc;
+        m->length = len;
+        m->device = did;
+        m->sec = sec;
+        m->block = blk;
+        ip->entries++;
+    }
+
+    //Filling a hole can join two entries
+    next = (e + 1 < ip->entries) ? &ip->pos[e + 1] : NULL;
+    if(next != NULL && next->startByte == m->startByte + m->length && next->device == m->device &&
+        next->sec == m->sec && next->block == m->block + m->length / LC_DEVICE_BLOCK_SIZE && m->length % LC_DEVICE_BLOCK_SIZE == 0) {
+        m->length += next->length;
+        memmove(next, next + 1, sizeof(MEMORY_ENTRY) * (ip->entries - e - 2));
+        ip->entries--;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : holeBlocks
+// Description  : Counts the blocks from the one an offset is in up to the
+//                end of a range or the file's next memory entry, whichever
+//                comes first. Called with the offset's block in a hole.
+//
+// Inputs       : ip - the file's inode, loc - the offset, end - the end of
+//                the range
+// Outputs      : the number of blocks
+uint32_t holeBlocks(INODE *ip, uint32_t loc, uint64_t end) {
+    int e = prevExtent(ip, loc) + 1;
+
+    if(e < ip->entries) {
+        end = CMPSC311_MINVAL(end, ip->pos[e].startByte);
+    }
+    return (end + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE - loc / LC_DEVICE_BLOCK_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocFor
+// Description  : Allocates a run of blocks for a hole in a file, right
+//                after the memory entry before it if there is room. With
+//                striping the run stops at the end of the stripe unit and
+//                goes on the unit's device.
+//
+// Inputs       : fl - the handle, ip - its inode, fileBlock - the first file
+//                block of the hole, want - blocks wanted, *dev, *sec, *block
+//                - set to the first block
+// Outputs      : number of blocks allocated, 0 if the devices are full
+int allocFor(FILE_OBJ *fl, INODE *ip, uint32_t fileBlock, uint32_t want, DEVICE_OBJ **dev, uint8_t *sec, uint16_t *block) {
+    int e = prevExtent(ip, fileBlock * LC_DEVICE_BLOCK_SIZE);
+    const MEMORY_ENTRY *after = (e == -1) ? NULL : &ip->pos[e];
+
+    if(stripeUnit) {
+        return allocBlocks(CMPSC311_MINVAL(want, stripeUnit - fileBlock % stripeUnit), after, stripeDevice(fl, fileBlock), dev, sec, block);
+    }
+    return allocBlocks(want, after, -1, dev, sec, block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAheadFrom
+// Description  : Queues the blocks after a sequential read for the read ahead
+//                thread. The window starts at LC_READAHEAD_MIN blocks and
+//                doubles (up to the file's raLimit) each time the reader gets
+//                within half a window of the last block queued, which is also
+//                when the next batch is queued.
+//
+// Inputs       : fl - the file, fileBlock - the file block the read ended in
+// Outputs      : none
+void readAheadFrom(FILE_OBJ *fl, uint32_t fileBlock) {
+    INODE *ip = inodes[fl->ino];
+    RA_REQ *req;
+    int e;
+
+    if(fl->raLimit == 0) {
+        return;
+    }
+    if(fl->raWindow == 0) {
+        fl->raWindow = CMPSC311_MINVAL(LC_READAHEAD_MIN, fl->raLimit);
+        fl->raStart = fl->raNext = fileBlock + 1;
+    }
+    else if(fl->raNext <= fileBlock + fl->raWindow / 2) {
+        fl->raWindow = CMPSC311_MINVAL(fl->raWindow * 2, fl->raLimit);
+        fl->raNext = CMPSC311_MAXVAL(fl->raNext, fileBlock + 1);
+    }
+    else {
+        return;
+    }
+
+    pthread_mutex_lock(&raLock);
+    while(fl->raNext <= fileBlock + fl->raWindow && raCount < LC_READAHEAD_QUEUE &&
+        (e = findExtent(ip, fl->raNext * LC_DEVICE_BLOCK_SIZE)) != -1) {
+        req = &raQueue[(raHead + raCount) % LC_READAHEAD_QUEUE];
+        req->handle = fl->info.handle;
+        req->device = ip->pos[e].device;
+        req->sec = ip->pos[e].sec;
+        req->block = ip->pos[e].block + (fl->raNext * LC_DEVICE_BLOCK_SIZE - ip->pos[e].startByte) / LC_DEVICE_BLOCK_SIZE;
+        raCount++;
+        fl->raNext++;
+    }
+    pthread_cond_signal(&raCond);
+    pthread_mutex_unlock(&raLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cancelReadAhead
+// Description  : Ends a file's stream and drops its blocks from the read
+//                ahead queue (a block already being fetched still lands in
+//                the cache)
+//
+// Inputs       : fl - the file
+// Outputs      : none
+void cancelReadAhead(FILE_OBJ *fl) {
+    int n = 0;
+    RA_REQ req;
+
+    fl->raWindow = 0;
+    if(!readAhead) {
+        return;
+    }
+
+    //Keep the other files' blocks in order
+    pthread_mutex_lock(&raLock);
+    for(int k=0;k<raCount;k++) {
+        req = raQueue[(raHead + k) % LC_READAHEAD_QUEUE];
+        if(req.handle != fl->info.handle) {
+            raQueue[(raHead + n) % LC_READAHEAD_QUEUE] = req;
+            n++;
+        }
+    }
+    raCount = n;
+    pthread_mutex_unlock(&raLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dequeueReadAhead
+// Description  : Takes a block the reader is about to fetch itself off the
+//                read ahead queue
+//
+// Inputs       : did - the device, sec - the sector, blk - the block
+// Outputs      : 1 if the block was queued, 0 if not
+int dequeueReadAhead(LcDeviceId did, uint8_t sec, uint16_t blk) {
+    int found = 0;
+    int n = 0;
+    RA_REQ req;
+
+    pthread_mutex_lock(&raLock);
+    for(int k=0;k<raCount;k++) {
+        req = raQueue[(raHead + k) % LC_READAHEAD_QUEUE];
+        if(!found && req.device == did && req.sec == sec && req.block == blk) {
+            found = 1;
+            continue;
+        }
+        raQueue[(raHead + n) % LC_READAHEAD_QUEUE] = req;
+        n++;
+    }
+    raCount = n;
+    pthread_mutex_unlock(&raLock);
+    return found;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAheadFeedback
+// Description  : Adapts a file's read ahead to how well it works. Each block
+//                of the stream found in the cache raises the file's limit by
+//                one, each one read ahead but evicted before the reader got
+//                to it halves the limit (so many streams sharing a small
+//                cache back off, down to no read ahead at all). A block the
+//                reader got to before it was read ahead counts as neither.
+//
+// Inputs       : fl - the file, fileBlock - the file block just read,
+//                used - was it in the cache, late - was it still queued
+// Outputs      : none
+void readAheadFeedback(FILE_OBJ *fl, uint32_t fileBlock, int used, int late) {
+    if(fileBlock < fl->raStart || fileBlock >= fl->raNext || late) {
+        return;
+    }
+    if(used) {
+        fl->raLimit = CMPSC311_MINVAL(fl->raLimit + 1, readAhead);
+        return;
+    }
+    fl->raLimit /= 2;
+    fl->raWindow = CMPSC311_MINVAL(fl->raWindow, fl->raLimit);
+    if(fl->raWindow == 0) {
+        cancelReadAhead(fl);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAheadWorker
+// Description  : Read ahead thread. Fetches queued blocks the cache does not
+//                have and fills them in. The check, transfer and fill are
+//                done holding the bus lock, so a write to the same block is
+//                either seen by the transfer or replaces the fill.
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+void *readAheadWorker(void *arg) {
+    RA_REQ req;
+    uint32_t epoch;
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    uint8_t rb0, rb1, rc0, rc1, rc2;
+    uint16_t rd0, rd1;
+
+    pthread_mutex_lock(&raLock);
+    while(1) {
+        while(raCount == 0 && !raStop) {
+            pthread_cond_wait(&raCond, &raLock);
+        }
+        if(raStop) {
+            break;
+        }
+        req = raQueue[raHead];
+        raHead = (raHead + 1) % LC_READAHEAD_QUEUE;
+        raCount--;
+        epoch = raEpoch;
+        pthread_mutex_unlock(&raLock);
+
+        //The block may have been freed since it was dequeued
+        pthread_mutex_lock(busFor(req.device));
+        if(__atomic_load_n(&raEpoch, __ATOMIC_SEQ_CST) == epoch && lcloud_peekcache(req.device, req.sec, req.block, NULL) == -1) {
+            LCloudRegisterFrame frame = create_lcloud_registers(0,0,LC_BLOCK_XFER,req.device,LC_XFER_READ,req.sec,req.block);
+            extract_lcloud_registers(client_lcloud_bus_request(frame,blk),&rb0,&rb1,&rc0,&rc1,&rc2,&rd0,&rd1);
+            if(rb1 == 1) {
+                lcloud_fillcache(req.device, req.sec, req.block, blk);
+            }
+        }
+        pthread_mutex_unlock(busFor(req.device));
+
+        pthread_mutex_lock(&raLock);
+    }
+    pthread_mutex_unlock(&raLock);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : submitAsync
+// Description  : Queues an asynchronous read or write for the request
+//                threads, starting them on the first request
+//
+// Inputs       : fh - the file handle, off - where in the file, buf - the
+//                data, len - its length, write - is it a write, done - called
+//                with the result (NULL to poll for it), arg - passed to done
+// Outputs      : the request ID, -1 if failure
+LcRequestId submitAsync(LcFHandle fh, size_t off, char *buf, size_t len, int write, LcCompletion done, void *arg) {
+    ASYNC_REQ *r;
+    LcRequestId req;
+    int slot;
+
+    //A handle that is not open fails now, like it would for the calls that block
+    pthread_rwlock_rdlock(&fsLock);
+    slot = checkHandle(fh);
+    pthread_rwlock_unlock(&fsLock);
+    if(slot == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&asyncLock);
+    if(asyncStop || (asyncWorkers == 0 && startAsync() == -1) || (asyncFree == -1 && growAsync() == -1)) {
+        pthread_mutex_unlock(&asyncLock);
+        return -1;
+    }
+    slot = asyncFree;
+    r = &asyncReqs[slot];
+    asyncFree = r->next;
+    r->handle = fh;
+    r->off = off;
+    r->buf = buf;
+    r->len = len;
+    r->write = write;
+    r->done = done;
+    r->arg = arg;
+    r->result = -1;
+    r->state = LC_ASYNC_QUEUED;
+    r->next = -1;
+    req = (LcRequestId)(r->gen << LC_ASYNC_SLOT_BITS | slot);
+
+    //Oldest first
+    if(asyncTail == -1) {
+        asyncHead = slot;
+    }
+    else {
+        asyncReqs[asyncTail].next = slot;
+    }
+    asyncTail = slot;
+    asyncPending++;
+    pthread_cond_signal(&asyncCond);
+    pthread_mutex_unlock(&asyncLock);
+
+    return req;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkRequest
+// Description  : Finds which slot a request ID is in, a freed request's ID
+//                has an old generation. Called holding asyncLock.
+//
+// Inputs       : req - the request ID
+// Outputs      : the slot, -1 if not a request
+int checkRequest(LcRequestId req) {
+    int slot = req & LC_ASYNC_SLOT_MASK;
+
+    if(req < 0 || slot >= asyncSlots || asyncReqs[slot].state == LC_ASYNC_FREE ||
+        (asyncReqs[slot].gen << LC_ASYNC_SLOT_BITS | slot) != req) {
+        return -1;
+    }
+    return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : growAsync
+// Description  : Doubles the request table, the new slots go on the free
+//                list lowest first. Called holding asyncLock.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int growAsync() {
+    uint32_t slots = asyncSlots ? asyncSlots * 2 : 64;
+    ASYNC_REQ *grown;
+
+    slots = CMPSC311_MINVAL(slots, (uint32_t)LC_ASYNC_SLOT_MASK + 1);
+    if(slots == asyncSlots) {
+        logMessage(LOG_ERROR_LEVEL,"Too many asynchronous requests");
+        return -1;
+    }
+    grown = (ASYNC_REQ *)realloc(asyncReqs, sizeof(ASYNC_REQ) * slots);
+    if(grown == NULL) {
+        return -1;
+    }
+    asyncReqs = grown;
+
+    for(uint32_t slot=slots;slot>asyncSlots;slot--) {
+        asyncReqs[slot-1].gen = 0;
+        asyncReqs[slot-1].state = LC_ASYNC_FREE;
+        asyncReqs[slot-1].next = asyncFree;
+        asyncFree = slot - 1;
+    }
+    asyncSlots = slots;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseRequest
+// Description  : Frees a finished request's slot, a new generation keeps
+//                its ID from matching the slot's next request. Called
+//                holding asyncLock.
+//
+// Inputs       : slot - the slot in the request table
+// Outputs      : none
+void releaseRequest(int slot) {
+    ASYNC_REQ *r = &asyncReqs[slot];
+
+    r->state = LC_ASYNC_FREE;
+    r->gen = (r->gen + 1) & LC_ASYNC_GEN_MASK;
+    r->next = asyncFree;
+    asyncFree = slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startAsync
+// Description  : Starts the request threads, LC_ASYNC_THREADS of them if
+//                set. Called holding asyncLock.
+//
+// Inputs       : none
+// Outputs      : 0 if any started, -1 if none could be
+int startAsync() {
+    int want = LC_ASYNC_WORKERS;
+
+    if(getenv("LC_ASYNC_THREADS") != NULL) {
+        want = CMPSC311_MINVAL(CMPSC311_MAXVAL(atoi(getenv("LC_ASYNC_THREADS")), 1), LC_ASYNC_MAX_WORKERS);
+    }
+    while(asyncWorkers < want && pthread_create(&asyncThreads[asyncWorkers], NULL, asyncWorker, NULL) == 0) {
+        asyncWorkers++;
+    }
+    if(asyncWorkers == 0) {
+        logMessage(LOG_ERROR_LEVEL,"Could not start a thread for asynchronous requests");
+        return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopAsync
+// Description  : Waits for every request queued or running, then stops the
+//                request threads. Requests started meanwhile fail. Results
+//                not yet collected stay in the table.
+//
+// Inputs       : none
+// Outputs      : none
+void stopAsync() {
+    pthread_mutex_lock(&asyncLock);
+    while(asyncPending > 0) {
+        pthread_cond_wait(&asyncDone, &asyncLock);
+    }
+    asyncStop = 1;
+    pthread_cond_broadcast(&asyncCond);
+    pthread_mutex_unlock(&asyncLock);
+
+    for(int k=0;k<asyncWorkers;k++) {
+        pthread_join(asyncThreads[k], NULL);
+    }
+
+    pthread_mutex_lock(&asyncLock);
+    asyncWorkers = 0;
+    asyncStop = 0;
+    pthread_mutex_unlock(&asyncLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : asyncWorker
+// Description  : Request thread. Runs queued requests oldest first, with
+//                the other request threads running theirs alongside. A
+//                request runs on a copy, so the table can grow meanwhile.
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+void *asyncWorker(void *arg) {
+    ASYNC_REQ req;
+    int slot;
+    int result;
+
+    pthread_mutex_lock(&asyncLock);
+    while(1) {
+        while(asyncHead == -1 && !asyncStop) {
+            pthread_cond_wait(&asyncCond, &asyncLock);
+        }
+        if(asyncHead == -1) {
+            break;
+        }
+        slot = asyncHead;
+        asyncHead = asyncReqs[slot].next;
+        if(asyncHead == -1) {
+            asyncTail = -1;
+        }
+        asyncReqs[slot].state = LC_ASYNC_RUNNING;
+        req = asyncReqs[slot];
+        pthread_mutex_unlock(&asyncLock);
+
+        result = fileTransfer(req.handle, &req.off, req.buf, req.len, req.write);
+        if(req.done != NULL) {
+            req.done((LcRequestId)(req.gen << LC_ASYNC_SLOT_BITS | slot), result, req.arg);
+        }
+
+        pthread_mutex_lock(&asyncLock);
+        if(req.done != NULL) {
+            releaseRequest(slot);
+        }
+        else {
+            asyncReqs[slot].result = result;
+            asyncReqs[slot].state = LC_ASYNC_DONE;
+        }
+        asyncPending--;
+        pthread_cond_broadcast(&asyncDone);
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : onAsyncThread
+// Description  : Tells whether the caller is one of the request threads,
+//                that is, a completion callback
+//
+// Inputs       : none
+// Outputs      : 1 if it is, 0 if not
+int onAsyncThread() {
+    int found = 0;
+
+    pthread_mutex_lock(&asyncLock);
+    for(int k=0;k<asyncWorkers && !found;k++) {
+        found = pthread_equal(asyncThreads[k], pthread_self());
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return found != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : planRuns
+// Description  : Picks the fewest free runs of a device that hold a file,
+//                longest first, the last one cut to what is needed.
+//                Called holding the device's lock.
+//
+// Inputs       : dev - the device, need - blocks needed, runs - set to the
+//                runs picked, room for a run per two blocks of the device
+// Outputs      : number of runs picked, -1 if the device has too few free blocks
+int planRuns(DEVICE_OBJ *dev, uint32_t need, FREE_RUN *runs) {
+    uint32_t total = (uint32_t)dev->numSectors * dev->numBlocks;
+    uint32_t n = 0;
+    uint32_t got = 0;
+    uint32_t b = 0;
+    uint32_t end;
+    uint64_t word;
+    int k;
+
+    if(dev->numFree < need) {
+        return -1;
+    }
+
+    //Every run of free blocks, a run ends at the end of its sector. The
+    //map is read a word at a time, skipping whole words of used blocks
+    //and then of free ones.
+    while(b < total) {
+        word = dev->freeMap[b / 64] >> (b % 64);
+        if(word == 0) {
+            b = (b / 64 + 1) * 64;
+            continue;
+        }
+        b += __builtin_ctzll(word);
+        if(b >= total) {
+            break;
+        }
+        runs[n].first = b;
+        end = (b / dev->numBlocks + 1) * dev->numBlocks;
+        while(b < end) {
+            word = ~dev->freeMap[b / 64] >> (b % 64);
+            if(word != 0) {
+                b = CMPSC311_MINVAL(b + __builtin_ctzll(word), end);
+                break;
+            }
+            b = CMPSC311_MINVAL((b / 64 + 1) * 64, end);
+        }
+        runs[n].length = b - runs[n].first;
+        n++;
+    }
+
+    //Longest first, the last one picked cut to what is needed
+    qsort(runs, n, sizeof(FREE_RUN), compareRuns);
+    for(k=0;got<need;k++) {
+        runs[k].length = CMPSC311_MINVAL(runs[k].length, need - got);
+        got += runs[k].length;
+    }
+    return k;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compareRuns
+// Description  : Orders free runs for qsort, longest first and then by
+//                where they start
+//
+// Inputs       : a, b - the runs
+// Outputs      : <0, 0 or >0 as a goes before, with or after b
+int compareRuns( const void *a, const void *b ) {
+    const FREE_RUN *x = (const FREE_RUN *)a;
+    const FREE_RUN *y = (const FREE_RUN *)b;
+
+    if(x->length != y->length) {
+        return (x->length > y->length) ? -1 : 1;
+    }
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeExtents
+// Description  : Gives every block of some memory entries back to the free
+//                maps
+//
+// Inputs       : pos - the memory entries, entries - how many
+// Outputs      : none
+void freeExtents(const MEMORY_ENTRY *pos, uint32_t entries) {
+    DEVICE_OBJ *dev;
+
+    //Nothing cached may be written over or read ahead into the blocks
+    //once another file has them
+    forgetExtents(pos, entries);
+    for(uint32_t e=0;e<entries;e++) {
+        dev = &devices[checkId(pos[e].device)];
+        for(uint32_t b=0;b<(pos[e].length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;b++) {
+            freeBlock(dev, (uint32_t)pos[e].sec * dev->numBlocks + pos[e].block + b);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : forgetExtents
+// Description  : Drops the blocks of some memory entries from the read
+//                ahead queue and the cache, dirty ones without writing them
+//                back. A block the read ahead thread already dequeued is
+//                either filled in before its line is dropped here (under
+//                the bus lock) or sees the new raEpoch and is skipped.
+//                Called holding fsLock exclusive, so no reader has a block
+//                pinned.
+//
+// Inputs       : pos - the memory entries, entries - how many
+// Outputs      : none
+void forgetExtents(const MEMORY_ENTRY *pos, uint32_t entries) {
+    DEVICE_OBJ *dev;
+    RA_REQ req;
+    uint32_t b;
+    int keep;
+    int n = 0;
+
+    if(readAhead) {
+        pthread_mutex_lock(&raLock);
+        for(int k=0;k<raCount;k++) {
+            req = raQueue[(raHead + k) % LC_READAHEAD_QUEUE];
+            keep = 1;
+            for(uint32_t e=0;keep && e<entries;e++) {
+                keep = !inExtent(&pos[e], req.device, req.sec, req.block);
+            }
+            if(keep) {
+                raQueue[(raHead + n) % LC_READAHEAD_QUEUE] = req;
+                n++;
+            }
+        }
+        raCount = n;
+        __atomic_add_fetch(&raEpoch, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&raLock);
+    }
+
+    for(uint32_t e=0;e<entries;e++) {
+        dev = &devices[checkId(pos[e].device)];
+        pthread_mutex_lock(busFor(dev->id));
+        for(uint32_t k=0;k<(pos[e].length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;k++) {
+            b = (uint32_t)pos[e].sec * dev->numBlocks + pos[e].block + k;
+            //Only a pinned block is refused, and fsLock keeps readers out
+            assert(lcloud_dropcache(dev->id, b / dev->numBlocks, b % dev->numBlocks) == 0);
+        }
+        pthread_mutex_unlock(busFor(dev->id));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inExtent
+// Description  : Tells whether a block is one of a memory entry's
+//
+// Inputs       : m - the memory entry, did - the device, sec - the
+//                sector, blk - the block
+// Outputs      : 1 if it is, 0 if not
+int inExtent(const MEMORY_ENTRY *m, LcDeviceId did, uint8_t sec, uint16_t blk) {
+    return did == m->device && sec == m->sec && blk >= m->block &&
+        blk < m->block + (m->length + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copyBlock
+// Description  : Copies a file block to a new block for a defrag, through
+//                the cache if the block is there. The new block is written
+//                through and cached, so the cache has nothing older of it.
+//
+// Inputs       : from - the memory entry holding the block, fromBlock - the
+//                block in its sector, to - the new block's device, toBlock
+//                - the new block (sector major)
+// Outputs      : 0 if successful, -1 if failure
+int copyBlock(const MEMORY_ENTRY *from, uint32_t fromBlock, DEVICE_OBJ *to, uint32_t toBlock) {
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    DEVICE_OBJ *dev = &devices[checkId(from->device)];
+    uint16_t sec = toBlock / to->numBlocks;
+    uint16_t block = toBlock % to->numBlocks;
+    int ret = 0;
+
+    lockBuses(from->device, to->id);
+    if(lcloud_readcache(from->device, from->sec, fromBlock, blk) == -1) {
+        client_lcloud_bus_request(create_lcloud_registers(0,0,LC_BLOCK_XFER,from->device,LC_XFER_READ,from->sec,fromBlock),blk);
+    }
+    if(writeBlock(to->id, sec, block, blk) == -1) {
+        ret = -1;
+    }
+    else {
+        lcloud_putcache(to->id, sec, block, blk);
+    }
+    unlockBuses(from->device, to->id);
 
+    to->table[sec][block].spaceUsed = dev->table[from->sec][fromBlock].spaceUsed;
+    return ret;
 }
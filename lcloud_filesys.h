@@ -19,11 +19,18 @@
 
 // Type definitions
 typedef int32_t LcFHandle;
+typedef int32_t LcRequestId;
+
+/* Called on a filesystem thread when an asynchronous request finishes, with
+   the bytes read or written or -1. It may start other requests and use the
+   other calls, but not lcshutdown (which fails there), and should not wait
+   long: the thread runs no other request meanwhile. */
+typedef void (*LcCompletion)( LcRequestId req, int result, void *arg );
 
 // File system interface definitions
 
 LcFHandle lcopen( const char *path );
-    // Open the file for for reading and writing
+    // Open the file for for reading and writing, creating it if it does not exist
 
 int lcread( LcFHandle fh, char *buf, size_t len );
     // Read data from the file hande
@@ -32,14 +39,44 @@ int lcwrite( LcFHandle fh, char *buf, size_t len );
     // Write data to the file
 
 int lcseek( LcFHandle fh, size_t off );
-    // Seek to a specific place in the file
+    // Seek to a specific place in the file, past the end leaves a hole for the next write
+
+int lcfallocate( LcFHandle fh, size_t off, size_t len );
+    // Set aside blocks for a range of the file, growing it to the end of the range
+
+int lctruncate( LcFHandle fh, size_t len );
+    // Set the length of the file, freeing the blocks past a shorter end
+
+int lcflush( LcFHandle fh );
+    // Write the file's cached (write back) blocks and the filesystem metadata to the devices
 
 int lcclose( LcFHandle fh );
     // Close the file
 
+int lcdefrag( LcFHandle fh );
+    // Move the file's blocks into as few runs on one device as will fit
+
 int lcshutdown( void );
     // Shut down the filesystem
 
+/* Asynchronous requests run the same reads and writes as lcread and lcwrite,
+   each on one of a few filesystem threads (LC_ASYNC_THREADS). They overlap
+   with the caller and with each other only as far as the file and device
+   locks allow, and the requests of one device still go over its connection
+   one at a time. buf must stay valid until the request is done. */
+
+LcRequestId lcread_async( LcFHandle fh, size_t off, char *buf, size_t len, LcCompletion done, void *arg );
+    // Start reading the file at an offset, done (if not NULL) gets the result
+
+LcRequestId lcwrite_async( LcFHandle fh, size_t off, char *buf, size_t len, LcCompletion done, void *arg );
+    // Start writing the file at an offset, done (if not NULL) gets the result
+
+int lcpoll( LcRequestId req, int *result );
+    // Check an asynchronous request without a callback, 1 and its result once done
+
+int lcwait( LcRequestId req );
+    // Wait for an asynchronous request without a callback, returns its result
+
 LCloudRegisterFrame create_lcloud_registers(uint8_t b0, uint8_t b1, uint8_t c0, uint8_t c1, uint8_t c2, uint16_t d0, uint16_t d1);
     // Make  Register Frame
 
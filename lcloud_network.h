@@ -21,6 +21,7 @@
 #define LCLOUD_NET_HEADER_SIZE sizeof(LCloudRegisterFrame)
 #define LCLOUD_DEFAULT_IP "127.0.0.1"
 #define LCLOUD_DEFAULT_PORT 24567
+#define LC_BUS_MAX_CONNECTIONS 16 // Most connections in the client pool, one per device
 
 // Global data
 
@@ -31,5 +32,20 @@ LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void *buf
 	// This is the implementation of the client operation, as implemented 
 	//  by the 311 student code.
 
+void client_lcloud_bus_post(LCloudRegisterFrame reg, void *buf);
+	// Sends a request without waiting for its response, a block read
+	//  lands in buf by the next wait or request. buf must stay valid
+	//  until then for a block write too.
+
+void client_lcloud_bus_wait(LcDeviceId did);
+	// Reads the responses of every request posted on the connection
+	//  the device uses.
+
+int client_lcloud_bus_channel(LcDeviceId did);
+	// Tells which connection of the pool a device's requests go on.
+
+int client_lcloud_bus_shared(void);
+	// Tells whether several threads can use a connection at once.
+
 
 #endif
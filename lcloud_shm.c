@@ -0,0 +1,266 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_shm.c
+//  Description    : The shared memory transport of the Lion Cloud bus, used
+//                   by the client for LC_BUS_SERVER=shm:<name> and by the
+//                   stand in server in bench. Each ring has one reader and
+//                   one writer. With more than one CPU a side looks at the
+//                   ring for a while before it sleeps, and the other side
+//                   only makes the wake system call if it said it was
+//                   going to sleep.
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+#include <lcloud_shm.h>
+
+// Defines
+#define LC_SHM_SPINS 2000               //Looks at the ring before sleeping, an answer is often about to land
+#define LC_SHM_BYTES (sizeof(LcShmConn) * LC_SHM_CONNECTIONS)
+
+// Global data
+int shmSpins = 0;                       //LC_SHM_SPINS, or none on one CPU where the other side cannot run meanwhile
+
+// Functional Prototypes
+int shmPath(const char *name, char *path, size_t len); //The object's name as shm_open wants it
+void shmSleep(uint32_t *word, uint32_t seen, uint32_t *asleep); //Waits for a futex word to move on
+void shmWake(uint32_t *word, uint32_t *asleep); //Wakes the other side if it is asleep on a word
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_map
+// Description  : Maps a server's shared memory object. The server makes a
+//                new one, zeroed, replacing any an earlier run left behind.
+//
+// Inputs       : name - the object's name (a leading / is added if it
+//                has none), create - non zero to make it
+// Outputs      : the connections, NULL if failure
+LcShmConn *lcloud_shm_map( const char *name, int create ) {
+    char path[NAME_MAX];
+    LcShmConn *conns;
+    int fd;
+
+    if(shmPath(name, path, sizeof(path)) == -1) {
+        return NULL;
+    }
+    shmSpins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? LC_SHM_SPINS : 0;
+    if(create) {
+        shm_unlink(path);
+    }
+    fd = shm_open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if(fd == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not open shared memory %s [%s]",path,strerror(errno));
+        return NULL;
+    }
+    if(create && ftruncate(fd, LC_SHM_BYTES) == -1) {
+        logMessage(LOG_ERROR_LEVEL,"Could not size shared memory %s [%s]",path,strerror(errno));
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+    conns = (LcShmConn *)mmap(NULL, LC_SHM_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(conns == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL,"Could not map shared memory %s [%s]",path,strerror(errno));
+        return NULL;
+    }
+    return( conns );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_unmap
+// Description  : Unmaps a shared memory object
+//
+// Inputs       : conns - the connections
+// Outputs      : none
+void lcloud_shm_unmap( LcShmConn *conns ) {
+    munmap(conns, LC_SHM_BYTES);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_remove
+// Description  : Removes a server's shared memory object. Anything that
+//                has it mapped keeps it until it unmaps it.
+//
+// Inputs       : name - the object's name
+// Outputs      : 0 if successful, -1 if failure
+int lcloud_shm_remove( const char *name ) {
+    char path[NAME_MAX];
+
+    if(shmPath(name, path, sizeof(path)) == -1) {
+        return -1;
+    }
+    return shm_unlink(path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_claim
+// Description  : Claims a free connection. Its rings carry on from where
+//                the last client left them, both empty by then.
+//
+// Inputs       : conns - the connections
+// Outputs      : the connection, NULL if all are in use
+LcShmConn *lcloud_shm_claim( LcShmConn *conns ) {
+    uint32_t free;
+
+    for(int k=0;k<LC_SHM_CONNECTIONS;k++) {
+        free = 0;
+        if(__atomic_compare_exchange_n(&conns[k].claimed, &free, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return &conns[k];
+        }
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_release
+// Description  : Gives a connection back for another client
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+void lcloud_shm_release( LcShmConn *conn ) {
+    __atomic_store_n(&conn->claimed, 0, __ATOMIC_SEQ_CST);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_write
+// Description  : Copies a frame into a ring and then moves head on, so the
+//                reader sees all of it at once. A frame bigger than the
+//                room left is handed over in parts.
+//
+// Inputs       : ring - the ring, iov - the pieces of the frame, cnt - how
+//                many
+// Outputs      : none
+void lcloud_shm_write( LcShmRing *ring, const struct iovec *iov, int cnt ) {
+    uint32_t head = ring->head;                 //Only the writer moves it
+    uint32_t tail;
+    size_t off, n;
+
+    for(int k=0;k<cnt;k++) {
+        for(off=0;off<iov[k].iov_len;off+=n) {
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            if(head - tail == LC_SHM_RING_BYTES) {
+                __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+                shmWake(&ring->head, &ring->readerAsleep);
+                shmSleep(&ring->tail, tail, &ring->writerAsleep);
+                n = 0;
+                continue;
+            }
+            n = CMPSC311_MINVAL(iov[k].iov_len - off, LC_SHM_RING_BYTES - (head - tail));
+            n = CMPSC311_MINVAL(n, LC_SHM_RING_BYTES - head % LC_SHM_RING_BYTES);
+            memcpy(&ring->data[head % LC_SHM_RING_BYTES], (char *)iov[k].iov_base + off, n);
+            head += n;
+        }
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    shmWake(&ring->head, &ring->readerAsleep);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shm_read
+// Description  : Copies bytes out of a ring as they arrive, then moves tail
+//                on so the writer can reuse the room
+//
+// Inputs       : ring - the ring, iov - where the bytes go, cnt - how many
+//                pieces
+// Outputs      : none
+void lcloud_shm_read( LcShmRing *ring, const struct iovec *iov, int cnt ) {
+    uint32_t tail = ring->tail;                 //Only the reader moves it
+    uint32_t head;
+    size_t off, n;
+
+    for(int k=0;k<cnt;k++) {
+        for(off=0;off<iov[k].iov_len;off+=n) {
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if(head == tail) {
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+                shmWake(&ring->tail, &ring->writerAsleep);
+                shmSleep(&ring->head, head, &ring->readerAsleep);
+                n = 0;
+                continue;
+            }
+            n = CMPSC311_MINVAL(iov[k].iov_len - off, head - tail);
+            n = CMPSC311_MINVAL(n, LC_SHM_RING_BYTES - tail % LC_SHM_RING_BYTES);
+            memcpy((char *)iov[k].iov_base + off, &ring->data[tail % LC_SHM_RING_BYTES], n);
+            tail += n;
+        }
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+    shmWake(&ring->tail, &ring->writerAsleep);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shmPath
+// Description  : Puts a / in front of a shared memory object's name if it
+//                has none, as shm_open wants
+//
+// Inputs       : name - the name, path - where the result goes, len - its
+//                size
+// Outputs      : 0 if successful, -1 if the name is too long
+int shmPath(const char *name, char *path, size_t len) {
+    if(snprintf(path, len, "%s%s", (name[0] == '/') ? "" : "/", name) >= (int)len) {
+        logMessage(LOG_ERROR_LEVEL,"Shared memory name too long [%s]",name);
+        return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shmSleep
+// Description  : Waits for a futex word to move on from what was seen,
+//                looking for a while first if there is another CPU for the
+//                other side to run on. The flag is set before the last
+//                look, so a side that moves the word after it sees the
+//                flag and wakes this one.
+//
+// Inputs       : word - the futex word, seen - its value when the ring
+//                was empty or full, asleep - this side's flag
+// Outputs      : none
+void shmSleep(uint32_t *word, uint32_t seen, uint32_t *asleep) {
+    for(int k=0;k<shmSpins;k++) {
+        if(__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) {
+            return;
+        }
+    }
+    __atomic_store_n(asleep, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen) {
+        syscall(SYS_futex, word, FUTEX_WAIT, seen, NULL, NULL, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shmWake
+// Description  : Wakes the other side if it said it was going to sleep on
+//                a word this side just moved on
+//
+// Inputs       : word - the futex word, asleep - the other side's flag
+// Outputs      : none
+void shmWake(uint32_t *word, uint32_t *asleep) {
+    if(__atomic_load_n(asleep, __ATOMIC_SEQ_CST) && __atomic_exchange_n(asleep, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
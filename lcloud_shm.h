@@ -0,0 +1,65 @@
+#ifndef LCLOUD_SHM_INCLUDED
+#define LCLOUD_SHM_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_shm.h
+//  Description    : The shared memory transport of the Lion Cloud bus. A
+//                   server makes a POSIX shared memory object holding a
+//                   pair of byte rings per connection, which carry the same
+//                   frames a socket does. A side with nothing to do sleeps
+//                   on a futex in the ring.
+//
+
+// Includes
+#include <stdint.h>
+#include <sys/uio.h>
+#include <lcloud_network.h>
+
+// Defines
+#define LC_SHM_RING_BYTES 131072 // Bytes each way, a power of two over a full window of frames
+#define LC_SHM_CONNECTIONS LC_BUS_MAX_CONNECTIONS // Connections in one shared memory object
+
+// Type definitions
+
+/* One direction of a connection. head and tail count bytes, wrapping
+   around at 2^32, and are the futex words the two sides sleep on. */
+typedef struct {
+    uint32_t head;          // Bytes written so far, an empty ring's reader sleeps on it
+    uint32_t tail;          // Bytes read so far, a full ring's writer sleeps on it
+    uint32_t readerAsleep;  // Set by the reader before it sleeps, cleared by its wake
+    uint32_t writerAsleep;  // Same for the writer
+    char data[LC_SHM_RING_BYTES];
+} LcShmRing;
+
+/* A connection, one of LC_SHM_CONNECTIONS in the object */
+typedef struct {
+    uint32_t claimed;       // A client is using it
+    LcShmRing requests;     // Client to server
+    LcShmRing answers;      // Server to client
+} LcShmConn;
+
+// Functional Prototypes
+
+LcShmConn *lcloud_shm_map( const char *name, int create );
+    // Maps a server's shared memory object, a new empty one if create is set
+
+void lcloud_shm_unmap( LcShmConn *conns );
+    // Unmaps a shared memory object
+
+int lcloud_shm_remove( const char *name );
+    // Removes a server's shared memory object, clients mapping it keep it
+
+LcShmConn *lcloud_shm_claim( LcShmConn *conns );
+    // Claims a free connection of the object, NULL if all are in use
+
+void lcloud_shm_release( LcShmConn *conn );
+    // Gives a connection back, once nothing is in flight on it
+
+void lcloud_shm_write( LcShmRing *ring, const struct iovec *iov, int cnt );
+    // Writes a frame, waiting for room if the ring is full
+
+void lcloud_shm_read( LcShmRing *ring, const struct iovec *iov, int cnt );
+    // Reads exactly the bytes asked for, waiting for them to arrive
+
+#endif